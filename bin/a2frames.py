@@ -0,0 +1,224 @@
+#!/usr/bin/env python3
+
+# a2frames.py - Part of a2fomu - Copyright (c) 2020-2021 Doug Eaton
+#
+# This file is part of a2fomu which is released under the two clause BSD
+# licence.  See file LICENSE in the project root directory or visit the
+# project at https://github.com/elecbrick/a2fomu for full license details.
+
+import sys, os, getopt, struct, zlib
+
+# Decode the Lo-Res and Hi-Res frames sent on the A2Fomu Video interface, the
+# third CDC port (eg. /dev/ttyACM2), into numbered PPM or PNG images. The
+# input is either the port itself, which is asked for a key frame, or a
+# capture of it. Frames are as written by graphics.c:
+#   0xA2 'G' flags sequence, then tokens covering the visible bytes of a page
+#   0x00-0x3F  n+1 unchanged blocks of 8 bytes
+#   0x40-0x7F  n-0x3F bytes follow, each XORed into the previous frame
+#   0x80-0xFF  the following byte is XORed into the next n-0x7E bytes
+# Only graphics are sent. In mixed mode the four text lines at the bottom are
+# left black as the TTY shows them.
+
+# Must match enum graphics_flags in graphics.h
+HIRES, PAGE2, MIXED, KEY = 1, 2, 4, 8
+HIRES_BYTES, LORES_BYTES = 7680, 960
+WIDTH, HEIGHT = 280, 192
+
+BLACK, WHITE = (0, 0, 0), (255, 255, 255)
+# Hi-Res colours of a lone pixel by column parity and the palette bit
+HIRES_COLOURS = [[(255, 68, 253), (20, 245, 60)],      # Violet, green
+                 [(20, 207, 253), (255, 106, 60)]]     # Blue, orange
+LORES_COLOURS = [
+    (0, 0, 0), (227, 30, 96), (96, 78, 189), (255, 68, 253),
+    (0, 163, 96), (156, 156, 156), (20, 207, 253), (208, 195, 255),
+    (96, 114, 3), (255, 106, 60), (156, 156, 156), (255, 160, 208),
+    (20, 245, 60), (208, 221, 141), (114, 255, 208), (255, 255, 255)]
+
+# Offset in the frame of a byte of the page: the 8 byte screen hole at the end
+# of each 128 is not sent.
+def visible(offset):
+    return (offset >> 7) * 120 + (offset & 127)
+
+def hires_line(y):
+    return visible((y & 7) << 10 | (y >> 3 & 7) << 7 | (y >> 6) * 40)
+
+def text_row(row):
+    return visible((row & 7) << 7 | (row >> 3) * 40)
+
+def render_hires(view, lines, mono):
+    rows = []
+    for y in range(lines):
+        base = hires_line(y)
+        bits, palette = [], []
+        for x in range(40):
+            byte = view[base + x]
+            for bit in range(7):
+                bits.append(byte >> bit & 1)
+                palette.append(byte >> 7)
+        row = []
+        for x in range(WIDTH):
+            if not bits[x]:
+                row.append(BLACK)
+            elif mono or (x > 0 and bits[x - 1]) or \
+                    (x < WIDTH - 1 and bits[x + 1]):
+                row.append(WHITE)
+            else:
+                row.append(HIRES_COLOURS[palette[x]][x & 1])
+        rows.append(row)
+    return rows
+
+def render_lores(view, lines):
+    rows = []
+    for y in range(lines):
+        base = text_row(y >> 3)
+        shift = 4 if y & 4 else 0
+        row = []
+        for x in range(40):
+            row += [LORES_COLOURS[view[base + x] >> shift & 15]] * 7
+        rows.append(row)
+    return rows
+
+def render(view, flags, mono):
+    lines = 160 if flags & MIXED else HEIGHT
+    if flags & HIRES:
+        rows = render_hires(view, lines, mono)
+    else:
+        rows = render_lores(view, lines)
+    return rows + [[BLACK] * WIDTH] * (HEIGHT - lines)
+
+def write_ppm(name, rows):
+    with open(name, 'wb') as f:
+        f.write(b'P6\n%d %d\n255\n' % (WIDTH, HEIGHT))
+        for row in rows:
+            f.write(bytes(c for pixel in row for c in pixel))
+
+def write_png(name, rows):
+    def chunk(kind, data):
+        return struct.pack('>I', len(data)) + kind + data + \
+            struct.pack('>I', zlib.crc32(kind + data))
+    raw = b''.join(b'\0' + bytes(c for pixel in row for c in pixel)
+                   for row in rows)
+    with open(name, 'wb') as f:
+        f.write(b'\x89PNG\r\n\x1a\n')
+        f.write(chunk(b'IHDR', struct.pack('>IIBBBBB', WIDTH, HEIGHT,
+                                           8, 2, 0, 0, 0)))
+        f.write(chunk(b'IDAT', zlib.compress(raw)))
+        f.write(chunk(b'IEND', b''))
+
+class Stream:
+    def __init__(self, f):
+        self.f = f
+        self.buf = b''
+        self.pos = 0
+    def byte(self):
+        if self.pos == len(self.buf):
+            # A port returns what has arrived rather than waiting for more
+            self.buf = self.f.read(4096)
+            self.pos = 0
+            if not self.buf:
+                raise EOFError
+        self.pos += 1
+        return self.buf[self.pos - 1]
+
+# Skip to the next header, of a key frame until the first has been seen.
+def sync(s, keyed):
+    while True:
+        if s.byte() != 0xA2:
+            continue
+        if s.byte() != ord('G'):
+            continue
+        flags = s.byte()
+        if keyed or flags & KEY:
+            return flags, s.byte()
+
+def frames(s):
+    view = bytearray(HIRES_BYTES)
+    keyed = False
+    while True:
+        flags, sequence = sync(s, keyed)
+        keyed = True
+        if flags & KEY:
+            view = bytearray(HIRES_BYTES)
+        size = HIRES_BYTES if flags & HIRES else LORES_BYTES
+        pos = 0
+        while pos < size:
+            t = s.byte()
+            if t < 0x40:
+                pos += 8 * (t + 1)
+            elif t < 0x80:
+                for i in range(t - 0x3f):
+                    view[pos + i] ^= s.byte()
+                pos += t - 0x3f
+            else:
+                b = s.byte()
+                for i in range(t - 0x7e):
+                    view[pos + i] ^= b
+                pos += t - 0x7e
+            if pos > size:
+                # Lost bytes; wait for a key frame
+                print('a2frames.py: bad frame %d' % sequence, file=sys.stderr)
+                keyed = False
+                break
+        else:
+            yield flags, sequence, view
+
+def open_input(name):
+    f = open(name, 'r+b', buffering=0) if os.path.exists(name) and \
+        not os.path.isfile(name) else open(name, 'rb')
+    if f.isatty():
+        import tty
+        tty.setraw(f.fileno())
+        # Any byte asks for a key frame
+        f.write(b'K')
+    return f
+
+def usage(out):
+    print('Usage: a2frames.py [-p] [-m] [-n <count>] [-o <prefix>] <port|capture>',
+          file=out)
+
+def main(argv):
+    prefix = 'frame'
+    png = mono = False
+    count = None
+    try:
+        opts, args = getopt.getopt(argv, "hpmn:o:",
+                                   ["help", "png", "mono", "count=", "ofile="])
+    except getopt.GetoptError:
+        usage(sys.stderr)
+        sys.exit(2)
+    for opt, arg in opts:
+        if opt in ('-h', '--help'):
+            usage(sys.stdout)
+            print('    -p  --png             write PNG rather than PPM')
+            print('    -m  --mono            Hi-Res in monochrome')
+            print('    -n  --count=<n>       stop after n frames')
+            print('    -o  --ofile=<prefix>  output files (default frame)')
+            sys.exit()
+        elif opt in ('-p', '--png'):
+            png = True
+        elif opt in ('-m', '--mono'):
+            mono = True
+        elif opt in ('-n', '--count'):
+            count = int(arg)
+        elif opt in ('-o', '--ofile'):
+            prefix = arg
+    if len(args) != 1:
+        usage(sys.stderr)
+        sys.exit(2)
+    written = 0
+    try:
+        for flags, sequence, view in frames(Stream(open_input(args[0]))):
+            rows = render(view, flags, mono)
+            if png:
+                write_png('%s%05d.png' % (prefix, written), rows)
+            else:
+                write_ppm('%s%05d.ppm' % (prefix, written), rows)
+            written += 1
+            if count is not None and written >= count:
+                break
+    except (EOFError, KeyboardInterrupt):
+        pass
+    print('a2frames.py: %d frames' % written, file=sys.stderr)
+
+if __name__ == "__main__":
+    main(sys.argv[1:])
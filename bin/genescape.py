@@ -0,0 +1,185 @@
+#!/usr/bin/env python3
+
+# genescape.py - Part of a2fomu - Copyright (c) 2020-2021 Doug Eaton
+#
+# This file is part of a2fomu which is released under the two clause BSD
+# licence.  See file LICENSE in the project root directory or visit the
+# project at https://github.com/elecbrick/a2fomu for full license details.
+
+import sys, getopt
+
+# Generate the tables used by escape.c to turn what a VT100 or xterm sends for
+# each key into what the Apple II expects. The sequences below are made into a
+# trie and sequences that end the same way, such as ESC [ A and ESC O A, share
+# their states. Input bytes that have the same effect in every state share a
+# column, so the transition table is states by columns rather than by 128.
+#
+# Table entries, as decoded by escape_key():
+#   0          not a known sequence; the bytes go to the Apple as typed
+#   1-0x7F     next state, the sequence is not yet complete
+#   0x80+n     complete: action n, the keys to send or a command
+
+ACTION = 0x80
+# Longest sequence, must match ESCAPE_MAX in escape.h
+ESCAPE_MAX = 8
+
+# Commands for tty_task, from enum escape_command in escape.h
+RESET = ('escape_apple_reset',)
+REDRAW = ('escape_redraw',)
+def function(n):
+    return ('escape_function+%d' % n,)
+
+def keys():
+    seq = {
+        '\0':    RESET,             # NUL
+        '\x12':  RESET,             # Control-R
+        '\b':    '\x88',            # Backspace becomes Left Arrow
+        '\x7f':  '\x88',            # Delete becomes Left Arrow
+        '\f':    REDRAW,            # Control-L
+    }
+    # Application and normal mode are treated the same
+    final = {
+        'A': '\033D',               # Up Arrow, Apple ESC editing code
+        'B': '\033C',               # Down Arrow
+        'C': '\x95',                # Right Arrow, ^U
+        'D': '\x88',                # Left Arrow, ^H
+        'M': '\r',                  # Keypad Enter
+        'X': '=',                   # Keypad Equal
+    }
+    for n, c in enumerate('PQRS'):
+        final[c] = function(n + 1)
+    for c, key in zip('jklmnopqrstuvwxy', '*+,-./0123456789'):
+        final[c] = key              # Keypad digits and symbols
+    # Editing and function keys ESC [ n ~
+    tilde = {
+        1: '\033@',                 # Home
+        2: '\033F',                 # Insert
+        3: '\x88',                  # Delete becomes Left Arrow
+        4: '\033E',                 # End
+        5: '\033I',                 # Page Up
+        6: '\033M',                 # Page Down
+        15: function(5),
+        17: function(6), 18: function(7), 19: function(8), 20: function(9),
+        21: function(10),
+        23: function(11), 24: function(12),
+    }
+    for intro in '[O':
+        for c, key in final.items():
+            seq['\033' + intro + c] = key
+        for n, key in tilde.items():
+            seq['\033' + intro + str(n) + '~'] = key
+    return seq
+
+# Trie of the sequences: a node is a dict from byte to node or to an action.
+def trie(seq):
+    root = {}
+    for s, key in seq.items():
+        node = root
+        for c in s[:-1]:
+            node = node.setdefault(ord(c), {})
+            if not isinstance(node, dict):
+                raise ValueError('%r extends a shorter sequence' % s)
+        if ord(s[-1]) in node:
+            raise ValueError('%r is a prefix of another sequence' % s)
+        node[ord(s[-1])] = key
+    return root
+
+# Number the states and actions, sharing those of identical subtrees.
+def number(node, states, actions, rows):
+    row = {}
+    for c, next in node.items():
+        if isinstance(next, dict):
+            row[c] = number(next, states, actions, rows)
+        else:
+            row[c] = ACTION + actions.setdefault(next, len(actions))
+    signature = tuple(sorted(row.items()))
+    if signature not in states:
+        states[signature] = len(rows)
+        rows.append(row)
+    return states[signature]
+
+def depth(node):
+    return 1 + max(depth(n) if isinstance(n, dict) else 0
+                   for n in node.values())
+
+def c_key(c):
+    n = ord(c)
+    return "'%s'" % c if 0x20 <= n < 0x7f and c not in "\\'" else '0x%02X' % n
+
+def c_action(key):
+    if isinstance(key, tuple):
+        return '{0, %s}' % key[0]
+    if len(key) > 2:
+        raise ValueError('%r: at most two keys' % key)
+    return '{%s}' % ', '.join(c_key(c) for c in key)
+
+def generate(out):
+    root = trie(keys())
+    if depth(root) > ESCAPE_MAX:
+        raise ValueError('sequences longer than ESCAPE_MAX')
+    states, actions, rows = {}, {}, []
+    number(root, states, actions, rows)
+    # The idle state, the root, is numbered last; make it state 0
+    rows.insert(0, rows.pop())
+    remap = {len(rows) - 1: 0}
+    remap.update({s: s + 1 for s in range(len(rows) - 1)})
+    rows = [{c: remap[n] if n < ACTION else n for c, n in row.items()}
+            for row in rows]
+    if len(rows) >= ACTION or len(actions) > 0x100 - ACTION:
+        raise ValueError('too many states or actions')
+    # Bytes that behave alike in every state share a column. Column 0 is the
+    # one that matches nothing, which is where bytes above 0x7F go.
+    columns = {tuple([0] * len(rows)): 0}
+    byte_class = []
+    for c in range(128):
+        column = tuple(row.get(c, 0) for row in rows)
+        byte_class.append(columns.setdefault(column, len(columns)))
+    table = [[0] * len(columns) for row in rows]
+    for column, n in columns.items():
+        for s, next in enumerate(column):
+            table[s][n] = next
+
+    w = out.write
+    w('// escape_table.h - generated by bin/genescape.py, do not edit\n\n')
+    w('#define ESCAPE_STATES  %d\n' % len(rows))
+    w('#define ESCAPE_CLASSES %d\n' % len(columns))
+    w('#define ESCAPE_ACTION  0x%02X\n\n' % ACTION)
+    w('// Column of the transition table for each input byte.\n')
+    w('static const uint8_t escape_class[128] = {\n')
+    for i in range(0, 128, 16):
+        w('  %s,\n' % ', '.join('%2d' % n for n in byte_class[i:i+16]))
+    w('};\n\n')
+    w('static const uint8_t escape_next[ESCAPE_STATES][ESCAPE_CLASSES] = {\n')
+    for row in table:
+        lines = [', '.join('0x%02X' % n for n in row[i:i+12])
+                 for i in range(0, len(row), 12)]
+        w('  {%s},\n' % ',\n   '.join(lines))
+    w('};\n\n')
+    w('// Keys sent to the Apple, or 0 and a command for tty_task.\n')
+    w('static const uint8_t escape_action[%d][2] = {\n' % len(actions))
+    for key, n in sorted(actions.items(), key=lambda a: a[1]):
+        w('  %s,\n' % c_action(key))
+    w('};\n')
+
+def main(argv):
+    outfile = None
+    try:
+        opts, args = getopt.getopt(argv, "ho:", ["help", "ofile="])
+    except getopt.GetoptError:
+        print('Usage: genescape.py -o <file>', file=sys.stderr)
+        sys.exit(2)
+    for opt, arg in opts:
+        if opt in ('-h', '--help'):
+            print('Usage: genescape.py -o <file>')
+            print('    -o  --ofile=<file>  output file (default stdout)')
+            sys.exit()
+        elif opt in ('-o', '--ofile'):
+            outfile = arg
+    if outfile:
+        with open(outfile, 'w') as out:
+            generate(out)
+    else:
+        generate(sys.stdout)
+
+if __name__ == "__main__":
+    main(sys.argv[1:])
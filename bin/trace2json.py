@@ -0,0 +1,116 @@
+#!/usr/bin/env python3
+
+# trace2json.py - Part of a2fomu - Copyright (c) 2020-2021 Doug Eaton
+#
+# This file is part of a2fomu which is released under the two clause BSD
+# licence.  See file LICENSE in the project root directory or visit the
+# project at https://github.com/elecbrick/a2fomu for full license details.
+
+import sys, getopt, json
+
+# Convert the output of the CLI "trace" command into Chrome trace JSON that
+# can be opened in chrome://tracing or https://ui.perfetto.dev. The input is
+# a capture of the tty, such as a terminal log, containing a block of lines
+# between "trace <count>" and "end", each an event as written by trace.c:
+#   tttttttt ty id aaaa   mcycle timestamp, type, identifier, argument
+
+# Must match enum task_num in a2fomu.h and enum trace_type in trace.h
+tasks = ['USB', 'TTY', 'LED', 'Touch', 'CLI', 'Keybd', 'Video', 'Disk', 'Feed',
+         'Gfx']
+flash_states = ['user mode', 'erase track', 'write sector', 'verify track']
+usb_kinds = ['cdc tx', 'cdc rx', 'msc read', 'msc write']
+TASK_ENTER, TASK_EXIT, ISR_ENTER, ISR_EXIT = 1, 2, 3, 4
+SECTOR_START, SECTOR_END, FLASH_STATE, USB = 5, 6, 7, 8
+
+def read_events(lines):
+    events = None
+    for line in lines:
+        line = line.strip()
+        if line.startswith('trace '):
+            events = []
+        elif line == 'end' and events is not None:
+            return events
+        elif events is not None and len(line) == 16:
+            events.append((int(line[0:8], 16), int(line[8:10], 16),
+                           int(line[10:12], 16), int(line[12:16], 16)))
+    return events
+
+def name(table, n):
+    return table[n] if n < len(table) else str(n)
+
+# Timeline rows: one per task followed by the other sources
+ISR_ROW, DRIVE_ROW, FLASH_ROW, USB_ROW = 100, 101, 103, 104
+
+def convert(events, mhz):
+    trace = []
+    rows = {}
+    base = events[0][0]
+    high = 0
+    last = base
+    for time, kind, ident, arg in events:
+        # Timestamps are the low 32 bits of mcycle and wrap every few minutes
+        if time < last:
+            high += 1 << 32
+        last = time
+        event = {'pid': 0, 'ts': (time + high - base) / mhz}
+        if kind in (TASK_ENTER, TASK_EXIT):
+            event.update(name=name(tasks, ident), tid=ident,
+                         ph='B' if kind == TASK_ENTER else 'E')
+            rows[ident] = name(tasks, ident)
+        elif kind in (ISR_ENTER, ISR_EXIT):
+            event.update(name='ISR', tid=ISR_ROW,
+                         ph='B' if kind == ISR_ENTER else 'E')
+            rows[ISR_ROW] = 'ISR'
+            if kind == ISR_ENTER:
+                event['args'] = {'irqs': arg}
+        elif kind in (SECTOR_START, SECTOR_END):
+            event.update(name='T{:d} S{:d}'.format(arg >> 8, arg & 0xff),
+                         tid=DRIVE_ROW + ident,
+                         ph='B' if kind == SECTOR_START else 'E')
+            rows[DRIVE_ROW + ident] = 'Drive {:d}'.format(ident + 1)
+        elif kind == FLASH_STATE:
+            event.update(name=name(flash_states, ident), tid=FLASH_ROW,
+                         ph='i', s='t')
+            rows[FLASH_ROW] = 'Flash'
+        elif kind == USB:
+            event.update(name=name(usb_kinds, ident), tid=USB_ROW,
+                         ph='i', s='t', args={'bytes': arg})
+            rows[USB_ROW] = 'USB transfers'
+        else:
+            continue
+        trace.append(event)
+    for tid, row in rows.items():
+        trace.append({'pid': 0, 'tid': tid, 'ph': 'M', 'name': 'thread_name',
+                      'args': {'name': row}})
+    return {'traceEvents': trace, 'displayTimeUnit': 'ns'}
+
+def main(argv):
+    mhz = 12.0
+    outfile = None
+    try:
+        opts, args = getopt.getopt(argv, "hc:o:", ["help", "clock=", "ofile="])
+    except getopt.GetoptError:
+        print('Usage: trace2json.py [-c <MHz>] [-o <file>] [<capture>]',
+              file=sys.stderr)
+        sys.exit(2)
+    for opt, arg in opts:
+        if opt in ('-h', '--help'):
+            print('Usage: trace2json.py [-c <MHz>] [-o <file>] [<capture>]')
+            print('    -c  --clock=<MHz>     processor clock (default 12)')
+            print('    -o  --ofile=<file>    output file (default stdout)')
+            sys.exit()
+        elif opt in ('-c', '--clock'):
+            mhz = float(arg)
+        elif opt in ('-o', '--ofile'):
+            outfile = arg
+    inp = open(args[0], errors='replace') if args else sys.stdin
+    events = read_events(inp)
+    if not events:
+        print('trace2json.py: no trace found in input', file=sys.stderr)
+        sys.exit(1)
+    outp = open(outfile, 'w') if outfile else sys.stdout
+    json.dump(convert(events, mhz), outp)
+    outp.write('\n')
+
+if __name__ == "__main__":
+    main(sys.argv[1:])
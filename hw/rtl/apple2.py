@@ -5,7 +5,7 @@
 # licence.  See file LICENSE in the project root directory or visit the
 # project at https://github.com/elecbrick/a2fomu for full license details.
 
-from migen import Module, Signal, If, ResetSignal, ClockSignal, Instance, Cat
+from migen import Module, Signal, If, ResetSignal, ClockSignal, Instance, Cat, Case, Mux
 from litex.soc.interconnect.csr import CSR, AutoCSR, CSRStatus, CSRStorage, CSRField
 from litex.soc.integration.doc import ModuleDoc
 from migen.genlib import fifo
@@ -33,6 +33,8 @@ class Apple2(Module, AutoCSR):
         clk_en = Signal()       # Clock divider limits CPU activity
         active = Signal()       # CPU is active this cycle
         available = Signal()    # Key press ready for reading
+        key_pop = Signal()      # Keyboard strobe cleared: next key
+        last_key = Signal(7)    # Shown at $C000 once the FIFO is empty
         div1M=4
         idlecount = Signal(div1M)   # Counter to slow CPU clock
 
@@ -46,6 +48,12 @@ class Apple2(Module, AutoCSR):
         disk_data_wanted    = Signal()     # Data wanted by DOS
         disk_read    = Signal()     # Data read by DOS so clear readable
 
+        # Display soft switches
+        gr_graphics  = Signal()     # Graphics rather than text
+        gr_mixed     = Signal()     # Text on the last four lines
+        gr_page2     = Signal()     # Show page 2
+        gr_hires     = Signal()     # High rather than low resolution
+
         simulation = getenv("SIMULATION")
         synthesis = not simulation
 
@@ -54,6 +62,12 @@ class Apple2(Module, AutoCSR):
             CSRField("Reset", reset=1 if synthesis else 0,  # auto-start in sim
                 description="6502 Reset line - 1: Reset Asserted, 0: Running"),
             CSRField("RWROM", size=1, description="Allow writes to ROM"),
+            CSRField("Lossy", size=1,
+                description="Drop screen writes when the FIFO is full rather " +
+                "than pausing the 6502. Dirty rows show what to redraw."),
+            CSRField("Batch", size=1,
+                description="Gather screen writes into runs read through " +
+                "the run and runchars registers instead of screen."),
             #CSRField("Pause", description="Halt processor allowing stepping"),
             #CSRField("Step",  description="Single step 6502 one clock cycle"),
             #CSRField("NMI", size=1, description="Non-maskable interrupt"),
@@ -65,8 +79,12 @@ class Apple2(Module, AutoCSR):
             #CSRField("DI", size=8, offset=16, description=""),
         ])
         self.keyboard=CSRStorage(8, write_from_dev=True,
-                description="Keyboard input ($C000)")
+                description="Keyboard input ($C000), each write queued")
         self.strobe=CSR(1) #, description="Keyboard strobe ($C010)")
+        self.keyfifo=CSRStatus(fields=[
+            CSRField("Room", size=5,
+                description="Keys that can be written before the queue is full"),
+            ], description="Keyboard queue behind $C000/$C010")
         self.screen=CSRStatus(fields=[
             CSRField("Character", size=8,
                 description="Character written to screen"),
@@ -87,6 +105,48 @@ class Apple2(Module, AutoCSR):
             CSRField("Vertical", size=5, offset=24,
                 description="Location of current character in screen memory"),
             ], description="Video Display Output")
+        self.run=CSRStatus(fields=[
+            CSRField("Character", size=8,
+                description="First character of the run"),
+            CSRField("Valid", size=1,
+                description="Run holds at least one character"),
+            CSRField("More", size=1,
+                description="Further writes are waiting in the FIFO"),
+            CSRField("Repeat", size=1, offset=11,
+                description="As for screen, for the first character"),
+            CSRField("ScrollStart", size=1, offset=12,
+                description="As for screen, for the first character"),
+            CSRField("ScrollEnd", size=1, offset=13,
+                description="As for screen, for the first character"),
+            CSRField("Horizontal", size=6, offset=16,
+                description="Location of the first character"),
+            CSRField("Vertical", size=5, offset=24,
+                description="Location of the first character"),
+            CSRField("Count", size=3, offset=29,
+                description="Characters in the run, 0-4"),
+            ], description="Screen writes to consecutive columns of one " +
+                "row, up to four. Reading takes the run and starts the next.")
+        self.runchars=CSRStatus(fields=[
+            CSRField("Characters", size=24,
+                description="Second, third and fourth characters of the " +
+                "run last read, from the lowest byte"),
+            ], description="Rest of the screen write run")
+        self.dirty=CSRStatus(fields=[
+            CSRField("Rows", size=24,
+                description="Rows written since last read, bit n for row n"),
+            CSRField("Lost", size=1, offset=31,
+                description="A screen write was dropped as the FIFO was full"),
+            ], description="Text page ($0400-$07FF) changes, cleared on read")
+        self.display=CSRStatus(fields=[
+            CSRField("Graphics", size=1,
+                description="Graphics ($C050) rather than text ($C051)"),
+            CSRField("Mixed", size=1,
+                description="Four lines of text below graphics ($C053/$C052)"),
+            CSRField("Page2", size=1,
+                description="Second display page ($C055/$C054)"),
+            CSRField("HiRes", size=1,
+                description="High ($C057) rather than low ($C056) resolution"),
+            ], description="Display mode soft switches ($C050-$C057)")
         self.diskctrl=CSRStatus(fields=[
             CSRField("Phase", size=4,
                 description="Four phases of the track selection stepper motor"),
@@ -127,12 +187,29 @@ class Apple2(Module, AutoCSR):
 
             # TODO eliminate wire [31:0] apple2_display_fifo_wrport_dat_r
             self.submodules.display_fifo= fifo.SyncFIFOBuffered(width=32, depth=256)
+            # Keys typed ahead, such as a paste. $C000 shows the oldest and an
+            # access to $C010 discards it, bringing up the next.
+            key_depth = 16
+            self.submodules.key_fifo = fifo.SyncFIFOBuffered(width=7,
+                depth=key_depth)
 
             self.comb += [
                 mem.addr6502.eq(addr),
                 mem.din6502.eq(dout),
                 mem.wren6502.eq(wren),
                 self.strobe.w.eq(available),
+                available.eq(self.key_fifo.readable),
+                self.key_fifo.din.eq(self.keyboard.storage[0:7]),
+                self.key_fifo.we.eq(self.keyboard.re),
+                self.key_fifo.re.eq(key_pop),
+                self.keyfifo.fields.Room.eq(key_depth-self.key_fifo.level),
+                # KBDSTRB: any read or write clears the pending key, once for
+                # each 6502 cycle rather than each system clock
+                key_pop.eq(iosel & active & (addr[4:8]==0x1) & available),
+                self.display.fields.Graphics.eq(gr_graphics),
+                self.display.fields.Mixed.eq(gr_mixed),
+                self.display.fields.Page2.eq(gr_page2),
+                self.display.fields.HiRes.eq(gr_hires),
                 #self.bus.fields.Addr.eq(addr),
                 #self.bus.fields.Data.eq(dout),
                 #self.bus.fields.WrEn.eq(wren),
@@ -151,7 +228,8 @@ class Apple2(Module, AutoCSR):
                 ).Else(
                     # I/O Read Address Decoder (reading but not from memory)
                     If(ior_addr[4:8]==0x0,
-                        din.eq(Cat(self.keyboard.storage[0:7], available)),
+                        din.eq(Cat(Mux(available, self.key_fifo.dout, last_key),
+                            available)),
                     ),
                     # Disk II Controller Card in slot 6  (0x8 | 0x6)
                     # The only data to be read are locations C and D. Simplify the
@@ -174,7 +252,8 @@ class Apple2(Module, AutoCSR):
                         #),
                     ),
                 ),
-                active.eq(clk_en & self.display_fifo.writable),
+                active.eq(clk_en & (self.display_fifo.writable |
+                    self.control.fields.Lossy)),
             ]
 
             self.sync += [
@@ -191,17 +270,21 @@ class Apple2(Module, AutoCSR):
                     r_memsel.eq(w_memsel),
                     ior_addr.eq(addr[0:8]),
                 ),
-                # Keyboard key available when written by host
-                If(self.keyboard.re,
-                    available.eq(1),
+                If(key_pop,
+                    last_key.eq(self.key_fifo.dout),
                 ),
                 If(iosel,
                     # I/O Write Address Decoder
-                    If(addr[4:8]==0x1,
-                        # KBDSTRB
-                        # Strobe cleared on read or write to KBDSTRB
-                        # Any read or write to this address clears the pending key
-                        available.eq(0),
+                    # Display soft switches in pairs: any access to the odd
+                    # address selects text, mixed, page 2 or Hi-Res and to the
+                    # even one graphics, full screen, page 1 or Lo-Res.
+                    If(active & (addr[3:8]==0xA),
+                        Case(addr[1:3], {
+                            0: gr_graphics.eq(~addr[0]),
+                            1: gr_mixed.eq(addr[0]),
+                            2: gr_page2.eq(addr[0]),
+                            3: gr_hires.eq(addr[0]),
+                        }),
                     ),
                 ),
 
@@ -360,6 +443,20 @@ class Apple2(Module, AutoCSR):
 
             fifo_out = Signal(32)
 
+            # Screen write run being gathered from the FIFO
+            run_count = Signal(3)
+            run_first = Signal(32)
+            run_chars = Signal(24)
+            run_next = Signal(6)        # Column the next character must be in
+            run_take = Signal()         # Move the FIFO head into the run
+            run_chars_read = Signal(24)
+
+            # Rows of the text page written since the dirty register was read
+            dirty_rows = Signal(24)
+            dirty_set = Signal(24)
+            dirty_lost = Signal()
+            fifo_drop = Signal()
+
             self.comb += [
                 # Detect access to frame memory: Address range 0x0400-0x7ff
                 fbsel.eq((addr[10:15]==0x1) & active),
@@ -452,8 +549,7 @@ class Apple2(Module, AutoCSR):
                         ~push_save),
 
                 # Retrieve characters from fifo
-                self.display_fifo.re.eq(self.screen.we),
-                self.screen.we.eq(self.display_fifo.re),
+                self.display_fifo.re.eq(self.screen.we | run_take),
                 self.screen.fields.Valid.eq(self.display_fifo.readable),
                 self.screen.fields.More.eq(self.display_fifo.readable),
                 self.screen.fields.Character.eq(fifo_out[0:8]),
@@ -463,10 +559,65 @@ class Apple2(Module, AutoCSR):
                 self.screen.fields.Repeat.eq(fifo_out[11]),
                 self.screen.fields.ScrollStart.eq(fifo_out[12]),
                 self.screen.fields.ScrollEnd.eq(fifo_out[13]),
+
+                # Mark the row of every visible write. The holes at horizontal
+                # 40-47 of each segment are not part of any row.
+                If(fb_w & (horiz<40),
+                    Case(vert, {row: dirty_set.eq(1<<row) for row in range(24)}),
+                ),
+                fifo_drop.eq(self.display_fifo.we & ~self.display_fifo.writable),
+                self.dirty.fields.Rows.eq(dirty_rows),
+                self.dirty.fields.Lost.eq(dirty_lost),
+
+                # A run starts with any write and is extended by writes to the
+                # next column of the same row with no flags. Nothing is moved
+                # in the cycle the run is read so the count read is exact.
+                If(self.control.fields.Batch & self.display_fifo.readable &
+                        ~self.run.we,
+                    If(run_count==0,
+                        run_take.eq(1),
+                    ).Elif((run_count!=4) & (run_first[11:14]==0) &
+                            (self.display_fifo.dout[11:14]==0) &
+                            (self.display_fifo.dout[24:29]==run_first[24:29]) &
+                            (self.display_fifo.dout[16:22]==run_next),
+                        run_take.eq(1),
+                    ),
+                ),
+                self.run.fields.Character.eq(run_first[0:8]),
+                self.run.fields.Valid.eq(run_count!=0),
+                self.run.fields.More.eq(self.display_fifo.readable),
+                self.run.fields.Repeat.eq(run_first[11]),
+                self.run.fields.ScrollStart.eq(run_first[12]),
+                self.run.fields.ScrollEnd.eq(run_first[13]),
+                self.run.fields.Horizontal.eq(run_first[16:22]),
+                self.run.fields.Vertical.eq(run_first[24:29]),
+                self.run.fields.Count.eq(run_count),
+                self.runchars.fields.Characters.eq(run_chars_read),
             ]
 
             self.sync += [
                 fifo_out.eq(self.display_fifo.dout),
+                If(self.run.we,
+                    run_count.eq(0),
+                    run_chars_read.eq(run_chars),
+                ).Elif(run_take,
+                    run_count.eq(run_count+1),
+                    run_next.eq(self.display_fifo.dout[16:22]+1),
+                    Case(run_count, {
+                        0: run_first.eq(self.display_fifo.dout),
+                        1: run_chars[0:8].eq(self.display_fifo.dout[0:8]),
+                        2: run_chars[8:16].eq(self.display_fifo.dout[0:8]),
+                        3: run_chars[16:24].eq(self.display_fifo.dout[0:8]),
+                    }),
+                ),
+                # Reading clears the register but keeps a write in that cycle
+                If(self.dirty.we,
+                    dirty_rows.eq(dirty_set),
+                    dirty_lost.eq(fifo_drop),
+                ).Else(
+                    dirty_rows.eq(dirty_rows | dirty_set),
+                    dirty_lost.eq(dirty_lost | fifo_drop),
+                ),
 
                 # Scroll
                 If(scroll_start,
@@ -0,0 +1,1035 @@
+//
+// bench.c - Part of a2fomu - Copyright (c) 2020-2021 Doug Eaton
+//
+// This file is part of a2fomu which is released under the two clause BSD
+// licence.  See file LICENSE in the project root directory or visit the
+// project at https://github.com/elecbrick/a2fomu for full license details.
+
+// Benchmark of the filesystem and encoders running natively on a development
+// machine. A FAT image, such as one copied from the Fomu mass storage device,
+// is mapped into the simulated flash and mounted exactly as the runtime does.
+// Each test also checks its results so the run fails if a change breaks the
+// code being measured. Without an image, or with - in its place, only the
+// filesystem tests are skipped. Cycle counts are those of the host processor,
+// useful for comparing two builds but not a measure of the RV32I firmware.
+//
+// Usage: fathost [image.img|- [passes]]
+//
+// Unlike the rest of the host build, this file uses the host C library. The
+// firmware modules are linked with every symbol prefixed by a2_ so the two
+// libraries do not collide. Only the firmware entry points used here are
+// declared and firmware structures are treated as opaque.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define FLASHFS_START_ADDRESS 0x80000
+#define FLASHFS_SIZE          (0x200000-FLASHFS_START_ADDRESS)
+#define SECTOR_BYTES          256
+#define FLASH_SECTOR          4096
+#define MAX_PATHS             512
+#define MAX_PATH_LENGTH       300
+#define MAX_FILE              (1<<20)
+
+// FAT directory entry as laid out on the media.
+struct a2_dirent {
+  uint8_t filename[11];
+  uint8_t attributes;
+  uint8_t unused[14];
+  uint16_t first_cluster;
+  uint32_t file_size;
+};
+
+// Character stream as declared in the firmware <stdio.h>.
+struct a2_file {
+  int head, tail, _max;
+  unsigned char *buffer;
+  int minor;
+  short _loc;
+  char _flags;
+  char device;
+};
+
+typedef struct a2_file A2FILE;
+typedef struct a2_dir A2DIR;
+
+extern unsigned char a2_host_flash[];
+extern int a2_errno;
+int a2_mount(void *filesystem, long opt);
+A2FILE *a2_fopen(const char *pathname, const char *mode);
+int a2_fclose(A2FILE *fp);
+int a2_fileno(A2FILE *fp);
+size_t a2_fwrite(const void *ptr, size_t size, size_t nmemb, A2FILE *stream);
+const void *a2_fmap(A2FILE *fp, size_t *length);
+int a2_read(int fd, void *buf, unsigned count);
+int a2_lseek(int fd, int offset, int whence);
+A2DIR *a2_opendir(const char *name);
+struct a2_dirent *a2_readdir(A2DIR *dirp);
+int a2_closedir(A2DIR *dirp);
+struct a2_dirent *a2_finddirent(const char *path);
+extern A2FILE a2__file[];
+int a2_printf(const char *format, ...);
+int a2_snprintf(char *str, unsigned size, const char *format, ...);
+int a2_ansi_cursor(A2FILE *stream, int row, int column);
+int a2_ansi_column(A2FILE *stream, int column);
+int a2_cursor_motion(A2FILE *stream, int from_v, int from_h, int v, int h);
+void a2_render_reset(void);
+uint32_t a2_render_update(A2FILE *stream, const void *vram, uint32_t rows);
+extern uint32_t a2_graphics_frames, a2_graphics_bytes;
+void a2_graphics_reset(void);
+void a2_graphics_frame(int flags);
+int a2_graphics_pending(void);
+int a2_graphics_encode(uint8_t *out, int room, const void *page, int limit);
+void a2_escape_reset(void);
+int a2_escape_key(int c, uint8_t *keys);
+void a2_nibblize(uint8_t *buf);
+void a2_denibblize(uint8_t *buf, int t0);
+unsigned int a2_crc32(const unsigned char *data, unsigned int length);
+extern int a2_flash_drive;
+int a2_write_flash(int dst, const void *src, int size);
+int32_t a2_tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset,
+    void *buffer, uint32_t bufsize);
+
+static char path[MAX_PATHS][64];
+static uint32_t path_size[MAX_PATHS];
+static int paths;
+static char long_path[MAX_PATHS][MAX_PATH_LENGTH];
+static int long_paths;
+static int failures;
+static uint8_t data[MAX_FILE];
+static uint8_t chunk[16];
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+
+// Processor cycles where a cycle counter is readily available.
+static uint64_t cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  return 0;
+#endif
+}
+
+static void report(const char *name, long ops, long bytes, double start) {
+  double elapsed = now()-start;
+  printf("%-12s %9ld ops %10.1f ns/op", name, ops, elapsed*1e9/ops);
+  if(bytes) {
+    printf(" %9.2f MB/s", bytes/elapsed/1e6);
+  }
+  printf("\n");
+}
+
+static void fail(const char *test, const char *what) {
+  fprintf(stderr, "FAIL %s: %s\n", test, what);
+  failures++;
+}
+
+//-----------------------------------------------------------------------
+// Convert the 8.3 name of a directory entry into a path component.
+//-----------------------------------------------------------------------
+static void name83(char *out, const uint8_t *filename) {
+  int i;
+  for(i=0; i<8 && filename[i]!=' '; i++) {
+    *out++ = filename[i];
+  }
+  if(filename[8]!=' ') {
+    *out++ = '.';
+    for(i=8; i<11 && filename[i]!=' '; i++) {
+      *out++ = filename[i];
+    }
+  }
+  *out = '\0';
+}
+
+//-----------------------------------------------------------------------
+// Store the ASCII characters of a VFAT long name part.
+//-----------------------------------------------------------------------
+static void long_part(char *name, const struct a2_dirent *entp) {
+  static const int offset[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+  const uint8_t *raw = (const uint8_t*)entp;
+  int part = (raw[0]&0x1F)-1;
+  for(int i=0; i<13; i++) {
+    int c = raw[offset[i]]|raw[offset[i]+1]<<8;
+    name[part*13+i] = c==0xFFFF ? 0 : c;
+  }
+  if(raw[0]&0x40) {
+    name[part*13+13] = '\0';
+  }
+}
+
+//-----------------------------------------------------------------------
+// Collect the files of the root directory and its subdirectories, along with
+// the long names of those that have one.
+//-----------------------------------------------------------------------
+static void collect(const char *dir, int depth) {
+  A2DIR *dirp = a2_opendir(dir);
+  struct a2_dirent *entp;
+  char name[13], sub[64], lname[261] = "";
+  if(!dirp) {
+    fail("opendir", dir);
+    return;
+  }
+  while((entp=a2_readdir(dirp)) && paths<MAX_PATHS) {
+    if(entp->filename[0]!=0xE5 && (entp->attributes&0x3F)==0x0F) {
+      long_part(lname, entp);
+      continue;
+    }
+    if(entp->filename[0]==0xE5 || entp->filename[0]=='.' ||
+        (entp->attributes&0x08)) {
+      lname[0] = '\0';
+      continue;                         // Deleted, dot, or label
+    }
+    name83(name, entp->filename);
+    snprintf(sub, sizeof(sub), "%s/%s", dir[1] ? dir : "", name);
+    if(lname[0] && !(entp->attributes&0x10)) {
+      snprintf(long_path[long_paths++], MAX_PATH_LENGTH, "%s/%s",
+          dir[1] ? dir : "", lname);
+    }
+    lname[0] = '\0';
+    if(entp->attributes&0x10) {
+      if(depth<2) {                     // Three streams exist for directories
+        collect(sub, depth+1);
+      }
+    } else {
+      strcpy(path[paths], sub);
+      path_size[paths++] = entp->file_size;
+    }
+  }
+  a2_closedir(dirp);
+}
+
+//-----------------------------------------------------------------------
+// Read a whole file through read() in blocks of the given size.
+//-----------------------------------------------------------------------
+static long read_file(const char *name, uint8_t *buf, int block) {
+  A2FILE *fp = a2_fopen(name, "r");
+  long total = 0;
+  int n;
+  if(!fp) {
+    fail("fopen", name);
+    return -1;
+  }
+  while(total+block<=MAX_FILE &&
+      (n=a2_read(a2_fileno(fp), buf+total, block))>0) {
+    total += n;
+  }
+  a2_fclose(fp);
+  return total;
+}
+
+static void bench_lookup(int passes) {
+  double start = now();
+  long ops = 0;
+  for(int pass=0; pass<passes*100; pass++) {
+    for(int i=0; i<paths; i++, ops++) {
+      struct a2_dirent *entp = a2_finddirent(path[i]);
+      if(!entp || entp->file_size!=path_size[i]) {
+        fail("lookup", path[i]);
+        return;
+      }
+    }
+    if(a2_finddirent("/NOSUCH.FIL")) {
+      fail("lookup", "found nonexistent file");
+      return;
+    }
+    ops++;
+  }
+  report("lookup", ops, 0, start);
+  // Scripts open the same file repeatedly.
+  start = now();
+  for(ops=0; ops<passes*10000L; ops++) {
+    if(!a2_finddirent(path[paths-1])) {
+      fail("lookup", path[paths-1]);
+      return;
+    }
+  }
+  report("lookup/same", ops, 0, start);
+  if(!long_paths) {
+    return;
+  }
+  // Most disk images copied from modern hosts have long names.
+  start = now();
+  for(ops=0; ops<passes*10000L; ) {
+    for(int i=0; i<long_paths; i++, ops++) {
+      if(!a2_finddirent(long_path[i])) {
+        fail("lookup", long_path[i]);
+        return;
+      }
+    }
+  }
+  report("lookup/long", ops, 0, start);
+}
+
+static void bench_open(int passes) {
+  double start = now();
+  long ops = 0;
+  for(int pass=0; pass<passes*100; pass++) {
+    for(int i=0; i<paths; i++, ops++) {
+      A2FILE *fp = a2_fopen(path[i], "r");
+      if(!fp) {
+        fail("open", path[i]);
+        return;
+      }
+      a2_fclose(fp);
+    }
+  }
+  report("open", ops, 0, start);
+}
+
+static void bench_read(int passes, int block) {
+  char name[16];
+  double start = now();
+  long ops = 0, bytes = 0;
+  for(int pass=0; pass<passes; pass++) {
+    for(int i=0; i<paths; i++, ops++) {
+      long n = read_file(path[i], data, block);
+      if(n!=(long)path_size[i]) {
+        fail("read", path[i]);
+        return;
+      }
+      bytes += n;
+    }
+  }
+  snprintf(name, sizeof(name), "read/%d", block);
+  report(name, ops, bytes, start);
+}
+
+static void bench_lseek(int passes) {
+  int largest = 0;
+  for(int i=1; i<paths; i++) {
+    if(path_size[i]>path_size[largest]) {
+      largest = i;
+    }
+  }
+  long size = read_file(path[largest], data, 512);
+  if(size<=16) {
+    return;
+  }
+  A2FILE *fp = a2_fopen(path[largest], "r");
+  int fd = a2_fileno(fp);
+  uint32_t seed = 1;
+  double start = now();
+  long ops;
+  for(ops=0; ops<passes*10000L; ops++) {
+    seed = seed*1103515245+12345;
+    int offset = (seed>>8)%(size-16);
+    if(a2_lseek(fd, offset, SEEK_SET)!=offset ||
+        a2_read(a2_fileno(fp), chunk, 16)!=16 ||
+        memcmp(chunk, data+offset, 16)) {
+      fail("lseek", path[largest]);
+      break;
+    }
+  }
+  report("lseek+read", ops, 0, start);
+  a2_fclose(fp);
+}
+
+static void bench_nibblize(int passes) {
+  uint8_t sector[SECTOR_BYTES], copy[SECTOR_BYTES];
+  double start;
+  long ops, count = passes*20000L;
+  for(int i=0; i<SECTOR_BYTES; i++) {
+    sector[i] = i*37+11;
+  }
+  start = now();
+  for(ops=0; ops<count; ops++) {
+    a2_nibblize(sector);
+  }
+  report("nibblize", ops, ops*SECTOR_BYTES, start);
+  start = now();
+  for(ops=0; ops<count; ops++) {
+    sector[ops&0xFF] ^= ops;
+    a2_nibblize(sector);
+    a2_denibblize(copy, 0);
+    if(memcmp(sector, copy, SECTOR_BYTES)) {
+      fail("nibblize", "round trip differs");
+      break;
+    }
+  }
+  report("roundtrip", ops, ops*SECTOR_BYTES, start);
+}
+
+//-----------------------------------------------------------------------
+// Compare the general formatter against the ANSI cursor fast path on the
+// sequence the video path sends most, after checking both, and the number
+// conversions in general, against the host C library.
+//-----------------------------------------------------------------------
+static void format_report(const char *name, long ops, double start,
+    uint64_t cycle_start) {
+  uint64_t cycle_count = cycles()-cycle_start;
+  double elapsed = now()-start;
+  printf("%-12s %9ld ops %10.1f ns/op", name, ops, elapsed*1e9/ops);
+  if(cycle_count) {
+    printf(" %9.1f host cycles/op", (double)cycle_count/ops);
+  }
+  printf("\n");
+}
+
+static void bench_format(int passes) {
+  A2FILE *out = &a2__file[1];
+  static const int value[] = { 0, 1, -1, 9, 10, 99, 100, -12, 4095, 65536,
+      123456789, 2147483647, -2147483647-1 };
+  char expect[80], got[80];
+  double start;
+  uint64_t cycle_start;
+  long ops, count = passes*100000L;
+  int n;
+
+  for(unsigned i=0; i<sizeof(value)/sizeof(value[0]); i++) {
+    int v = value[i];
+    snprintf(expect, sizeof(expect), "%d|%u|%x|%X|%08d|%-6d|%5x", v,
+        (unsigned)v, (unsigned)v, (unsigned)v, v, v, (unsigned)v);
+    n = a2_snprintf(got, sizeof(got)-1, "%d|%u|%x|%X|%08d|%-6d|%5x", v, v,
+        v, v, v, v, v);
+    if(n!=(int)strlen(expect) || memcmp(got, expect, n)) {
+      fail("format", expect);
+    }
+  }
+  a2_printf("");
+  for(int row=1; row<=24; row++) {
+    for(int col=1; col<=120; col++) {
+      n = snprintf(expect, sizeof(expect), "\033[%d;%dH\033[%dG", row, col,
+          col);
+      out->head = out->tail = 0;
+      a2_ansi_cursor(out, row, col);
+      a2_ansi_column(out, col);
+      if(out->tail!=n || memcmp(out->buffer, expect, n)) {
+        fail("ansi", expect);
+        row = 24;
+        break;
+      }
+    }
+  }
+
+  start = now();
+  cycle_start = cycles();
+  for(ops=0; ops<count; ops++) {
+    out->head = out->tail = 0;
+    a2_printf("\033[%d;%dH", (int)(ops&15)+1, (int)(ops&31)+1);
+  }
+  format_report("printf/cup", ops, start, cycle_start);
+  start = now();
+  cycle_start = cycles();
+  for(ops=0; ops<count; ops++) {
+    out->head = out->tail = 0;
+    a2_ansi_cursor(out, (int)(ops&15)+1, (int)(ops&31)+1);
+  }
+  format_report("ansi_cursor", ops, start, cycle_start);
+}
+
+//-----------------------------------------------------------------------
+// Interpret cursor motion the way an ANSI terminal would. Returns the bytes
+// sent over USB, counting newline as CR LF, or -1 for anything unexpected.
+//-----------------------------------------------------------------------
+static int terminal(const unsigned char *s, int n, int *v, int *h) {
+  int bytes = 0, param;
+  for(int i=0; i<n; i++) {
+    bytes++;
+    if(s[i]=='\r') {
+      *h = 0;
+    } else if(s[i]=='\n') {
+      bytes++;
+      *h = 0;
+      ++*v;
+    } else if(s[i]=='\b') {
+      // Backspace from past the last column differs between terminals.
+      if(*h>=40) {
+        return -1;
+      }
+      --*h;
+    } else if(s[i]=='\033' && i+2<n && s[i+1]=='[') {
+      int p[2] = { 0, 0 }, np = 0;
+      for(i+=2, bytes++; i<n && (s[i]==';' || (s[i]>='0' && s[i]<='9'));
+          i++, bytes++) {
+        if(s[i]==';') {
+          np++;
+        } else if(np<2) {
+          p[np] = p[np]*10+s[i]-'0';
+        }
+      }
+      if(i==n) {
+        return -1;
+      }
+      bytes++;
+      param = p[0] ? p[0] : 1;
+      if(*h>=40 && (s[i]=='C' || s[i]=='D')) {
+        return -1;
+      }
+      switch(s[i]) {
+      case 'A': *v -= param; break;
+      case 'B': *v += param; break;
+      case 'C': *h += param; break;
+      case 'D': *h -= param; break;
+      case 'G': *h = param-1; break;
+      case 'H': *v = param-1; *h = (p[1] ? p[1] : 1)-1; break;
+      default: return -1;
+      }
+      if(*h>=40) {
+        // Vertical moves leave the cursor in the last column.
+        *h = 39;
+      }
+    } else {
+      return -1;
+    }
+  }
+  return bytes;
+}
+
+static void bench_motion(int passes) {
+  A2FILE *out = &a2__file[1];
+  double start;
+  long ops, bytes = 0, absolute = 0;
+  int v, h, n;
+  char cup[16];
+
+  a2_printf("");
+  for(int v0=0; v0<24; v0++) {
+    for(int h0=0; h0<=40; h0++) {
+      for(int v1=0; v1<24; v1++) {
+        for(int h1=0; h1<40; h1++) {
+          out->head = out->tail = 0;
+          if(a2_cursor_motion(out, v0, h0, v1, h1)<0) {
+            fail("motion", "no room");
+            return;
+          }
+          v = v0;
+          h = h0;
+          n = terminal(out->buffer, out->tail, &v, &h);
+          if(n<0 || v!=v1 || h!=h1) {
+            fail("motion", "wrong position");
+            return;
+          }
+          bytes += n;
+          if(v1!=v0 || h1!=h0) {
+            absolute += snprintf(cup, sizeof(cup), "\033[%d;%dH", v1+1, h1+1);
+          }
+        }
+      }
+    }
+  }
+  printf("%-12s %9.2f bytes/move, %.2f with only CSI H\n", "motion",
+      (double)bytes/(24*41*24*40), (double)absolute/(24*41*24*40));
+  start = now();
+  for(ops=0; ops<passes*100000L; ops++) {
+    out->head = out->tail = 0;
+    a2_cursor_motion(out, ops%24, ops%41, (ops>>3)%24, (ops>>2)%40);
+  }
+  report("motion", ops, 0, start);
+}
+
+//-----------------------------------------------------------------------
+// A terminal screen for checking the shadow renderer: characters, CR, LF
+// (sent as CR LF and scrolling at the bottom), backspace, cursor motion and
+// erase to end of line. Returns the bytes sent or -1 for anything else.
+//-----------------------------------------------------------------------
+static char tty_screen[24][40];
+static int tty_v, tty_h;
+
+static int tty_put(const unsigned char *s, int n) {
+  int bytes = 0;
+  for(int i=0; i<n; ) {
+    int j = i;
+    if(s[i]=='\n') {
+      bytes += 2;
+      tty_h = 0;
+      if(tty_v==23) {
+        memmove(tty_screen[0], tty_screen[1], 23*40);
+        memset(tty_screen[23], ' ', 40);
+      } else {
+        tty_v++;
+      }
+      i++;
+    } else if(s[i]>=' ' && s[i]<0x7f) {
+      if(tty_h>=40) {
+        return -1;
+      }
+      tty_screen[tty_v][tty_h++] = s[i++];
+      bytes++;
+    } else if(s[i]=='\033' && i+3<=n && s[i+1]=='[' && s[i+2]=='K') {
+      if(tty_h<40) {
+        memset(&tty_screen[tty_v][tty_h], ' ', 40-tty_h);
+      }
+      bytes += 3;
+      i += 3;
+    } else {
+      // Cursor motion: up to the final byte of an escape sequence
+      if(s[j]=='\033') {
+        for(j+=2; j<n && !(s[j]>='@' && s[j]<='~'); j++) {
+        }
+      }
+      int m = terminal(s+i, j+1-i, &tty_v, &tty_h);
+      if(m<0) {
+        return -1;
+      }
+      bytes += m;
+      i = j+1;
+    }
+  }
+  return bytes;
+}
+
+// Apple II text page: eight blocks of 128 bytes each holding three rows.
+static uint8_t text_page[1024] __attribute__((aligned(4)));
+
+static uint8_t *text_cell(int v, int h) {
+  return &text_page[(v&7)*128+(v>>3)*40+h];
+}
+
+static int text_ascii(int c) {
+  return c&0x20 ? c&0x3f : (c&0x1f)|0x40;
+}
+
+// One look at the screen as video_task makes it. Rows not done are carried
+// over to the next look. When checking, looks are repeated until the
+// renderer is done and the terminal must then match.
+static uint32_t render_rows;
+static long render_bytes, render_looks;
+
+static void render_look(int check) {
+  A2FILE *out = &a2__file[1];
+  int n, tries = 0;
+  render_rows |= 0xffffff;
+  while(render_rows && tries++<(check ? 32 : 1)) {
+    out->head = out->tail = 0;
+    render_rows = a2_render_update(out, text_page, render_rows);
+    if((n=tty_put(out->buffer, out->tail))<0) {
+      fail("render", "bad output");
+      return;
+    }
+    render_bytes += n;
+    render_looks++;
+  }
+  if(check) {
+    for(int v=0; v<24; v++) {
+      for(int h=0; h<40; h++) {
+        if(tty_screen[v][h]!=text_ascii(*text_cell(v, h))) {
+          fail("render", "screen differs");
+          return;
+        }
+      }
+    }
+  }
+}
+
+//-----------------------------------------------------------------------
+// 6502 time passing. The screen is looked at every 16ms as the firmware does
+// or after a millisecond while rows are still to be done, such as during a
+// scroll.
+//-----------------------------------------------------------------------
+#define LOOK_CYCLES   16000
+#define RETRY_CYCLES  1000
+
+static void render_time(int cycles) {
+  static int time;
+  if((time+=cycles)>=(render_rows ? RETRY_CYCLES : LOOK_CYCLES)) {
+    time = 0;
+    render_look(0);
+  }
+}
+
+//-----------------------------------------------------------------------
+// A listing scrolling up the screen the way the Apple monitor does it and
+// then random changes. Compared with sending every write and with a full
+// redraw. Printing a character through BASIC takes far longer than copying
+// one during a scroll.
+//-----------------------------------------------------------------------
+#define PRINT_CYCLES  1000
+#define SCROLL_CYCLES 15
+
+static void bench_render(int passes) {
+  double start;
+  long ops, writes = 0, listing = 0;
+  int line, v, h, n;
+  char text[48];
+
+  memset(text_page, 0xa0, sizeof(text_page));
+  memset(tty_screen, ' ', sizeof(tty_screen));
+  tty_v = tty_h = 0;
+  a2_render_reset();
+  render_bytes = render_looks = 0;
+  start = now();
+  for(ops=0; ops<passes; ops++) {
+    listing -= render_bytes;
+    for(line=0; line<200; line++) {
+      n = snprintf(text, sizeof(text), "%d PRINT \"LINE %d\";X%d", line*10,
+          line, (line*7)%40);
+      for(h=0; h<n && h<40; h++) {
+        *text_cell(23, h) = text[h]|0x80;
+        writes++;
+        render_time(PRINT_CYCLES);
+      }
+      // Scroll: copy each row up then clear the last
+      for(v=0; v<23; v++) {
+        for(h=0; h<40; h++) {
+          *text_cell(v, h) = *text_cell(v+1, h);
+          writes++;
+          render_time(SCROLL_CYCLES);
+        }
+      }
+      for(h=0; h<40; h++) {
+        *text_cell(23, h) = 0xa0;
+        writes++;
+      }
+      *text_cell(23, 0) = 0x60;         // Flashing cursor
+    }
+    render_look(1);
+    listing += render_bytes;
+    for(n=0; n<2000; n++) {
+      *text_cell(rand()%24, rand()%40) = 0xa0+rand()%64;
+      writes++;
+      if(n%8==7) {
+        render_look(1);
+      }
+    }
+  }
+  printf("%-12s %9.2f bytes/line listing, %.2f bytes/look, "
+      "%.2f bytes/write, redraw %d\n", "render",
+      (double)listing/(200*passes), (double)render_bytes/render_looks,
+      (double)render_bytes/writes, 24*40+23*2+3);
+  report("render", render_looks, 0, start);
+}
+
+//-----------------------------------------------------------------------
+// Graphics frames decoded as the viewer does, into the visible bytes of a
+// page in the order they are sent.
+//-----------------------------------------------------------------------
+#define GFX_HIRES 1
+#define GFX_KEY   8
+#define GFX_HIRES_BYTES 7680
+
+static uint8_t gfx_page[2][0x2000] __attribute__((aligned(8)));
+static uint8_t gfx_view[GFX_HIRES_BYTES];
+static uint8_t gfx_stream[0x4000];
+
+static int gfx_decode(const uint8_t *s, int n) {
+  const uint8_t *end = s+n;
+  int pos, size, count, t, b;
+  while(s<end) {
+    if(end-s<4 || s[0]!=0xA2 || s[1]!='G') {
+      return -1;
+    }
+    size = s[2]&GFX_HIRES ? GFX_HIRES_BYTES : GFX_HIRES_BYTES/8;
+    if(s[2]&GFX_KEY) {
+      memset(gfx_view, 0, sizeof(gfx_view));
+    }
+    s += 4;
+    for(pos=0; pos<size; pos+=count) {
+      if(s>=end) {
+        return -1;
+      }
+      t = *s++;
+      count = t<0x40 ? 8*(t+1) : t<0x80 ? t-0x3f : t-0x7e;
+      if(pos+count>size || (t>=0x40 && s+(t<0x80 ? count : 1)>end)) {
+        return -1;
+      }
+      if(t>=0x80) {
+        b = *s++;
+        for(int i=0; i<count; i++) {
+          gfx_view[pos+i] ^= b;
+        }
+      } else if(t>=0x40) {
+        for(int i=0; i<count; i++) {
+          gfx_view[pos+i] ^= *s++;
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+// Encode one frame in USB sized pieces and check the viewer then matches.
+static long gfx_send(int page, int flags) {
+  int n, len = 0, size = flags&GFX_HIRES ? GFX_HIRES_BYTES : GFX_HIRES_BYTES/8;
+  a2_graphics_frame(flags);
+  while(a2_graphics_pending()) {
+    n = a2_graphics_encode(gfx_stream+len, 64, gfx_page[page], 120);
+    len += n;
+    if(len>(int)sizeof(gfx_stream)-64) {
+      fail("graphics", "frame too long");
+      return len;
+    }
+  }
+  if(gfx_decode(gfx_stream, len)<0) {
+    fail("graphics", "bad stream");
+  }
+  for(int k=0; k<size; k++) {
+    if(gfx_view[k]!=gfx_page[page][k/120*128+k%120]) {
+      fail("graphics", "frame differs");
+      break;
+    }
+  }
+  return len;
+}
+
+// Hi-Res line y: eight interleaved groups of eight within thirds of the page.
+static uint8_t *hires_byte(int page, int y, int x) {
+  return &gfx_page[page][((y&7)<<10 | ((y>>3)&7)<<7 | (y>>6)*40)+x];
+}
+
+//-----------------------------------------------------------------------
+// A key frame of a random picture, a 7x8 sprite moving across it, flipping
+// between two pages that differ by the sprite and Lo-Res blocks changing.
+//-----------------------------------------------------------------------
+static void bench_graphics(int passes) {
+  double start;
+  long ops, key = 0, sprite = 0, flip = 0, lores = 0;
+  int x, y, i;
+
+  start = now();
+  for(ops=0; ops<passes; ops++) {
+    for(i=0; i<(int)sizeof(gfx_page[0]); i++) {
+      gfx_page[0][i] = rand();
+    }
+    a2_graphics_reset();
+    key += gfx_send(0, GFX_HIRES);
+    if(gfx_send(0, GFX_HIRES)!=0) {
+      fail("graphics", "unchanged frame sent");
+    }
+    for(x=0; x<39; x++) {
+      for(y=80; y<88; y++) {
+        *hires_byte(0, y, x) = 0;
+        *hires_byte(0, y, x+1) = 0x7f;
+      }
+      sprite += gfx_send(0, GFX_HIRES);
+    }
+    memcpy(gfx_page[1], gfx_page[0], sizeof(gfx_page[0]));
+    for(y=100; y<108; y++) {
+      *hires_byte(1, y, 20) ^= 0x7f;
+    }
+    for(i=0; i<20; i++) {
+      flip += gfx_send(i&1, GFX_HIRES);
+    }
+    for(i=0; i<40; i++) {
+      gfx_page[0][rand()%1024] = rand();
+      lores += gfx_send(0, 0);
+    }
+  }
+  printf("%-12s %9.2f bytes key frame, %.2f bytes/sprite move, "
+      "%.2f bytes/flip, %.2f bytes/lo-res change\n", "graphics",
+      (double)key/passes, (double)sprite/(39*passes),
+      (double)flip/(20*passes), (double)lores/(40*passes));
+  report("graphics", a2_graphics_frames, a2_graphics_bytes, start);
+}
+
+//-----------------------------------------------------------------------
+// Terminal input as recorded from xterm: typing, arrows, keypad in
+// application mode, function and editing keys and ESC pressed before a key.
+// The time is for a copy many times over decoded as tty_task does, a USB
+// packet at a time.
+//-----------------------------------------------------------------------
+static const char escape_typed[] =
+    "10 print \"hello\"\r\033[A\033[D\033[D\x7f\033OP\033Ol\033Ot\033OM"
+    "\033[15~\033[24~\033[1~\033[4~\033x\033[99Zlist\r\f";
+static const char escape_apple[] =
+    "10 PRINT \"HELLO\"\r\033D\x88\x88\x88,4\r\033@\033E\033X\033[99ZLIST\r";
+// Function keys 1, 5 and 12 then redraw, as enum escape_command
+static const int escape_commands[] = { 0x11, 0x15, 0x1C, 2 };
+
+static int escape_decode(const char *typed, int count, uint8_t *keys,
+    int *commands) {
+  int i, rc, n = 0, c = 0;
+  for(i=0; i<count; i++) {
+    rc = a2_escape_key((uint8_t)typed[i], keys+n);
+    if(rc>=0) {
+      n += rc;
+    } else if(c<(int)(sizeof(escape_commands)/sizeof(escape_commands[0]))) {
+      commands[c++] = -rc;
+    }
+  }
+  return n;
+}
+
+static void bench_escape(int passes) {
+  static char typed[64*1024];
+  static uint8_t keys[sizeof(typed)+8];
+  int commands[sizeof(escape_commands)/sizeof(escape_commands[0])];
+  int n, len = sizeof(escape_typed)-1, count;
+  double start;
+  uint64_t cycle_start;
+  long ops, i;
+
+  a2_escape_reset();
+  memset(commands, 0, sizeof(commands));
+  n = escape_decode(escape_typed, len, keys, commands);
+  if(n!=(int)sizeof(escape_apple)-1 || memcmp(keys, escape_apple, n)) {
+    fail("escape", "keys");
+  }
+  if(memcmp(commands, escape_commands, sizeof(commands))) {
+    fail("escape", "commands");
+  }
+  for(count=0; count+len<=(int)sizeof(typed); count+=len) {
+    memcpy(typed+count, escape_typed, len);
+  }
+  start = now();
+  cycle_start = cycles();
+  for(ops=0, i=0; i<passes*10; i++) {
+    a2_escape_reset();
+    for(n=0; n<count; n+=64) {
+      escape_decode(typed+n, count-n<64 ? count-n : 64, keys, commands);
+    }
+    ops += count;
+  }
+  format_report("escape/byte", ops, start, cycle_start);
+}
+
+//-----------------------------------------------------------------------
+// The USB host streams the last sector of the drive, so it is read ahead,
+// then the firmware saves over it. The rest of the sector must come from
+// flash, not the read-ahead block. The sector is put back afterwards.
+//-----------------------------------------------------------------------
+static void test_msc(void) {
+  static uint8_t saved[FLASH_SECTOR], sector[FLASH_SECTOR], got[512];
+  int lba = FLASHFS_SIZE/FLASH_SECTOR-1;
+  int dst = a2_flash_drive+lba*FLASH_SECTOR;
+  int i;
+
+  memcpy(saved, a2_host_flash+dst, sizeof(saved));
+  for(i=0; i<FLASH_SECTOR; i++) {
+    sector[i] = saved[i]^0xA5;
+  }
+  a2_tud_msc_read10_cb(0, lba, 0, got, sizeof(got));
+  a2_tud_msc_read10_cb(0, lba, sizeof(got), got, sizeof(got));
+  a2_write_flash(dst, sector, sizeof(sector));
+  a2_tud_msc_read10_cb(0, lba, 2*sizeof(got), got, sizeof(got));
+  if(memcmp(got, sector+2*sizeof(got), sizeof(got))) {
+    fail("msc", "read-ahead block not discarded by write_flash");
+  }
+  a2_write_flash(dst, saved, sizeof(saved));
+}
+
+//-----------------------------------------------------------------------
+// A file is created in the descriptor another file was last read through.
+// It must not be mapped while it is being written and once written must map
+// to what was written, not to the file that used the descriptor before.
+//-----------------------------------------------------------------------
+static void test_fmap(void) {
+  static uint8_t text[3000];
+  const void *map;
+  size_t length;
+  A2FILE *fp;
+  int i;
+
+  if((fp=a2_fopen(path[0], "r"))) {
+    a2_fclose(fp);
+  }
+  if(!(fp=a2_fopen("/FMAPTEST.BIN", "w"))) {
+    fail("fmap", "create");
+    return;
+  }
+  for(i=0; i<(int)sizeof(text); i++) {
+    text[i] = rand();
+  }
+  a2_fwrite(text, 1, sizeof(text), fp);
+  if(a2_fmap(fp, &length)) {
+    fail("fmap", "file being written was mapped");
+  }
+  a2_fclose(fp);
+  fp = a2_fopen("/FMAPTEST.BIN", "r");
+  map = fp ? a2_fmap(fp, &length) : NULL;
+  if(!map || length!=sizeof(text) || memcmp(map, text, sizeof(text))) {
+    fail("fmap", "written file");
+  }
+  if(fp) {
+    a2_fclose(fp);
+  }
+}
+
+static void bench_crc(int passes) {
+  const uint8_t *fs = a2_host_flash+FLASHFS_START_ADDRESS;
+  double start;
+  long ops;
+  if(a2_crc32((const unsigned char*)"123456789", 9)!=0xCBF43926) {
+    fail("crc32", "check value");
+  }
+  start = now();
+  for(ops=0; ops<passes; ops++) {
+    a2_crc32(fs, FLASHFS_SIZE);
+  }
+  report("crc32", ops, ops*FLASHFS_SIZE, start);
+}
+
+//-----------------------------------------------------------------------
+// Map a FAT image over the filesystem area of the simulated flash, mount it
+// and collect the paths used by the filesystem tests.
+// Return: 0 or the exit status for main
+//-----------------------------------------------------------------------
+static int load_image(const char *image) {
+  struct stat st;
+  int fd;
+  if((fd=open(image, O_RDONLY))<0 || fstat(fd, &st)<0) {
+    perror(image);
+    return 2;
+  }
+  if(st.st_size<512 || st.st_size>FLASHFS_SIZE) {
+    fprintf(stderr, "%s: image must be 512 bytes to %d kB\n", image,
+        FLASHFS_SIZE/1024);
+    return 2;
+  }
+  // Private mapping keeps the image file unchanged should the firmware write
+  // to it.
+  if(mmap(a2_host_flash+FLASHFS_START_ADDRESS, st.st_size,
+      PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED, fd, 0)==MAP_FAILED) {
+    perror("mmap");
+    return 2;
+  }
+  close(fd);
+  if(a2_mount(a2_host_flash+FLASHFS_START_ADDRESS, 0)) {
+    fprintf(stderr, "%s: mount failed, errno %d\n", image, a2_errno);
+    return 1;
+  }
+  collect("/", 0);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  const char *image = argc>1 && strcmp(argv[1], "-") ? argv[1] : NULL;
+  int rc, passes = 10;
+  if(argc>3) {
+    fprintf(stderr, "Usage: %s [image.img|- [passes]]\n", argv[0]);
+    return 2;
+  }
+  if(argc==3 && (passes=atoi(argv[2]))<1) {
+    passes = 1;
+  }
+  if(image) {
+    if((rc=load_image(image))) {
+      return rc;
+    }
+    printf("%s: %d files, %d long names, %d passes\n", image, paths,
+        long_paths, passes);
+  } else {
+    printf("no image: %d passes\n", passes);
+  }
+  if(paths) {
+    bench_lookup(passes);
+    bench_open(passes);
+    bench_read(passes, 512);
+    bench_read(passes, 16);
+    bench_lseek(passes);
+    test_fmap();
+  }
+  bench_nibblize(passes);
+  bench_format(passes);
+  bench_motion(passes);
+  bench_render(passes);
+  bench_graphics(passes);
+  bench_escape(passes);
+  test_msc();
+  bench_crc(passes);
+  if(failures) {
+    fprintf(stderr, "%d failures\n", failures);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,78 @@
+//
+// host.c - Part of a2fomu - Copyright (c) 2020-2021 Doug Eaton
+//
+// This file is part of a2fomu which is released under the two clause BSD
+// licence.  See file LICENSE in the project root directory or visit the
+// project at https://github.com/elecbrick/a2fomu for full license details.
+
+// Hardware stand-ins for running the filesystem, stdio and disk modules on a
+// development machine. This file is compiled exactly like the firmware
+// modules, with the a2fomu headers rather than the host C library, and
+// provides the few symbols those modules expect from flash.c, rtc.c and
+// main.c along with the memory behind the stub <generated/mem.h> and
+// <generated/csr.h>.
+
+#include <stdint.h>
+#include <string.h>
+#include <a2fomu.h>
+#include <flash.h>
+#include <fsfat.h>
+#include <trace.h>
+
+// Memory mapped SPI flash. Aligned so an image file can be mapped over the
+// filesystem area which starts on a page boundary.
+unsigned char host_flash[SPIFLASH_SIZE] __attribute__((aligned(4096)));
+unsigned char host_a2ram[A2RAM_SIZE];
+
+uint32_t host_csr_apple2_control;
+uint32_t host_csr_apple2_diskctrl;
+uint32_t host_csr_apple2_diskdata;
+uint32_t host_csr_timer0_value;
+
+volatile a2time_t system_ticks;
+int debug_counter[max_application_error];
+
+//-----------------------------------------------------------------------
+// Flash programming completes immediately. The same safety limits and the
+// same notification of the filesystem as the real driver are retained so
+// that writes behave identically. A rejected write reports completion
+// without changing anything, as does the driver, and is caught on verify.
+//-----------------------------------------------------------------------
+int write_flash(int dst, const void *src, int size) {
+  if(dst<FIRST_SAFE_ADDRESS || size>ERASE_SECTOR_SIZE ||
+      (dst&(ERASE_SECTOR_SIZE-1))+size>ERASE_SECTOR_SIZE) {
+    return size;
+  }
+  fat_flash_write(dst, size);
+  memcpy(host_flash+dst, src, size);
+  return size;
+}
+
+int read_flash(void *dst, int src, int size) {
+  memcpy(dst, host_flash+src, size);
+  return size;
+}
+
+void task_ready(enum task_num task) {
+  (void)task;
+}
+
+void trace(enum trace_type type, int id, int arg) {
+  (void)type;
+  (void)id;
+  (void)arg;
+}
+
+uint32_t rtc_cycles(void) {
+  return 0;
+}
+
+int flash_busy(void) {
+  return 0;
+}
+
+void flash_task(void) {
+}
+
+void yield(void) {
+}
@@ -0,0 +1,16 @@
+//
+// assert.h - Part of a2fomu - Copyright (c) 2020-2021 Doug Eaton
+//
+// This file is part of a2fomu which is released under the two clause BSD
+// licence.  See file LICENSE in the project root directory or visit the
+// project at https://github.com/elecbrick/a2fomu for full license details.
+
+#ifndef _ASSERT_H_
+#define _ASSERT_H_
+
+// Host build: only compile time checks are used by the firmware modules.
+
+#define static_assert _Static_assert
+#define assert(x) ((void)0)
+
+#endif
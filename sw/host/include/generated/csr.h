@@ -0,0 +1,57 @@
+//
+// csr.h - Part of a2fomu - Copyright (c) 2020-2021 Doug Eaton
+//
+// This file is part of a2fomu which is released under the two clause BSD
+// licence.  See file LICENSE in the project root directory or visit the
+// project at https://github.com/elecbrick/a2fomu for full license details.
+
+#ifndef __GENERATED_CSR_H
+#define __GENERATED_CSR_H
+
+// Host stand-in for the LiteX generated register accessors. Only the
+// registers touched by the modules in the host build are provided. Each one
+// is backed by a plain variable in host.c so a benchmark can preset what the
+// gateware would have returned and inspect what the firmware wrote.
+
+#include <stdint.h>
+
+extern uint32_t host_csr_apple2_control;
+extern uint32_t host_csr_apple2_diskctrl;
+extern uint32_t host_csr_apple2_diskdata;
+extern uint32_t host_csr_timer0_value;
+
+#define CSR_APPLE2_CONTROL_RESET_OFFSET 0
+#define CSR_APPLE2_CONTROL_RESET_SIZE 1
+#define CSR_APPLE2_CONTROL_DIVISOR_OFFSET 8
+#define CSR_APPLE2_CONTROL_DIVISOR_SIZE 4
+#define CSR_APPLE2_DISKCTRL_PHASE_OFFSET 0
+#define CSR_APPLE2_DISKCTRL_PHASE_SIZE 4
+#define CSR_APPLE2_DISKCTRL_MOTOR_OFFSET 4
+#define CSR_APPLE2_DISKCTRL_MOTOR_SIZE 1
+#define CSR_APPLE2_DISKCTRL_DRIVE_OFFSET 5
+#define CSR_APPLE2_DISKCTRL_DRIVE_SIZE 1
+#define CSR_APPLE2_DISKCTRL_WANTED_OFFSET 6
+#define CSR_APPLE2_DISKCTRL_WANTED_SIZE 1
+#define CSR_APPLE2_DISKCTRL_PENDING_OFFSET 7
+#define CSR_APPLE2_DISKCTRL_PENDING_SIZE 1
+
+static inline uint32_t apple2_control_read(void) {
+  return host_csr_apple2_control;
+}
+static inline void apple2_control_write(uint32_t v) {
+  host_csr_apple2_control = v;
+}
+static inline uint8_t apple2_diskctrl_read(void) {
+  return host_csr_apple2_diskctrl;
+}
+static inline void apple2_diskdata_write(uint8_t v) {
+  host_csr_apple2_diskdata = v;
+}
+static inline void timer0_update_value_write(uint8_t v) {
+  (void)v;
+}
+static inline uint32_t timer0_value_read(void) {
+  return host_csr_timer0_value;
+}
+
+#endif
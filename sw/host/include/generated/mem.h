@@ -0,0 +1,25 @@
+//
+// mem.h - Part of a2fomu - Copyright (c) 2020-2021 Doug Eaton
+//
+// This file is part of a2fomu which is released under the two clause BSD
+// licence.  See file LICENSE in the project root directory or visit the
+// project at https://github.com/elecbrick/a2fomu for full license details.
+
+#ifndef __GENERATED_MEM_H
+#define __GENERATED_MEM_H
+
+// Host stand-in for the LiteX generated memory map. The memory mapped SPI
+// flash and the Apple II RAM are arrays in host.c. The host build links
+// without PIE so their addresses fit in the 32-bit integers the firmware
+// uses to hold pointers.
+
+extern unsigned char host_flash[];
+extern unsigned char host_a2ram[];
+
+#define A2RAM_BASE ((long)host_a2ram)
+#define A2RAM_SIZE 0x00010000
+
+#define SPIFLASH_BASE ((long)host_flash)
+#define SPIFLASH_SIZE 0x00200000
+
+#endif
@@ -0,0 +1,22 @@
+//
+// irq.h - Part of a2fomu - Copyright (c) 2020-2021 Doug Eaton
+//
+// This file is part of a2fomu which is released under the two clause BSD
+// licence.  See file LICENSE in the project root directory or visit the
+// project at https://github.com/elecbrick/a2fomu for full license details.
+
+#ifndef __IRQ_H
+#define __IRQ_H
+
+// Host stand-in for the LiteX interrupt controls. There are no interrupts.
+
+#include <generated/csr.h>
+
+static inline unsigned int irq_getie(void) {
+  return 0;
+}
+static inline void irq_setie(unsigned int ie) {
+  (void)ie;
+}
+
+#endif
@@ -0,0 +1,19 @@
+//
+// stdlib.h - Part of a2fomu - Copyright (c) 2020-2021 Doug Eaton
+//
+// This file is part of a2fomu which is released under the two clause BSD
+// licence.  See file LICENSE in the project root directory or visit the
+// project at https://github.com/elecbrick/a2fomu for full license details.
+
+#ifndef _STDLIB_H_
+#define _STDLIB_H_
+
+// Host build: only the conversion supplied by string.c is used.
+
+#ifndef NULL
+#define NULL ((void *)0)
+#endif
+
+int atoi(const char *nptr);
+
+#endif
@@ -0,0 +1,16 @@
+//
+// types.h - Part of a2fomu - Copyright (c) 2020-2021 Doug Eaton
+//
+// This file is part of a2fomu which is released under the two clause BSD
+// licence.  See file LICENSE in the project root directory or visit the
+// project at https://github.com/elecbrick/a2fomu for full license details.
+
+#ifndef _SYS_TYPES_H
+#define _SYS_TYPES_H
+
+// Host build: keep the 32-bit sizes of the RISC-V newlib types.
+
+typedef int ssize_t;
+typedef int off_t;
+
+#endif
@@ -0,0 +1,61 @@
+//
+// tusb.h - Part of a2fomu - Copyright (c) 2020-2021 Doug Eaton
+//
+// This file is part of a2fomu which is released under the two clause BSD
+// licence.  See file LICENSE in the project root directory or visit the
+// project at https://github.com/elecbrick/a2fomu for full license details.
+
+#ifndef _TUSB_H_
+#define _TUSB_H_
+
+// Host stand-in for TinyUSB. The CDC ports behave as if no terminal were
+// attached: nothing is ever received and there is never room to transmit.
+// Mass storage has just what the callbacks in msc_flash.c refer to so that
+// they can be called directly.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define CFG_TUD_CDC_RX_BUFSIZE 64
+#define CFG_TUD_CDC_TX_BUFSIZE 64
+
+static inline uint32_t tud_cdc_n_available(uint8_t itf) {
+  (void)itf;
+  return 0;
+}
+static inline uint32_t tud_cdc_n_read(uint8_t itf, void *buffer,
+    uint32_t bufsize) {
+  (void)itf; (void)buffer; (void)bufsize;
+  return 0;
+}
+static inline uint32_t tud_cdc_n_write_available(uint8_t itf) {
+  (void)itf;
+  return 0;
+}
+static inline uint32_t tud_cdc_n_write_char(uint8_t itf, char ch) {
+  (void)itf; (void)ch;
+  return 0;
+}
+static inline uint32_t tud_cdc_n_write_str(uint8_t itf, const char *str) {
+  (void)itf; (void)str;
+  return 0;
+}
+static inline uint32_t tud_cdc_n_write_flush(uint8_t itf) {
+  (void)itf;
+  return 0;
+}
+
+#define SCSI_CMD_INQUIRY                      0x12
+#define SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL 0x1E
+#define SCSI_CMD_READ_FORMAT_CAPACITY         0x23
+#define SCSI_CMD_READ_CAPACITY_10             0x25
+#define SCSI_SENSE_ILLEGAL_REQUEST            0x05
+
+static inline bool tud_msc_set_sense(uint8_t lun, uint8_t sense_key,
+    uint8_t add_sense_code, uint8_t add_sense_qualifier) {
+  (void)lun; (void)sense_key; (void)add_sense_code; (void)add_sense_qualifier;
+  return true;
+}
+
+#endif
@@ -24,12 +24,29 @@ enum task_num {
   keyboard_task_active,
   video_task_active,
   disk_task_active,
+  disk_feed_task_active,
+  graphics_task_active,
   max_task
 };
 extern int active_tasks;
 
-// Global performance monitoring statistics.
-extern a2time_t task_runtime[max_task];
+// Tasks with work to do. Bits are set by interrupt handlers and, through
+// task_ready(), by producers. The scheduler clears a bit as it runs the task
+// and waits for an interrupt when none are set.
+extern volatile unsigned int ready_tasks;
+void task_ready(enum task_num task);
+
+// Per task run time statistics in processor cycles, always collected by the
+// scheduler. Histogram bin n counts runs of 2^n to 2^(n+1)-1 cycles; the last
+// bin also holds anything longer.
+#define TASK_HISTOGRAM_BINS 24
+struct task_stats {
+  uint32_t calls;
+  uint32_t max;
+  uint64_t total;
+  uint32_t histogram[TASK_HISTOGRAM_BINS];
+};
+extern struct task_stats task_stats[max_task];
 
 // Major Device Types used by stdio. Occupies one byte in FILE structure.
 // Since there are so few devices, three of the bits serve as flags indicating
@@ -49,6 +66,7 @@ typedef enum __attribute__((packed)) {
 enum cdc_channel {
   cdc_tty = 0,          // /dev/ttyACM0
   cdc_disk,             // /dev/ttyACM1
+  cdc_video,            // /dev/ttyACM2
 };
 
 enum application_error {
@@ -56,6 +74,7 @@ enum application_error {
   disk_input_overflow,
   video_output_overflow,
   usb_interrupt_lost,
+  disk_deadline_missed,
   max_application_error
 };
 
@@ -64,8 +83,20 @@ enum scroll_mode {
   scroll_enhanced = 1,
 };
 
+// How the text screen reaches the terminal: each write as the screen FIFO
+// reports it, or the differences between screen memory and a shadow copy.
+enum video_mode {
+  video_stream = 0,
+  video_shadow = 1,
+};
+
 extern int debug_counter[max_application_error];
 extern enum scroll_mode scroll_mode;
+extern enum video_mode video_mode;
+
+// Least time in ms from the start of one graphics frame to the next, 0 to
+// send none.
+extern unsigned int graphics_interval;
 
 extern FILE *persistence;
 void persistence_init(void);
@@ -76,10 +107,16 @@ void dump_persistence(void);
 // time for something external to complete.
 void yield(void);
 
+int tty_drain(FILE *stream, int itf);
+
 // Operating system call allowing a task to pause as above but without
 // affecting watchdor timer.
 void run_task_list(void);
 
+// Run any ready task with a hard deadline. Long running tasks call this
+// between units of work so the disk byte feed is not held up behind them.
+void run_deadline_tasks(void);
+
 // Put task to sleep for the given number of milliseconds.
 // Operating system call allowing a task to pause and keep pausing until a
 // timer has expired. This uses the system ms jiffie clock so a call msleep(n)
@@ -14,10 +14,13 @@
 #define CLI_PROMPT "a2>"
 
 extern int cli_active;
+extern int cli_running;         // A command or script is in progress
 extern char cli_escape;
 
 int cli(char *in, int s);
 int exec(const char *script);
+// Run a script in the background as if typed. Returns -1 if busy.
+int cli_script(const char *script);
 void cli_reset(void);
 
 #endif /* _CLI_H_ */
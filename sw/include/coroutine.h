@@ -0,0 +1,40 @@
+//
+// coroutine.h - Part of a2fomu - Copyright (c) 2020-2021 Doug Eaton
+//
+// This file is part of a2fomu which is released under the two clause BSD
+// licence.  See file LICENSE in the project root directory or visit the
+// project at https://github.com/elecbrick/a2fomu for full license details.
+
+#ifndef _COROUTINE_H_
+#define _COROUTINE_H_
+
+// Cooperative threads for work that takes longer than a task should, such as
+// CLI commands that wait on the flash. Each runs on its own small stack from
+// a fixed pool and is resumed by the scheduler as the CLI task. A yield()
+// from within one switches back to the main loop rather than running the
+// task list again further down the stack.
+
+#define COROUTINE_MAX        2          // Threads that may exist at once
+#define COROUTINE_STACK_SIZE 2048       // Bytes of stack for each
+
+// Thread being run, NULL when on the main stack.
+extern struct coroutine *coroutine_current;
+
+// Threads started and not yet finished.
+extern volatile int coroutine_count;
+
+// Start entry(arg) on a free stack. It first runs the next time the CLI task
+// is scheduled. Returns -1 with errno EAGAIN if the pool is exhausted.
+int coroutine_start(void (*entry)(void *arg), void *arg);
+
+// Suspend the current thread until the next timer tick or USB event.
+void coroutine_yield(void);
+
+// Scheduler task resuming each thread in turn.
+void coroutine_task(void);
+
+// Save callee saved registers on the current stack, store the stack pointer
+// to *save and continue on the stack given by restore. In crt0.S.
+void coroutine_switch(void **save, void *restore);
+
+#endif /* _COROUTINE_H_ */
@@ -71,8 +71,12 @@ extern struct partial_sector partial_sector;
 extern struct track_cache cache_index[DISK_CACHE_LINES];
 extern uint8_t track_cache[DISK_CACHE_LINES][TRACK_SIZE];
 
-// External entry point for task manager
+// External entry points for task manager
 void disk_task(void);
+void disk_feed_task(void);
 void disk_init(void);
+// Insert a DOS order disk image that is memory mapped in flash into the
+// internal drive. NULL ejects the disk.
+void disk_insert_internal(const uint8_t *image);
 
 #endif /* _DISK_H_ */
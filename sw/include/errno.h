@@ -30,6 +30,7 @@ enum __errno {
   ENOENT,         // No such file or directory
   ENOEXEC,        // Executable file format error
   ENOLCK,         // No locks available
+  ENOSPC,         // No space left on device
   ENOTDIR,        // Not a directory
   EROFS,          // Read-only file system
   ERANGE,         // Result too large
@@ -83,7 +84,6 @@ enum __errno_reserved {
   // ENOMEM,         // Not enough space
   // ENOMSG,         // No message of the desired type
   // ENOPROTOOPT,    // Protocol not available
-  // ENOSPC,         // No space left on device
   // ENOSR,          // No STREAM resources
   // ENOSTR,         // Not a STREAM
   // ENOSYS,         // Function not supported
@@ -0,0 +1,38 @@
+//
+// escape.h - Part of a2fomu - Copyright (c) 2020-2021 Doug Eaton
+//
+// This file is part of a2fomu which is released under the two clause BSD
+// licence.  See file LICENSE in the project root directory or visit the
+// project at https://github.com/elecbrick/a2fomu for full license details.
+
+#ifndef _ESCAPE_H_
+#define _ESCAPE_H_
+
+// Keyboard input from a VT100 or xterm as Apple II keys. Arrow, editing and
+// keypad keys arrive as escape sequences and are decoded one byte at a time
+// by table lookup, the tables being generated from a list of the sequences by
+// bin/genescape.py. Letters are made upper case as that is all an Apple II+
+// understands.
+
+#include <stdint.h>
+
+// Longest sequence. An unknown one is sent to the Apple as typed so this is
+// also the most keys a single byte can produce.
+#define ESCAPE_MAX 8
+
+// Keys the Apple has no code for, which tty_task acts on itself.
+enum escape_command {
+  escape_none,
+  escape_apple_reset,       // NUL or Control-R: reset the 6502
+  escape_redraw,            // Control-L: redraw the terminal
+  escape_function = 0x10,   // Function key n is escape_function+n
+};
+
+// Forget any sequence part way through.
+void escape_reset(void);
+
+// Decode one byte of terminal input. Keys for the Apple, at most ESCAPE_MAX,
+// are written to keys. Returns how many or, for a command, minus the command.
+int escape_key(int c, uint8_t *keys);
+
+#endif /* _ESCAPE_H_ */
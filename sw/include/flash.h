@@ -18,6 +18,7 @@
 // Also here are constants containing the flash memory usage and reserved
 // locations.
 
+#include <stdint.h>
 #include <generated/mem.h>
 
 #define ERASE_SECTOR_SIZE 4096
@@ -55,6 +56,22 @@ int flash_busy(void);
 void flash_task(void);
 void flash_init(void);
 
+// USB Mass Storage statistics displayed by the CLI. Time is only accumulated
+// while the host is issuing back-to-back reads so bytes_read/active_ms gives
+// the transfer rate in kB/s of large file copies.
+struct msc_stats {
+  uint32_t bytes_read;                  // Total bytes returned to host
+  uint32_t bytes_cached;                // Portion served from read-ahead block
+  uint32_t blocks_prefetched;           // 4kB blocks copied into RAM
+  uint32_t active_ms;                   // Time spent in sequential transfers
+};
+extern struct msc_stats msc_stats;
+
+// Discard the mass storage read-ahead block. Must be called by anything that
+// modifies the flash drive behind the back of the USB host; write_flash()
+// does so through fat_flash_write().
+void msc_invalidate(void);
+
 // WARNING: bypass safety checks to write over configuration data
 int write_flash_unsafe(int dst, const void *src, int size);
 
@@ -69,6 +69,8 @@ typedef enum __attribute__((packed)) {   // Occupy one byte in structure
   // The two high order bits of this byte are undefined and reserved and
   // may be used for internal purposes.
   e_contiguous    = 0x40,
+  // Combination marking a VFAT long filename part rather than a file.
+  e_longname      = 0x0F,
 } attribute_t;
 
 typedef enum __attribute__((packed)) {   // Occupy one byte in structure
@@ -116,6 +118,7 @@ typedef struct {
   boot_sector *p_volume;                // Pointer to boot sector
   uint16_t n_dirent;                    // Number of root directory entries
   uint32_t n_fatent;                    // Maximum valid pointer into FAT
+  uint8_t fat_bits;                     // FAT entry size: 12 or 16
   struct dirent *p_rootdir;             // Root directory
   uint8_t *p_fat;                       // Pointer to file allocation table
   uint8_t *p_ino;                       // Pointer to cluster 0
@@ -133,14 +136,28 @@ extern FATFS g_filesystem;
 FILE *fopen(const char* pathname, const char* mode);
 int fclose(FILE* fp);
 
+// Nonstandard: Direct pointer to the contents of a contiguous file.
+const void *fmap(FILE *fp, size_t *length);
+
 // <unistd.h> -- FAT filesystem unbuffered read/write access
 ssize_t read(int fd, void *buf, size_t count);
 ssize_t write(int fd, const void *buf, size_t count);
 off_t lseek(int fd, off_t offset, int whence);
+int fsync(int fd);
 
 // <sys/mount.h>
 int mount(void* filesystem, long opt);
 
+// Called by the flash driver before a region of flash is rewritten so that
+// cached directory information can be discarded.
+void fat_flash_write(int dst, int size);
+
+// Changes on mount and whenever the flash is written.
+extern unsigned fat_generation;
+
+// Nonstandard: Directory entry of an absolute path, or NULL with errno set.
+struct dirent *finddirent(const char *path);
+
 // <dirent.h> -- FAT Directory Entry API
 DIR           *opendir(const char *name);
 int            closedir(DIR *dirp);
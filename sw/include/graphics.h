@@ -0,0 +1,63 @@
+//
+// graphics.h - Part of a2fomu - Copyright (c) 2020-2021 Doug Eaton
+//
+// This file is part of a2fomu which is released under the two clause BSD
+// licence.  See file LICENSE in the project root directory or visit the
+// project at https://github.com/elecbrick/a2fomu for full license details.
+
+#ifndef _GRAPHICS_H_
+#define _GRAPHICS_H_
+
+// Lo-Res and Hi-Res frames for a viewer on the host. Each frame is sent as
+// the differences from the previous one, in blocks of 8 bytes of screen
+// memory, so a still picture costs nothing and a small sprite little more.
+//
+// A frame is a header followed by tokens that together cover every visible
+// byte of the page, in address order with the screen holes left out:
+//   0xA2 'G' flags sequence
+//   0x00-0x3F  n+1 unchanged blocks
+//   0x40-0x7F  n-0x3F bytes follow, each XORed into the previous frame
+//   0x80-0xFF  the following byte is XORed into the next n-0x7E bytes
+// A key frame is XORed into a frame of zeros, which is where a viewer starts.
+
+#include <stdint.h>
+
+#define GRAPHICS_BLOCK        8         // Bytes compared at a time
+// Each 128 bytes of a page hold three 40 byte lines followed by 8 unused
+// bytes, the screen holes.
+#define GRAPHICS_GROUP_BLOCKS 15
+#define GRAPHICS_LORES_BLOCKS (8*GRAPHICS_GROUP_BLOCKS)
+#define GRAPHICS_HIRES_BLOCKS (64*GRAPHICS_GROUP_BLOCKS)
+
+// Room the encoder needs to be sure of fitting the next block: a header,
+// skips over every unchanged block of a Hi-Res page and a changed block.
+#define GRAPHICS_BLOCK_MAX    32
+
+// Frame header flags, from the display soft switches.
+enum graphics_flags {
+  graphics_hires = 1,       // $C057: Hi-Res page, otherwise Lo-Res
+  graphics_page2 = 2,       // $C055: page 2
+  graphics_mixed = 4,       // $C053: last four text lines shown below
+  graphics_key   = 8,       // Viewer clears its frame first
+};
+
+extern uint32_t graphics_frames;        // Frames sent
+extern uint32_t graphics_bytes;         // Bytes in them
+
+// The next frame is a key frame.
+void graphics_reset(void);
+
+// Start comparing the page with what was last sent. Nothing is produced if
+// it has not changed unless the frame is a key frame.
+void graphics_frame(int flags);
+
+// Nonzero while a frame is part way through.
+int graphics_pending(void);
+
+// Compare up to limit blocks of the page at page ($0400 or $2000 in Apple
+// memory, page 2 if selected) and write their encoding to out. Stops when
+// fewer than GRAPHICS_BLOCK_MAX bytes of room are left. Returns the number
+// of bytes written.
+int graphics_encode(uint8_t *out, int room, const void *page, int limit);
+
+#endif /* _GRAPHICS_H_ */
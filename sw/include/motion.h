@@ -0,0 +1,21 @@
+//
+// motion.h - Part of a2fomu - Copyright (c) 2020-2021 Doug Eaton
+//
+// This file is part of a2fomu which is released under the two clause BSD
+// licence.  See file LICENSE in the project root directory or visit the
+// project at https://github.com/elecbrick/a2fomu for full license details.
+
+#ifndef _MOTION_H_
+#define _MOTION_H_
+
+// Cursor motion on an ANSI terminal showing the Apple II text screen.
+
+#define MOTION_ROWS    24
+#define MOTION_COLUMNS 40
+
+// Longest sequence cursor_motion() will queue: "\033[24;40H"
+#define MOTION_MAX     8
+
+int cursor_motion(FILE *stream, int from_v, int from_h, int v, int h);
+
+#endif /* _MOTION_H_ */
@@ -0,0 +1,38 @@
+//
+// render.h - Part of a2fomu - Copyright (c) 2020-2021 Doug Eaton
+//
+// This file is part of a2fomu which is released under the two clause BSD
+// licence.  See file LICENSE in the project root directory or visit the
+// project at https://github.com/elecbrick/a2fomu for full license details.
+
+#ifndef _RENDER_H_
+#define _RENDER_H_
+
+// Terminal output by comparing the Apple II text page with a shadow copy of
+// what the terminal is showing. Only changed characters are sent so the
+// bandwidth used depends on how much of the screen changed rather than on
+// how many writes the 6502 made.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <motion.h>
+
+#define RENDER_ALL_ROWS ((1<<MOTION_ROWS)-1)
+
+// Room needed in the stream to bring one row up to date: a cursor motion,
+// forty characters and an erase to end of line.
+#define RENDER_ROW_MAX (MOTION_MAX+MOTION_COLUMNS+3)
+
+// Terminal cursor: where the next character will appear. The column is 40
+// after the last one was written and the terminal is waiting to wrap.
+extern int render_v, render_h;
+
+// The terminal has just been cleared with the cursor at home.
+void render_reset(void);
+
+// Send what differs between the text page at vram ($0400) and the terminal
+// for the rows whose bits are set. Stops early if the stream runs short of
+// room and returns the rows not yet compared, 0 once all are up to date.
+uint32_t render_update(FILE *stream, const void *vram, uint32_t rows);
+
+#endif /* _RENDER_H_ */
@@ -28,6 +28,7 @@ static inline a2time_t rtc_read (void) {
 
 void timer_isr(void);
 a2time_t activetime(void);
+uint32_t rtc_cycles(void);
 void rtc_init(void);
 
 #endif /* _RTC_H_ */
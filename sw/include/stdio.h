@@ -79,6 +79,24 @@ int getchar(void);
 int ungetc(int c, FILE *stream);
 int cangetc(FILE *stream);
 
+size_t fread(void *ptr, size_t size, size_t nmemb, FILE *stream);
+size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream);
+
+// Nonstandard: Contiguous free or filled part of a character stream buffer
+// for producers and consumers that move whole blocks. Commit what was used.
+size_t fputspan(FILE *stream, unsigned char **span);
+void fputcommit(FILE *stream, size_t n);
+size_t fgetspan(FILE *stream, const unsigned char **span);
+void fgetcommit(FILE *stream, size_t n);
+
+// Nonstandard: n bytes queued whole or not at all. Returns n or EOF.
+int fputseq(FILE *stream, const char *seq, int n);
+
+// Nonstandard: ANSI cursor movement queued whole or not at all. Rows and
+// columns are one-based as in the escape sequences.
+int ansi_cursor(FILE *stream, int row, int column);
+int ansi_column(FILE *stream, int column);
+
 void clearerr(FILE *stream);
 int feof(FILE *stream);
 int ferror(FILE *stream);
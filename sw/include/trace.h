@@ -0,0 +1,51 @@
+//
+// trace.h - Part of a2fomu - Copyright (c) 2020-2021 Doug Eaton
+//
+// This file is part of a2fomu which is released under the two clause BSD
+// licence.  See file LICENSE in the project root directory or visit the
+// project at https://github.com/elecbrick/a2fomu for full license details.
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+// Event trace for finding latency problems. Events are kept in a ring in RAM,
+// the oldest being overwritten, and written out on request by the CLI. The
+// script bin/trace2json.py turns the output into a Chrome trace.
+
+#include <stdint.h>
+#include <stdio.h>
+
+enum trace_type {
+  trace_task_enter = 1,         // id: task number
+  trace_task_exit,              // id: task number
+  trace_isr_enter,              // arg: pending interrupts
+  trace_isr_exit,
+  trace_sector_start,           // id: drive, arg: track<<8 | sector
+  trace_sector_end,             // id: drive, arg: track<<8 | sector
+  trace_flash_state,            // id: new flash controller state
+  trace_usb,                    // id: enum trace_usb, arg: bytes
+};
+
+enum trace_usb {
+  trace_usb_cdc_tx = 0,
+  trace_usb_cdc_rx,
+  trace_usb_msc_read,
+  trace_usb_msc_write,
+};
+
+// One event: 32-bit mcycle timestamp, type, identifier and argument.
+struct trace_event {
+  uint32_t time;
+  uint8_t type;
+  uint8_t id;
+  uint16_t arg;
+};
+
+#define TRACE_EVENTS 512        // Must be a power of two
+
+extern int trace_enabled;
+
+void trace(enum trace_type type, int id, int arg);
+void trace_dump(FILE *stream);
+
+#endif /* _TRACE_H_ */
@@ -98,7 +98,7 @@
 #endif
 
 //------------- CLASS -------------//
-#define CFG_TUD_CDC              2
+#define CFG_TUD_CDC              3
 #define CFG_TUD_MSC              1
 #define CFG_TUD_DFU_RT           0
 
@@ -19,11 +19,15 @@
 #include <flash.h>
 #include <fsfat.h>
 #include <disk.h>
+#include <trace.h>
+#include <coroutine.h>
+#include <graphics.h>
 
 #define ISR_TIME_TRACKING
 #include <perfmon.h>
 
 int cli_active;
+int cli_running;
 char cli_escape = '\\';
 char cli_execute = '\r';
 char cli_command[CMD_BUFFER_LEN];
@@ -94,8 +98,18 @@ void cli_bload(void) {
     size = atox(string);
   }
   // Avoid stdio and just copy the entire raw file, or the subset given by
-  // size, to the destination address
-  read(fileno(file), (void*)address, size);
+  // size, to the destination address. Contiguous files are copied straight
+  // out of the memory mapped flash in one pass.
+  size_t length;
+  const void *image = fmap(file, &length);
+  if(image) {
+    if((size_t)size>length) {
+      size = length;
+    }
+    memcpy((void*)address, image, size);
+  } else {
+    read(fileno(file), (void*)address, size);
+  }
   fclose(file);
 }
 
@@ -161,8 +175,8 @@ void cli_clock(void) {
               return;
   }
   uint32_t control = apple2_control_read();
-  control &= ((1<<CSR_APPLE2_CONTROL_DIVISOR_SIZE)-1)<<
-      CSR_APPLE2_CONTROL_DIVISOR_OFFSET;
+  control &= ~(((1<<CSR_APPLE2_CONTROL_DIVISOR_SIZE)-1)<<
+      CSR_APPLE2_CONTROL_DIVISOR_OFFSET);
   control |= clock<<CSR_APPLE2_CONTROL_DIVISOR_OFFSET;
   apple2_control_write(control);
   // Convert raw clock delay cycles to MHz in fixed point
@@ -188,8 +202,26 @@ void cli_exec(void) {
   exec(strtok(NULL, ""));
 }
 
+// Reset the drives. With a filename, a contiguous 140kB DOS order disk image
+// is inserted into the internal drive and read directly from flash.
 void cli_floppy(void) {
+  char *filename = strtok(NULL, "");
   disk_init();
+  if(filename) {
+    FILE *file = fopen(filename, "rb");
+    if(!file) {
+      printf("file: errno %d\n", errno);
+      return;
+    }
+    size_t length;
+    const uint8_t *image = fmap(file, &length);
+    fclose(file);
+    if(!image || length!=DISK_SIZE) {
+      printf("Not a contiguous disk image\n");
+      return;
+    }
+    disk_insert_internal(image);
+  }
 }
 
 void cli_hex(void) {
@@ -225,6 +257,23 @@ void cli_go(void) {
   apple2_control_write(control & ~(1<<CSR_APPLE2_CONTROL_RESET_OFFSET));
 }
 
+// Most graphics frames per second sent to the viewer, 0 for none.
+void cli_graphics(void) {
+  char *token = strtok(NULL, ", ");
+  int fps;
+  if(token) {
+    fps = atoi(token);
+    graphics_interval = fps>0 ? (1000+fps-1)/fps : 0;
+  }
+  if(graphics_interval) {
+    printf("Up to %u frames/s", 1000/graphics_interval);
+  } else {
+    printf("Graphics off");
+  }
+  printf(", %u sent in %u bytes\n", (unsigned)graphics_frames,
+      (unsigned)graphics_bytes);
+}
+
 void cli_int(void) {
   // TODO Reload ROM with Integer Basic
 }
@@ -275,16 +324,35 @@ void cli_morse(void) {
   stdout->device = a2dev_led;
 }
 
+// Display USB Mass Storage read statistics. Bytes per millisecond is close
+// enough to kB/s for judging the effect of the read-ahead block.
+void cli_msc(void) {
+  char *token;
+  token = strtok(NULL, ", ");
+  if(token && token[0]=='z') {
+    memset(&msc_stats, 0, sizeof(msc_stats));
+  }
+  printf("Read     %u\n", (unsigned)msc_stats.bytes_read);
+  printf("Cached   %u\n", (unsigned)msc_stats.bytes_cached);
+  printf("Blocks   %u\n", (unsigned)msc_stats.blocks_prefetched);
+  printf("Active   %ums\n", (unsigned)msc_stats.active_ms);
+  if(msc_stats.active_ms) {
+    printf("Rate     %ukB/s\n",
+        (unsigned)(msc_stats.bytes_read/msc_stats.active_ms));
+  }
+}
+
 // Print application error counters. The static assert takes no space in the
 // executable but causes the compile to fail if a new counter is added and this
 // file is not updated to display it.
-static_assert(max_application_error==4, "Debug counters inconsistent");
+static_assert(max_application_error==5, "Debug counters inconsistent");
 
 void cli_overflow(void) {
   printf("tty_input_overflow    %d\n", debug_counter[tty_input_overflow]);
   printf("floppy_input_overflow %d\n", debug_counter[disk_input_overflow]);
   printf("video_output_overflow %d\n", debug_counter[video_output_overflow]);
   printf("usb_interrupt_lost    %d\n", debug_counter[usb_interrupt_lost]);
+  printf("disk_deadline_missed  %d\n", debug_counter[disk_deadline_missed]);
 }
 
 // Display the persistent log possibly showing what led up to a crash.
@@ -344,7 +412,8 @@ void cli_sector(void) {
 }
 
 const char *task_name[] = {
-  "USB", "TTY", "LED", "Touch", "CLI", "Keybd", "Video", "Disk" };
+  "USB", "TTY", "LED", "Touch", "CLI", "Keybd", "Video", "Disk", "Feed",
+  "Gfx" };
 static_assert(sizeof(task_name)/sizeof(task_name[0])==max_task,
     "Missing task from list of names");
 
@@ -352,30 +421,112 @@ typedef union lw {
   long long unsigned int q;
   unsigned int l[2];
 } q2l;
-  
+
+// Percentage of a 64-bit total. Both are first scaled down so that only a 32
+// bit division is needed; 64-bit division is not available.
+static unsigned percent(a2time_t part, a2time_t total) {
+  while(total>>24) {
+    part >>= 1;
+    total >>= 1;
+  }
+  return total ? (100*(unsigned)part+(unsigned)total/2)/(unsigned)total : 0;
+}
+
+// Task run times in cycles. "times dump" prints the same figures, with the
+// whole histogram, one task per line for processing on the host and "times
+// reset" starts collecting afresh.
 void cli_times(void) {
-  a2time_t total=0, pct;
+  a2time_t total=0;
   enum task_num task;
+  struct task_stats *stats;
+  char *token = strtok(NULL, ", ");
+  if(token && strcmp(token, "reset")==0) {
+    memset(task_stats, 0, sizeof(task_stats));
+    return;
+  }
+  if(token && strcmp(token, "dump")==0) {
+    printf("task,calls,total_hi,total_lo,max");
+    for(int bin=0; bin<TASK_HISTOGRAM_BINS; bin++) {
+      printf(",h%d", bin);
+    }
+    putchar('\n');
+    for(task=0; task<max_task; task++) {
+      stats = &task_stats[task];
+      printf("%s,%u,%u,%u,%u", task_name[task], (unsigned)stats->calls,
+          ((q2l)stats->total).l[1], ((q2l)stats->total).l[0],
+          (unsigned)stats->max);
+      for(int bin=0; bin<TASK_HISTOGRAM_BINS; bin++) {
+        printf(",%u", (unsigned)stats->histogram[bin]);
+      }
+      putchar('\n');
+      yield();
+    }
+    return;
+  }
   for(task=0; task<max_task; task++) {
-    total += task_runtime[task];
+    total += task_stats[task].total;
   }
   total += isr_runtime;
+  printf("Task    %%      calls  max cycles  histogram log2(cycles):count\n");
   for(task=0; task<max_task; task++) {
-    pct=(100*task_runtime[task]+50)/total; ///total; TODO compiles to ebreak
-    printf("%5s %c %2u%% %u\n", task_name[task], active_tasks&(1<<task)?'A':' ',
-        (unsigned)pct, (unsigned)(task_runtime[task]));
+    stats = &task_stats[task];
+    printf("%5s %c %2u%% %10u %11u ", task_name[task],
+        active_tasks&(1<<task)?'A':' ', percent(stats->total, total),
+        (unsigned)stats->calls, (unsigned)stats->max);
+    for(int bin=0; bin<TASK_HISTOGRAM_BINS; bin++) {
+      if(stats->histogram[bin]) {
+        printf(" %d:%u", bin, (unsigned)stats->histogram[bin]);
+      }
+    }
+    putchar('\n');
+    yield();
   }
   if(isr_runtime>0) {
-    printf("ISR   %2d%% %u\n", (int)((100*isr_runtime+50)/total), (int)(isr_runtime));
+    printf("ISR   %2d%% %u\n", percent(isr_runtime, total), (int)(isr_runtime));
   }
   printf("Time  --- %d\n", (unsigned)rtc_read()/1000); // (int)(total>>32)
   printf("Total Interrupts: %d Time: %08x %08x\n", isr_count,
       ((q2l)total).l[1], ((q2l)total).l[0]);
 }
 
+// Trace ring: "trace" writes it out for bin/trace2json.py, "trace on" and
+// "trace off" control recording.
+void cli_trace(void) {
+  char *token = strtok(NULL, ", ");
+  if(!token) {
+    trace_dump(stdout);
+  } else if(strcmp(token, "on")==0) {
+    trace_enabled = 1;
+  } else if(strcmp(token, "off")==0) {
+    trace_enabled = 0;
+  } else {
+    printf("trace [on|off]\n");
+  }
+}
+
 void cli_upload(void) {
 }
 
+void cli_video(void) {
+  char *token;
+  token = strtok(NULL, ", ");
+  if(token) {
+    if(token[0]=='s' && token[1]=='h') {
+      video_mode = video_shadow;
+    } else {
+      video_mode = video_stream;
+    }
+  } else {
+    // Flip between the two
+    video_mode = !video_mode;
+  }
+  if(video_mode==video_shadow) {
+    printf("Shadow framebuffer\n");
+  } else {
+    printf("Screen write stream\n");
+  }
+}
+
 void cli_zero(void) {
   char *token;
   token = strtok(NULL, ", ");
@@ -432,18 +583,22 @@ struct cli_command_entry cli_command_list[] = {
   {"floppy",    cli_floppy},
   {"fp",        cli_fp},
   {"go",        cli_go},
+  {"graphics",  cli_graphics},
   {"hex",       cli_hex},
   {"int",       cli_int},
   {"install",   cli_install},
   {"ls",        cli_catalog},
   {"morse",     cli_morse},
+  {"msc",       cli_msc},
   {"overflow",  cli_overflow},
   {"persistence", cli_persistence},
   {"reset",     cli_reset},
   {"scroll",    cli_scroll},
   {"sector",    cli_sector},
   {"times",     cli_times},
+  {"trace",     cli_trace},
   {"upload",    cli_upload},
+  {"video",     cli_video},
   {"x",         cli_hex},
   {"zero",      cli_zero},
 };
@@ -468,6 +623,29 @@ void cli_parse(char *command_line) {
   printf("i:%d, len:%d, cmd:[%s]\n", i, strlen(command), command);
 }
 
+// Commands and scripts run as a coroutine so one that waits, such as install
+// for the flash, leaves the scheduler free to run everything else. The tty
+// holds further input back until it finishes.
+static void cli_thread(void *command_line) {
+  cli_parse(command_line);
+  cli_running = 0;
+  task_ready(tty_task_active);
+}
+
+static void cli_script_thread(void *script_name) {
+  exec(script_name);
+  cli_running = 0;
+  task_ready(tty_task_active);
+}
+
+int cli_script(const char *script_name) {
+  if(coroutine_start(cli_script_thread, (void*)script_name)<0) {
+    return -1;
+  }
+  cli_running = 1;
+  return 0;
+}
+
 // Collect characters one at a time to build command in buffer
 // Handle editing via backspace and (TODO) arrow keys.
 int cli(char *in, int s) {
@@ -475,6 +653,11 @@ int cli(char *in, int s) {
   char *p = in;
   int alerted = 0;
   //fputs("cli:", stderr);
+  if(cli_running) {
+    // The command line buffer is still in use; discard until it finishes
+    putchar('\a');
+    return s;
+  }
   if(!cli_active) {
     puts(CLI_PROMPT);
     cli_active=1;
@@ -522,19 +705,45 @@ int cli(char *in, int s) {
     *cmd_ptr = '\0';
     p++;
     //fprintf(stderr, "parse(%s):", cli_command);
-    cli_parse(cli_command);
     cli_active=0;
+    if(coroutine_start(cli_thread, cli_command)<0) {
+      printf("Busy: errno %d\n", errno);
+    } else {
+      cli_running = 1;
+    }
   }
 
   return p-in;
 }
 
+// Fetch the next line of a script into the command buffer. Contiguous
+// scripts are read in place from flash rather than through stdio.
+static void exec_line(FILE *script, const char **map, const char *end) {
+  const char *src = *map;
+  char *dst = cli_command;
+  if(src) {
+    while(src<end && dst<cli_command+sizeof(cli_command)-1) {
+      if((*dst++ = *src++)=='\n') {
+        break;
+      }
+    }
+    *dst = '\0';
+    *map = src;
+  } else {
+    fgets(cli_command, sizeof(cli_command), script);
+  }
+}
+
 int exec(const char*script_name) {
   FILE *script;
+  const char *map, *end;
+  size_t length = 0;
   script = fopen(script_name, "r");
   if(script) {
+    map = fmap(script, &length);
+    end = map+length;
     do {
-      fgets(cli_command, sizeof(cli_command), script);
+      exec_line(script, &map, end);
       if(cli_command[0]=='\0') {
         break;
       }
@@ -559,6 +768,7 @@ int exec(const char*script_name) {
       // Process stdout again.
       yield();
     } while(1);
+    fclose(script);
   } else {
     if(errno==ENOENT) {
       printf("Failed to execute HELLO: errno %d\n", errno);
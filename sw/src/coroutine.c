@@ -0,0 +1,89 @@
+//
+// coroutine.c - Part of a2fomu - Copyright (c) 2020-2021 Doug Eaton
+//
+// This file is part of a2fomu which is released under the two clause BSD
+// licence.  See file LICENSE in the project root directory or visit the
+// project at https://github.com/elecbrick/a2fomu for full license details.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+#include <a2fomu.h>
+#include <coroutine.h>
+
+// Frame pushed by coroutine_switch: ra, s0-s11 and padding to keep the stack
+// pointer 16 byte aligned as the calling convention requires.
+#define COROUTINE_FRAME 16
+#define COROUTINE_WORDS (COROUTINE_STACK_SIZE/4)
+
+// Lowest word of each stack. Finding it changed after a thread has run means
+// the stack overflowed into whatever precedes it.
+#define COROUTINE_GUARD 0x5a5aa5a5
+
+struct coroutine {
+  uint32_t stack[COROUTINE_WORDS];      // Must be first to stay aligned
+  void *sp;                             // Stack pointer while suspended
+  void (*entry)(void *arg);             // NULL when this slot is free
+  void *arg;
+};
+
+static struct coroutine coroutine_pool[COROUTINE_MAX]
+    __attribute__((aligned(16)));
+struct coroutine *coroutine_current;
+volatile int coroutine_count;
+static void *scheduler_sp;
+
+// First code run on a new stack, reached by the return of the switch that
+// first resumes it. The slot is freed before the final switch; nothing can
+// claim it until the scheduler is back on its own stack.
+static void coroutine_entry(void) {
+  struct coroutine *self = coroutine_current;
+  (*self->entry)(self->arg);
+  self->entry = NULL;
+  coroutine_count--;
+  coroutine_switch(&self->sp, scheduler_sp);
+}
+
+int coroutine_start(void (*entry)(void *arg), void *arg) {
+  struct coroutine *co;
+  for(co=coroutine_pool; co<coroutine_pool+COROUTINE_MAX; co++) {
+    if(!co->entry) {
+      uint32_t *sp = &co->stack[COROUTINE_WORDS-COROUTINE_FRAME];
+      sp[0] = (uintptr_t)coroutine_entry;       // Saved ra
+      co->stack[0] = COROUTINE_GUARD;
+      co->sp = sp;
+      co->entry = entry;
+      co->arg = arg;
+      coroutine_count++;
+      task_ready(cli_task_active);
+      return 0;
+    }
+  }
+  errno = EAGAIN;
+  return -1;
+}
+
+void coroutine_yield(void) {
+  struct coroutine *self = coroutine_current;
+  // Threads wait on time, the flash or room in a USB buffer. The interrupt
+  // handler readies the CLI task on each timer tick and USB event while any
+  // thread exists, so the main loop can still sleep in between.
+  coroutine_switch(&self->sp, scheduler_sp);
+}
+
+void coroutine_task(void) {
+  struct coroutine *co;
+  for(co=coroutine_pool; co<coroutine_pool+COROUTINE_MAX; co++) {
+    if(co->entry) {
+      coroutine_current = co;
+      coroutine_switch(&scheduler_sp, co->sp);
+      coroutine_current = NULL;
+      if(co->stack[0]!=COROUTINE_GUARD) {
+        fprintf(persistence, "Coroutine %d stack overflow\n",
+            (int)(co-coroutine_pool));
+        co->stack[0] = COROUTINE_GUARD;
+      }
+      run_deadline_tasks();
+    }
+  }
+}
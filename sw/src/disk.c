@@ -18,6 +18,7 @@
 #include <flash.h>
 #include <generated/mem.h>
 #include <crc.h>
+#include <trace.h>
 
 #define FAST_PERFMON
 #include <perfmon.h>
@@ -29,6 +30,8 @@ struct track_cache cache_index[DISK_CACHE_LINES];
 uint8_t track_cache[DISK_CACHE_LINES][TRACK_SIZE];
 uint8_t cache_validated[DISK_CACHE_LINES];
 struct partial_sector partial_sector;
+// Disk image in the internal drive. Sectors are read in place from flash.
+static const uint8_t *internal_image;
 uint32_t last_crc;
 int disk_diagnostics;  // Debug and Performance flags
 
@@ -45,6 +48,13 @@ uint8_t interleave33_l2p[16] = { 0x0, 0xD, 0xB, 0x9, 0x7, 0x5, 0x3, 0x1,
 // Returns location in cache if the requested LOGICAL sector is cached.
 uint8_t *iscached(int drive, int track, int sector) {
   uint8_t *addr = NULL;
+  if(drive==disk_internal && internal_image) {
+    // The whole image is memory mapped. Wait only while flash is programming.
+    if(flash_busy()) {
+      return NULL;
+    }
+    return (uint8_t*)internal_image+track*TRACK_SIZE+sector*SECTOR_SIZE;
+  }
   #ifdef SIMULATION
     // Avoid USB transfers for faster startup during simulation
     addr = &track_cache[drive][sector*SECTOR_SIZE];
@@ -288,6 +298,9 @@ int active_READwrite;
 #define RWTSVOLUME (A2RAM_BASE+0x37EB)
 
 #define SECTOR_HEADER_SIZE 16
+// Sync bytes between the address field and the data field, beyond the one
+// at the start of data_prologue. DOS 3.3 formats the gap with 5 to 10.
+#define DATA_GAP_SIZE 5
 uint8_t hbuf[SECTOR_HEADER_SIZE] =
     { 0xFF, 0xFF, 0xD5, 0xAA, 0x96, 0,0, 0,0, 0,0, 0,0, 0xDE, 0xAA, 0xEB };
 
@@ -436,6 +449,7 @@ void disk_update_head(int drive) {
     //dump("nbuf1:", nbuf1);
     //dump("nbuf2:", nbuf2);
     sector_state = head_header;
+    trace(trace_sector_start, drive, active_track<<8 | active_sector);
     a2perf_t delay = perfmon_end(perftime);
     if(delay.ms>2) {
       printf("{i%d.%u}", (int)delay.ms, (unsigned)delay.ck);
@@ -449,13 +463,16 @@ void disk_update_head(int drive) {
       //printf("[t%ds%d]", active_track, active_sector);   // Debug
       putchar('a'+active_sector);
       sector_state = head_read;
-      active_byte = -4;
+      active_byte = -4-DATA_GAP_SIZE;
       prev = 0;
     }
   } else if(sector_state==head_read) {
     int data;
-    if(active_byte<0) {
-      // Prologue - 3 bytes
+    if(active_byte<-4) {
+      // Gap between the address and data fields - sync bytes
+      data = 0xFF;
+    } else if(active_byte<0) {
+      // Prologue - sync byte and 3 bytes
       data = data_prologue[active_byte+4];
     } else if(active_byte<86) {
       // nbuf2 - 86 bytes
@@ -474,6 +491,7 @@ void disk_update_head(int drive) {
       data = data_epilogue[active_byte-343];
       if(active_byte>=345) {
         sector_state=head_inactive;
+        trace(trace_sector_end, drive, active_track<<8 | active_sector);
 //      if(active_track>2) {
 //        // Advance to next sector as this one has completed
 //        active_sector = (active_sector+1)&15;
@@ -836,55 +854,52 @@ void disk_controller_task(void) {
       disk_drive[drive].track2x = 68;
     }
   }
-  if(disk_drive[drive].wanted) {
-    if(!(status&(1<<CSR_APPLE2_DISKCTRL_PENDING_OFFSET))) {
-      disk_update_head(drive);
-      if(sector_state!=head_inactive) {
-        a2perf_t perftime;
-        perfmon_start(&perftime);
-        a2time_t ms=system_ticks;
-        timer0_update_value_write(1);
-        unsigned ck = timer0_value_read();
-        //uint64_t start = (ms+1)*(CONFIG_CLOCK_FREQUENCY/1000)-ck;
-        int local_watchdog=0;
-        // Speed up apple clock so it can read a sector in less than 1ms to
-        // prevent the watchdog timer from tripping.
-        uint32_t control = apple2_control_read();
-        apple2_control_write(control&((1<<CSR_APPLE2_CONTROL_DIVISOR_SIZE)-1)<<
-            CSR_APPLE2_CONTROL_DIVISOR_OFFSET);
-        // Now send entire sector as long as each byte is read within a few
-        // microseconds.
-        while(local_watchdog++<5 && sector_state!=head_inactive) {
-          //fputc('s'+local_watchdog, debugfile);
-          status=apple2_diskctrl_read();
-          if(status&(1<<CSR_APPLE2_DISKCTRL_PENDING_OFFSET)) {
-            disk_update_head(drive);
-            local_watchdog=0;
-          }
-        }
-        // Restore clock to configured value
-        apple2_control_write(control);
-        a2time_t mse=system_ticks;
-        timer0_update_value_write(1);
-        unsigned cke = timer0_value_read();
-        //uint64_t start = (ms+1)*(CONFIG_CLOCK_FREQUENCY/1000)-ck;
-        a2perf_t delay = perfmon_end(perftime);
-        if(mse-ms>10) {
-          printf("{t%dms, %dus/12 -- w%d -- d%d.%u}\n",
-              (int)(mse-ms), (int)(ck-cke), local_watchdog,
-              (int)delay.ms, (unsigned)delay.ck);
-        };
-        if(delay.ms>0) {
-          //printf("{ds%u}", (unsigned)delay);
-        }
-      }
-    } else {
-      //fputc('w', debugfile);
+  if(disk_drive[drive].motor || disk_drive[drive].wanted) {
+    // Bytes are passed under the head by the deadline task.
+    task_ready(disk_feed_task_active);
+  }
+}
+
+// The Apple reads a disk byte every 32us, which is 384 cycles at 12MHz.
+#define DISK_BYTE_CYCLES 384
+
+// Hard deadline task: hand the controller its next byte as soon as the last
+// one has been read. It stays ready while the motor of the selected drive is
+// on, as reading a full latch clears Wanted until the 6502 polls again. The
+// lateness clock starts on the first pass that finds the byte consumed and
+// stops at the write that refills the latch. A byte within a sector that took
+// more than a byte time is counted as missed, as a real drive would have moved
+// on without it.
+void disk_feed_task(void) {
+  static uint32_t empty_since;
+  static char empty_seen;
+  int status = apple2_diskctrl_read();
+  if(!(status&(1<<CSR_APPLE2_DISKCTRL_MOTOR_OFFSET|
+      1<<CSR_APPLE2_DISKCTRL_WANTED_OFFSET))) {
+    empty_seen = 0;
+    return;
+  }
+  task_ready(disk_feed_task_active);
+  if(status&(1<<CSR_APPLE2_DISKCTRL_PENDING_OFFSET)) {
+    return;
+  }
+  if(!empty_seen) {
+    empty_since = rtc_cycles();
+    empty_seen = 1;
+  }
+  if(!(status&(1<<CSR_APPLE2_DISKCTRL_WANTED_OFFSET))) {
+    return;
+  }
+  // Only runs that pass a byte are traced; run_task() leaves this task out.
+  trace(trace_task_enter, disk_feed_task_active, 0);
+  disk_update_head((status>>CSR_APPLE2_DISKCTRL_DRIVE_OFFSET)&1);
+  trace(trace_task_exit, disk_feed_task_active, 0);
+  if(apple2_diskctrl_read()&(1<<CSR_APPLE2_DISKCTRL_PENDING_OFFSET)) {
+    if(sector_state!=head_inactive &&
+        rtc_cycles()-empty_since>DISK_BYTE_CYCLES) {
+      debug_counter[disk_deadline_missed]++;
     }
-  } else if(sector_state!=head_inactive) {
-    // TODO Timing is terrible - use a static variable or interrupt
-    //sector_state = head_inactive;
-    //fputc('-', debugfile);
+    empty_seen = 0;
   }
 }
 
@@ -893,6 +908,16 @@ void disk_task(void) {
   internal_disk_task();
   external_disk_buffer_management();
   flash_task();
+  // The Apple expects a new byte every 32us while a drive is spinning and the
+  // controller has no interrupt, so keep running rather than wait for a tick.
+  if(disk_drive[0].motor || disk_drive[1].motor || flash_busy()) {
+    task_ready(disk_task_active);
+  }
+}
+
+void disk_insert_internal(const uint8_t *image) {
+  internal_image = image;
+  cache_index[disk_internal].track = 255;
 }
 
 void disk_init(void) {
@@ -26,6 +26,7 @@ const char* const _sys_errlist[_MAX_ERROR] = {
   [ENOENT]        = "No such file or directory",
   [ENOEXEC]       = "Executable file format error",
   [ENOLCK]        = "No locks available",
+  [ENOSPC]        = "No space left on device",
   [ENOTDIR]       = "Not a directory",
   [EROFS]         = "Read-only file system",
   [ERANGE]        = "Result too large",         // Required by STD C.
@@ -43,7 +44,6 @@ const char* const __attribute__((section (".a2folib0"))) __sys_errlist_extension
   [EINTR]         = "Interrupted call",
   [ENOBUFS]       = "No buffer space available",
   [ENOMEM]        = "Not enough space",
-  [ENOSPC]        = "No space left on device",
   [ENOSYS]        = "Function not supported",
   [ENOTEMPTY]     = "Directory not empty",
   [ENOTSUP]       = "Not supported",
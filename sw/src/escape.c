@@ -0,0 +1,59 @@
+//
+// escape.c - Part of a2fomu - Copyright (c) 2020-2021 Doug Eaton
+//
+// This file is part of a2fomu which is released under the two clause BSD
+// licence.  See file LICENSE in the project root directory or visit the
+// project at https://github.com/elecbrick/a2fomu for full license details.
+
+// Escape sequence decoder.
+//
+// Each byte costs a lookup of its column and of the next state in the table
+// generated by bin/genescape.py, whatever the state. The bytes of a sequence
+// are kept until it is known so that one that does not match, most likely
+// the ESC key followed by another key, can be passed on as typed.
+
+#include <stdint.h>
+#include <ctype.h>
+#include <escape.h>
+#include <escape_table.h>
+
+static uint8_t state, length;
+static uint8_t seen[ESCAPE_MAX];
+
+void escape_reset(void) {
+  state = 0;
+  length = 0;
+}
+
+int escape_key(int c, uint8_t *keys) {
+  int next = escape_next[state][c&0x80 ? 0 : escape_class[c]];
+  const uint8_t *action;
+  int n;
+
+  if(next && next<ESCAPE_ACTION) {
+    seen[length++] = c;
+    state = next;
+    return 0;
+  }
+  state = 0;
+  if(next) {
+    length = 0;
+    action = escape_action[next-ESCAPE_ACTION];
+    if(!action[0]) {
+      return -action[1];
+    }
+    keys[0] = action[0];
+    if(!action[1]) {
+      return 1;
+    }
+    keys[1] = action[1];
+    return 2;
+  }
+  // Not a known sequence: the keys as typed
+  for(n=0; n<length; n++) {
+    keys[n] = toupper(seen[n]);
+  }
+  keys[n++] = toupper(c);
+  length = 0;
+  return n;
+}
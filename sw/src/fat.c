@@ -74,7 +74,7 @@ uint16_t align16 (const uint8_t* ptr) {
 
 // Load a 4-byte little-endian word from unaligned memory
 uint32_t align32 (const uint8_t* ptr) {
-  return (((ptr[3]<<8)|(ptr[2]<< 8))|(ptr[1]<<8))|ptr[0];
+  return (ptr[3]<<24)|(ptr[2]<<16)|(ptr[1]<<8)|ptr[0];
 }
 
 //-----------------------------------------------------------------------
@@ -112,27 +112,57 @@ static void *lookup_fat(int cluster) {
   return g_filesystem.p_ino+cluster*FLASHFS_SECTOR_SIZE;
 }
 
+//-----------------------------------------------------------------------
+// FAT window - The FAT is read through a small RAM copy. Every byte fetched
+// from the memory mapped flash is a separate SPI transaction while following
+// a chain touches neighbouring entries over and over. One extra byte holds
+// the second half of a FAT12 entry that straddles the end of the window.
+// Flash being written reads back as status rather than data so nothing is
+// kept from it until the write completes.
+//-----------------------------------------------------------------------
+#define FAT_WINDOW_SIZE FATFS_SECTOR_SIZE
+static uint8_t fat_window[FAT_WINDOW_SIZE+1];
+static int fat_window_start = -1;
+
+static const uint8_t *fat_entry(unsigned offset) {
+  if(flash_busy()) {
+    return g_filesystem.p_fat+offset;
+  }
+  if(fat_window_start<0 || offset<(unsigned)fat_window_start ||
+      offset>=(unsigned)fat_window_start+FAT_WINDOW_SIZE) {
+    fat_window_start = offset&~(FAT_WINDOW_SIZE-1);
+    memcpy(fat_window, g_filesystem.p_fat+fat_window_start,
+        FAT_WINDOW_SIZE+1);
+  }
+  return fat_window+offset-fat_window_start;
+}
+
 //-----------------------------------------------------------------------
 // FAT access - Read value of a FAT entry
-// Return:  0..0xFFF: Value in FAT for given cluster
-//         -1:        Error, cluster out of range for this filesystem
+// Return:  0..0xFFF:  Value in FAT12 for given cluster
+//          0..0xFFFF: Value in FAT16 for given cluster
+//         -1:         Error, cluster out of range for this filesystem
 //-----------------------------------------------------------------------
 int next_cluster(uint32_t cluster) {
-  unsigned byte_pair, cluster_pair;
+  unsigned byte_pair;
+  const uint8_t *entry;
 
   // Verify cluster is valid for this filesystem. 
   if(cluster<2 || cluster>=g_filesystem.n_fatent) {
     errno = EBADF;
     return -1;
   }
+  if(g_filesystem.fat_bits==16) {
+    // FAT16 entries are aligned halfwords.
+    entry = fat_entry(cluster*2);
+    return (entry[1]<<8)|entry[0];
+  }
   // Each FAT entry is 12 bits. Read the two bytes containing the entry.
   // Two entries are in three bytes so multiply by 1.5 to get a 24-bit pair
-  cluster_pair = cluster+cluster/2;
+  entry = fat_entry(cluster+cluster/2);
   // The bytes may be crossing a word boundary so read independently.
-  // They may also cross a sector boundary but this assumes the entire FAT is
-  // resident in memory.
-  byte_pair = g_filesystem.p_fat[cluster_pair++];
-  byte_pair |= g_filesystem.p_fat[cluster_pair] << 8;
+  byte_pair = entry[0];
+  byte_pair |= entry[1] << 8;
   // Finally, get the bits into the right position and mask off bits from the
   // other sector in the trio of bytes. Even numbered clusters have extra bits
   // above the MSB that need to be masked off while odd numbered clusters have
@@ -170,11 +200,10 @@ void _opendir(DIR *dir_p, struct dirent *ent_p) {
 
 //-----------------------------------------------------------------------
 // Close a directory stream. Easy enough. We could NULLify the pointers but
-// nothing needs to be done so why bother. It will be no different from
-// unitinialized.
+// all that is needed is to return the FILE it occupies to the pool.
 //-----------------------------------------------------------------------
 int closedir(DIR *dirp) {
-  (void)dirp;
+  ((FILE*)dirp)->device = a2dev_none;   // Release the stream for reuse
   return 0;
 }
 
@@ -293,8 +322,9 @@ struct dirent *readdir(DIR *dirp) {
           dirp->next_d = NULL;
         }
       } else {
-        // Subdirectory that needs to follow cluster chain.
-        clust = next_cluster(cluster_number(dirp->next_d));
+        // Subdirectory that needs to follow cluster chain from the cluster
+        // holding the entry just returned.
+        clust = next_cluster(cluster_number(entp));
         if(clust<2 || clust >= g_filesystem.n_fatent) {
           // Normal end of directory. Set state so NULL is returned next time.
           // TODO Should be able to signal error on subsequent read as well in
@@ -307,7 +337,7 @@ struct dirent *readdir(DIR *dirp) {
       }
     }
   }
-  if(entp->filename[0]=='\0') {
+  if(entp && entp->filename[0]=='\0') {
     // A filename starting with '\0' indicates no further entries exist and
     // that this is the end of the directory.
     entp = NULL;
@@ -367,17 +397,510 @@ struct dirent *scandir(DIR* dirp, char *pattern) {
   return foundp;
 }
 
+
+//╔═══════════════════════════════════════════════════════════════════════════╗
+//║                                                                           ║
+//║      Long filenames - VFAT name parts stored ahead of the 8.3 entry       ║
+//║                                                                           ║
+//╚═══════════════════════════════════════════════════════════════════════════╝
+
+// A long name is split into parts of 13 UCS-2 characters, each in a directory
+// entry with the attribute bits of a volume label plus read-only, hidden and
+// system. The parts are numbered from 1 and stored in reverse order directly
+// ahead of the 8.3 entry. The part stored first has 0x40 added to its number.
+// Every part carries a checksum of the 8.3 name to tie them to it. Names are
+// kept folded to upper case ASCII for case-insensitive comparison. Any other
+// character becomes 0xFF which can never match a path.
+#define FAT_LFN_PARTS     20            // 255 characters maximum
+#define FAT_LFN_CHARS     13            // Characters per part
+#define FAT_LFN_MAX       (FAT_LFN_PARTS*FAT_LFN_CHARS)
+#define FAT_LFN_LAST      0x40          // Flag on the part holding the end
+
+typedef struct {
+  uint32_t seen;                        // Bit n-1 set once part n is stored
+  uint8_t parts;                        // Number of parts, 0 if not yet known
+  uint8_t checksum;                     // Checksum of 8.3 name in every part
+  uint16_t length;                      // Characters in name
+  uint8_t name[FAT_LFN_MAX+1];          // Folded name, NUL terminated
+} fat_lfn;
+
+// Only one name is assembled at a time.
+static fat_lfn fat_lfn_buf;
+
+// Offsets of the 13 characters within a long name directory entry.
+static const uint8_t fat_lfn_offset[FAT_LFN_CHARS] = {
+  1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30
+};
+
+static int fat_is_lfn(const struct dirent *entp) {
+  return (entp->attributes&0x3F)==e_longname;
+}
+
+static void fat_lfn_reset(fat_lfn *lfn) {
+  lfn->seen = 0;
+  lfn->parts = 0;
+}
+
+//-----------------------------------------------------------------------
+// Checksum of an 8.3 name as stored in each of its long name parts.
+//-----------------------------------------------------------------------
+static uint8_t fat_lfn_checksum(const uint8_t *name) {
+  uint8_t sum = 0;
+  for(int i=0; i<11; i++) {
+    sum = ((sum&1)<<7)+(sum>>1)+name[i];
+  }
+  return sum;
+}
+
+//-----------------------------------------------------------------------
+// Store one long name part. Parts may be added in either order. A part that
+// does not belong with those already stored starts a new name.
+//-----------------------------------------------------------------------
+static void fat_lfn_add(fat_lfn *lfn, const struct dirent *entp) {
+  const uint8_t *raw = (const uint8_t*)entp;
+  int part = raw[0]&0x1F;
+  int pos, i;
+  unsigned c;
+
+  if(part<1 || part>FAT_LFN_PARTS) {
+    fat_lfn_reset(lfn);
+    return;
+  }
+  if(lfn->seen && (raw[13]!=lfn->checksum || (lfn->seen&(1<<(part-1))) ||
+      (lfn->parts && (raw[0]&FAT_LFN_LAST)) ||
+      (lfn->parts && part>lfn->parts))) {
+    fat_lfn_reset(lfn);
+  }
+  lfn->seen |= 1<<(part-1);
+  lfn->checksum = raw[13];
+  if(raw[0]&FAT_LFN_LAST) {
+    lfn->parts = part;
+    lfn->length = part*FAT_LFN_CHARS;
+  }
+  pos = (part-1)*FAT_LFN_CHARS;
+  for(i=0; i<FAT_LFN_CHARS; i++, pos++) {
+    c = raw[fat_lfn_offset[i]]|raw[fat_lfn_offset[i]+1]<<8;
+    if(c==0) {
+      // Name ends before the part is full. The rest is 0xFFFF filler.
+      if(raw[0]&FAT_LFN_LAST) {
+        lfn->length = pos;
+      }
+      break;
+    }
+    if(c>='a' && c<='z') {
+      c = c+'A'-'a';
+    }
+    lfn->name[pos] = c<0x80 ? c : 0xFF;
+  }
+}
+
+//-----------------------------------------------------------------------
+// Finish a long name with the 8.3 entry that follows its parts.
+// Return: The folded long name or NULL if the entry has none
+//-----------------------------------------------------------------------
+static const uint8_t *fat_lfn_name(fat_lfn *lfn, const struct dirent *entp) {
+  const uint8_t *name = NULL;
+  if(lfn->parts && lfn->seen==(1u<<lfn->parts)-1 &&
+      lfn->checksum==fat_lfn_checksum(entp->filename)) {
+    lfn->name[lfn->length] = '\0';
+    name = lfn->name;
+  }
+  fat_lfn_reset(lfn);
+  return name;
+}
+
+//-----------------------------------------------------------------------
+// Compare a folded long name with a path component of the given length.
+//-----------------------------------------------------------------------
+static int fat_lfn_match(const uint8_t *lname, const char *name, int length) {
+  int i, c;
+  for(i=0; i<length; i++) {
+    c = name[i];
+    if(c>='a' && c<='z') {
+      c = c+'A'-'a';
+    }
+    if(lname[i]!=c) {
+      return 0;
+    }
+  }
+  return lname[length]=='\0';
+}
+
+//-----------------------------------------------------------------------
+// Entry stored before entp in directory dirp, following the cluster chain
+// backwards if needed.
+// Return: Entry or NULL if entp is the first in the directory
+//-----------------------------------------------------------------------
+static struct dirent *fat_prev_entry(struct dirent *dirp, struct dirent *entp) {
+  int clust, next, target;
+  if((void*)dirp==(void*)g_filesystem.p_volume) {
+    return entp>g_filesystem.p_rootdir ? entp-1 : NULL;
+  }
+  if(cluster_offset(entp)) {
+    return entp-1;
+  }
+  target = cluster_number(entp);
+  for(clust=dirp->first_cluster; clust>=2 &&
+      (unsigned)clust<g_filesystem.n_fatent; clust=next) {
+    next = next_cluster(clust);
+    if(next==target) {
+      return (struct dirent*)lookup_fat(next)-1;
+    }
+  }
+  return NULL;
+}
+
+//-----------------------------------------------------------------------
+// Collect the long name of an 8.3 entry by walking back over its parts.
+// Return: The folded long name or NULL if the entry has none
+//-----------------------------------------------------------------------
+static const uint8_t *fat_long_name(struct dirent *dirp, struct dirent *entp) {
+  struct dirent *prev = entp;
+  fat_lfn_reset(&fat_lfn_buf);
+  for(int n=0; n<FAT_LFN_PARTS; n++) {
+    prev = fat_prev_entry(dirp, prev);
+    if(!prev || !fat_is_lfn(prev) || prev->filename[0]==0xE5) {
+      break;
+    }
+    fat_lfn_add(&fat_lfn_buf, prev);
+    if(prev->filename[0]&FAT_LFN_LAST) {
+      break;
+    }
+  }
+  return fat_lfn_name(&fat_lfn_buf, entp);
+}
+
+//-----------------------------------------------------------------------
+// Find a long name in a directory in a single pass.
+// Return: Directory entry or NULL with errno set to ENOENT
+//-----------------------------------------------------------------------
+static struct dirent *fat_scan_long(struct dirent *dirp, const char *name,
+    int length) {
+  DIR dir_s;
+  struct dirent *entp;
+  const uint8_t *lname;
+
+  _opendir(&dir_s, dirp);
+  fat_lfn_reset(&fat_lfn_buf);
+  while((entp = readdir(&dir_s))) {
+    if(entp->filename[0]==0xE5) {
+      fat_lfn_reset(&fat_lfn_buf);
+    } else if(fat_is_lfn(entp)) {
+      if(entp->filename[0]&FAT_LFN_LAST) {
+        fat_lfn_reset(&fat_lfn_buf);
+      }
+      fat_lfn_add(&fat_lfn_buf, entp);
+    } else {
+      lname = fat_lfn_name(&fat_lfn_buf, entp);
+      if(lname && !(entp->attributes&e_volume) &&
+          fat_lfn_match(lname, name, length)) {
+        return entp;
+      }
+    }
+  }
+  errno = ENOENT;
+  return NULL;
+}
+
+
+//╔═══════════════════════════════════════════════════════════════════════════╗
+//║                                                                           ║
+//║     Directory cache - Hash of 8.3 names to entries built at mount time    ║
+//║                                                                           ║
+//╚═══════════════════════════════════════════════════════════════════════════╝
+
+// Every open walks the directory in flash comparing 11 bytes per entry. A
+// small open addressed hash table in RAM maps (parent, name) to the entry so
+// exact names are found with one or two probes. Entries are stored as their
+// index from the start of the root directory plus one so zero marks an empty
+// slot. The parent of entries in the root directory is zero. Wildcard patterns
+// still use scandir() as they may match many names. An entry with a long name
+// is added a second time hashed by that name. Every probe is confirmed
+// against the entry itself so the two kinds of slot need not be told apart.
+#define DIRCACHE_SLOTS    512           // Power of two
+#define DIRCACHE_ENTRIES  (DIRCACHE_SLOTS*3/4)
+#define DIRCACHE_DEPTH    8             // Maximum subdirectory nesting cached
+
+typedef struct {
+  uint16_t entry;                       // Directory entry index+1, 0 if empty
+  uint16_t parent;                      // Parent directory entry index+1
+} dircache_slot;
+
+static dircache_slot dircache[DIRCACHE_SLOTS];
+static int dircache_count;
+// Clusters holding subdirectories. A write to one of these or to the boot
+// sector, FAT or root directory invalidates the cache.
+static uint8_t dircache_clusters[FLASHFS_NUM_SECTORS/8+1];
+static enum { dircache_invalid, dircache_valid, dircache_overflow }
+    dircache_state;
+
+//-----------------------------------------------------------------------
+// Convert a directory entry pointer to and from the cached index form.
+// Return: 0: the root directory (represented by the volume)
+//        -1: not representable in 16 bits
+//-----------------------------------------------------------------------
+static int dircache_index(const struct dirent *entp) {
+  int index;
+  if((void*)entp==(void*)g_filesystem.p_volume) {
+    return 0;
+  }
+  index = entp-g_filesystem.p_rootdir+1;
+  if(index<1 || index>UINT16_MAX) {
+    return -1;
+  }
+  return index;
+}
+
+static struct dirent *dircache_entry(int index) {
+  return g_filesystem.p_rootdir+index-1;
+}
+
+//-----------------------------------------------------------------------
+// Hash an 8.3 or long name together with the directory containing it. Case
+// is folded so a path component hashes the same as the name stored.
+// Shift and add only as the processor has no multiplier.
+//-----------------------------------------------------------------------
+static unsigned dircache_hash(int parent, const uint8_t *name, int length) {
+  unsigned hash = parent;
+  int c;
+  for(int i=0; i<length; i++) {
+    c = name[i];
+    if(c>='a' && c<='z') {
+      c = c+'A'-'a';
+    }
+    hash = ((hash<<5)+hash)^c;
+  }
+  return (hash^(hash>>9))&(DIRCACHE_SLOTS-1);
+}
+
+//-----------------------------------------------------------------------
+// Place an entry in the first free slot at or after its hash.
+// Return: 0: success
+//        -1: table full
+//-----------------------------------------------------------------------
+static int dircache_insert(int parent, int index, unsigned slot) {
+  if(dircache_count>=DIRCACHE_ENTRIES) {
+    return -1;
+  }
+  while(dircache[slot].entry) {
+    slot = (slot+1)&(DIRCACHE_SLOTS-1);
+  }
+  dircache[slot].entry = index;
+  dircache[slot].parent = parent;
+  dircache_count++;
+  return 0;
+}
+
+//-----------------------------------------------------------------------
+// Add all entries of a directory and, recursively, its subdirectories.
+// Return: 0: success
+//        -1: table full or entry out of range. Cache must not be used.
+//-----------------------------------------------------------------------
+static int dircache_add(struct dirent *dirp, int depth) {
+  DIR dir_s;
+  struct dirent *entp;
+  const uint8_t *lname;
+  int parent, index, clust, length;
+
+  parent = dircache_index(dirp);
+  if(parent<0 || depth>DIRCACHE_DEPTH) {
+    return -1;
+  }
+  _opendir(&dir_s, dirp);
+  fat_lfn_reset(&fat_lfn_buf);
+  while((entp = readdir(&dir_s))) {
+    // Skip deleted files and volume labels while collecting long filename
+    // parts. The dot entries are skipped to avoid looping back up the tree.
+    if(entp->filename[0]==0xE5) {
+      fat_lfn_reset(&fat_lfn_buf);
+      continue;
+    }
+    if(fat_is_lfn(entp)) {
+      if(entp->filename[0]&FAT_LFN_LAST) {
+        fat_lfn_reset(&fat_lfn_buf);
+      }
+      fat_lfn_add(&fat_lfn_buf, entp);
+      continue;
+    }
+    lname = fat_lfn_name(&fat_lfn_buf, entp);
+    if((entp->attributes&e_volume) || entp->filename[0]=='.') {
+      continue;
+    }
+    index = dircache_index(entp);
+    if(index<0 || dircache_insert(parent, index,
+        dircache_hash(parent, entp->filename, 11))) {
+      return -1;
+    }
+    if(lname) {
+      for(length=0; lname[length]; length++)
+        ;
+      if(dircache_insert(parent, index,
+          dircache_hash(parent, lname, length))) {
+        return -1;
+      }
+    }
+    if(entp->attributes&e_directory) {
+      // Remember where the subdirectory lives so writes to it are noticed.
+      for(clust=entp->first_cluster; clust>=2 &&
+          clust<(int)g_filesystem.n_fatent &&
+          clust<(int)sizeof(dircache_clusters)*8; clust=next_cluster(clust)) {
+        dircache_clusters[clust/8] |= 1<<(clust&7);
+      }
+      if(dircache_add(entp, depth+1)) {
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+//-----------------------------------------------------------------------
+// Rebuild the directory cache from the filesystem in flash. The flash must
+// be in memory mapped mode and not in the middle of being programmed.
+//-----------------------------------------------------------------------
+static void dircache_build(void) {
+  memset(dircache, 0, sizeof(dircache));
+  memset(dircache_clusters, 0, sizeof(dircache_clusters));
+  dircache_count = 0;
+  if(dircache_add((struct dirent*)(void*)g_filesystem.p_volume, 0)) {
+    dircache_state = dircache_overflow;
+  } else {
+    dircache_state = dircache_valid;
+  }
+  debug("dircache %d entries state %d\n", dircache_count, dircache_state);
+}
+
+// Incremented on mount and on every flash write. Anything that remembers
+// directory entries compares this with the value it saw.
+unsigned fat_generation;
+
+//-----------------------------------------------------------------------
+// Notification from the flash driver that a region is about to be rewritten.
+// Discard the cache if any filesystem metadata is affected. It is rebuilt
+// on the next lookup.
+//-----------------------------------------------------------------------
+void fat_flash_write(int dst, int size) {
+  uint8_t *start = (uint8_t*)(SPIFLASH_BASE+dst);
+  uint8_t *end = start+size;
+  int clust;
+
+  // The USB host must not be given the old contents of a sector saved here
+  msc_invalidate();
+  // Forget resolved paths. Any write may be the directory entry one names.
+  fat_generation++;
+  if(!g_filesystem.p_volume) {
+    return;
+  }
+  if(end>g_filesystem.p_fat && start<(uint8_t*)g_filesystem.p_rootdir) {
+    // Reload the FAT window on next access
+    fat_window_start = -1;
+  }
+  if(end>(uint8_t*)g_filesystem.p_volume &&
+      start<g_filesystem.p_ino+2*FLASHFS_SECTOR_SIZE) {
+    // Boot sector, FAT or root directory
+    dircache_state = dircache_invalid;
+    return;
+  }
+  // Subdirectory clusters are only known while the cache is valid.
+  clust = cluster_number(start);
+  if(dircache_state==dircache_valid && clust>0 &&
+      (dircache_clusters[clust/8]&(1<<(clust&7)))) {
+    dircache_state = dircache_invalid;
+  }
+}
+
+//-----------------------------------------------------------------------
+// Find an exact 8.3 name within a directory using the cache.
+// Return: Directory entry or NULL with errno set to ENOENT
+//-----------------------------------------------------------------------
+static struct dirent *dircache_find(struct dirent *dirp, const char *name) {
+  int parent = dircache_index(dirp);
+  unsigned slot = dircache_hash(parent, (const uint8_t*)name, 11);
+  struct dirent *entp;
+
+  while(dircache[slot].entry) {
+    if(dircache[slot].parent==parent) {
+      entp = dircache_entry(dircache[slot].entry);
+      if(!memcmp(entp->filename, name, 11)) {
+        return entp;
+      }
+    }
+    slot = (slot+1)&(DIRCACHE_SLOTS-1);
+  }
+  errno = ENOENT;
+  return NULL;
+}
+
+//-----------------------------------------------------------------------
+// Return true if the cache is up to date, rebuilding it if possible.
+//-----------------------------------------------------------------------
+static int dircache_ready(void) {
+  if(dircache_state==dircache_invalid && !flash_busy()) {
+    dircache_build();
+  }
+  return dircache_state==dircache_valid;
+}
+
+//-----------------------------------------------------------------------
+// Return true if the cache may be used to look up this name.
+//-----------------------------------------------------------------------
+static int dircache_usable(const char *name) {
+  for(int i=0; i<11; i++) {
+    if(name[i]=='*') {
+      return 0;
+    }
+  }
+  return dircache_ready();
+}
+
+//-----------------------------------------------------------------------
+// Find a long name, as given in a path component of the given length,
+// within a directory. The index is used when valid, otherwise the directory
+// is scanned once.
+// Return: Directory entry or NULL with errno set to ENOENT
+//-----------------------------------------------------------------------
+static struct dirent *fat_find_long(struct dirent *dirp, const char *name,
+    int length) {
+  struct dirent *entp;
+  const uint8_t *lname;
+  unsigned slot;
+  int parent;
+
+  if(length<1 || length>FAT_LFN_MAX) {
+    errno = ENOENT;
+    return NULL;
+  }
+  if(!dircache_ready()) {
+    return fat_scan_long(dirp, name, length);
+  }
+  parent = dircache_index(dirp);
+  for(slot=dircache_hash(parent, (const uint8_t*)name, length);
+      dircache[slot].entry;
+      slot=(slot+1)&(DIRCACHE_SLOTS-1)) {
+    if(dircache[slot].parent==parent) {
+      entp = dircache_entry(dircache[slot].entry);
+      lname = fat_long_name(dirp, entp);
+      if(lname && fat_lfn_match(lname, name, length)) {
+        return entp;
+      }
+    }
+  }
+  errno = ENOENT;
+  return NULL;
+}
+
 //-----------------------------------------------------------------------
 // Find named file in hierarchy
     // EOK(0): successful, !=0: error code
     // Directory object to return last directory and found object
     // Full-path string to find a file or directory
 //-----------------------------------------------------------------------
-struct dirent *finddirent(const char* path) {
+static struct dirent *fat_resolve(const char* path) {
   char filename[12];
   DIR dir_s;
-  int i, c, in_ext, long_filename;
-  struct dirent *de_p = (struct dirent*)(void*)g_filesystem.p_volume;
+  int i, c, in_ext, long_filename, not_short, length;
+  const char *component;
+  struct dirent *dir_p, *de_p = (struct dirent*)(void*)g_filesystem.p_volume;
 
   // This OS does not have a current directory so everyting starts at the root.
   // The first entry of the root directory could be a subdirectory so a special
@@ -396,10 +919,12 @@ struct dirent *finddirent(const char* path) {
   for (;;) {
     _opendir(&dir_s, de_p);
     // Munge filename into format that matches directory entry
-    i = in_ext = long_filename = 0;
+    i = in_ext = long_filename = not_short = 0;
+    component = path;
     // Loop for each character in a name
     for (;;) {
       c = *path++;
+      length = path-1-component;
       if(c=='\0') {
         // End of input path
         break;
@@ -411,6 +936,7 @@ struct dirent *finddirent(const char* path) {
       }
       if (c=='.') {
         // Fill remainder of basename with spaces and move to extenstion
+        not_short |= in_ext;
         in_ext = 1;
         for( ; i<8; i++) {
           filename[i] = ' ';
@@ -438,6 +964,7 @@ struct dirent *finddirent(const char* path) {
       if(in_ext) {
         if(i>=11) {
           // Ignore extension character after the first three.
+          not_short = 1;
           continue;
         }
       } else {
@@ -471,8 +998,31 @@ struct dirent *finddirent(const char* path) {
       filename[7] = '*';
     }
     filename[11] = '\0';
-    // Find an object with the chosen name in the current directory
-    de_p = scandir(&dir_s, filename);
+    // Find an object with the chosen name in the current directory. A name
+    // that could be a short name is tried as one first. Otherwise it is looked
+    // up by long name, falling back to the ~N wildcard for entries that were
+    // given no long name.
+    dir_p = de_p;
+    de_p = NULL;
+    errno = ENOENT;
+    if(!long_filename && !not_short) {
+      if(dircache_usable(filename)) {
+        de_p = dircache_find(dir_p, filename);
+      } else {
+        de_p = scandir(&dir_s, filename);
+      }
+    }
+    if(!de_p && errno==ENOENT) {
+      de_p = fat_find_long(dir_p, component, length);
+    }
+    if(!de_p && errno==ENOENT && long_filename) {
+      _opendir(&dir_s, dir_p);
+      de_p = scandir(&dir_s, filename);
+      if(de_p && fat_long_name(dir_p, de_p)) {
+        errno = ENOENT;
+        de_p = NULL;
+      }
+    }
     if(!de_p) {
       // Either no object found, multiple objects found, or some internal
       // error occurred. errno has been set appropriately so return NULL.
@@ -491,14 +1041,577 @@ struct dirent *finddirent(const char* path) {
       de_p = NULL;
       break;
     }
-    // Close current directory and open next level directory the entry of which
-    // already happens to be in de_p.
-    (void)closedir(&dir_s);
+    // Move on to the next level directory the entry of which already happens
+    // to be in de_p. The directory on the stack needs no closing.
   }
   debug("finddirent %08x\n", (unsigned)de_p);
   return de_p;
 }
 
+//╔═══════════════════════════════════════════════════════════════════════════╗
+//║                                                                           ║
+//║        Path cache - Recently resolved full paths and their entries        ║
+//║                                                                           ║
+//╚═══════════════════════════════════════════════════════════════════════════╝
+
+// Scripts tend to open the same few files again and again. Resolving a path
+// parses every component and long names need a wildcard scan of the whole
+// directory to prove the match is unique. The last few successful lookups
+// are remembered by their exact path string. An entry is only used while
+// fat_generation is unchanged since it was stored.
+#define PATHCACHE_SLOTS   8
+#define PATHCACHE_NAME    40            // Longer paths are not cached
+
+typedef struct {
+  struct dirent *entp;                  // Result of the lookup
+  unsigned generation;                  // Value of fat_generation when stored
+  unsigned used;                        // Time of last use for LRU
+  uint16_t hash;                        // Quick check before comparing path
+  char path[PATHCACHE_NAME];
+} pathcache_slot;
+
+static pathcache_slot pathcache[PATHCACHE_SLOTS];
+static unsigned pathcache_clock;
+
+//-----------------------------------------------------------------------
+// Hash a path. Return its length in *length or PATHCACHE_NAME if too long.
+//-----------------------------------------------------------------------
+static unsigned pathcache_hash(const char *path, int *length) {
+  unsigned hash = 0;
+  int i;
+  for(i=0; path[i] && i<PATHCACHE_NAME; i++) {
+    hash = ((hash<<5)+hash)^(uint8_t)path[i];
+  }
+  *length = i;
+  return (hash^(hash>>16))&0xFFFF;
+}
+
+//-----------------------------------------------------------------------
+// Find a file or directory by its absolute path.
+// Return: Directory entry or NULL with errno set
+//-----------------------------------------------------------------------
+struct dirent *finddirent(const char* path) {
+  pathcache_slot *slot, *victim = pathcache;
+  struct dirent *de_p;
+  int length;
+  unsigned hash = pathcache_hash(path, &length);
+
+  if(length<PATHCACHE_NAME) {
+    for(slot=pathcache; slot<pathcache+PATHCACHE_SLOTS; slot++) {
+      if(slot->entp && slot->generation==fat_generation &&
+          slot->hash==hash && !memcmp(slot->path, path, length+1)) {
+        slot->used = ++pathcache_clock;
+        return slot->entp;
+      }
+      // Replace a stale entry or else the least recently used one.
+      if(victim->entp && victim->generation==fat_generation &&
+          (!slot->entp || slot->generation!=fat_generation ||
+           slot->used<victim->used)) {
+        victim = slot;
+      }
+    }
+  }
+  de_p = fat_resolve(path);
+  // Flash being written reads back as status so a result found during a
+  // write is not kept.
+  if(de_p && length<PATHCACHE_NAME && !flash_busy()) {
+    victim->entp = de_p;
+    victim->generation = fat_generation;
+    victim->used = ++pathcache_clock;
+    victim->hash = hash;
+    memcpy(victim->path, path, length+1);
+  }
+  return de_p;
+}
+
+
+//╔═══════════════════════════════════════════════════════════════════════════╗
+//║                                                                           ║
+//║      Extent map - Cluster chain of each open file decoded at fopen()      ║
+//║                                                                           ║
+//╚═══════════════════════════════════════════════════════════════════════════╝
+
+// Files copied onto a freshly formatted drive are almost always contiguous.
+// The FAT chain is decoded once when the file is opened into a short list of
+// runs of consecutive clusters so read() and lseek() need only arithmetic.
+// A file more fragmented than the list allows is still readable; clusters
+// beyond the last extent are found by continuing along the FAT chain.
+#define FAT_MAX_EXTENTS 8
+
+typedef struct {
+  uint16_t first;                       // First cluster of run
+  uint16_t count;                       // Number of consecutive clusters
+} fat_extent;
+
+static fat_extent file_extent[FOPEN_MAX][FAT_MAX_EXTENTS];
+static uint8_t file_extents[FOPEN_MAX]; // Number of extents in use
+static off_t file_base[FOPEN_MAX];      // File offset of start of buffer
+
+//-----------------------------------------------------------------------
+// Decode up to max runs of the cluster chain starting at clust.
+// Return: Number of extents filled in. The cluster following the last one
+//         decoded, or the end of chain mark, is stored in next.
+//-----------------------------------------------------------------------
+static int fat_map_chain(fat_extent *ext, int max, int clust, int *next) {
+  int n = 0;
+  unsigned limit = g_filesystem.n_fatent;
+
+  // The limit guards against loops in a corrupted FAT.
+  while(clust>=2 && (unsigned)clust<g_filesystem.n_fatent && limit--) {
+    if(n && clust==ext[n-1].first+ext[n-1].count) {
+      ext[n-1].count++;
+    } else if(n<max) {
+      ext[n].first = clust;
+      ext[n].count = 1;
+      n++;
+    } else {
+      break;
+    }
+    clust = next_cluster(clust);
+  }
+  *next = clust;
+  return n;
+}
+
+//-----------------------------------------------------------------------
+// Decode the cluster chain starting at clust into the extent list of fd.
+//-----------------------------------------------------------------------
+static void fat_map_file(int fd, int clust) {
+  int next;
+  file_extents[fd] = fat_map_chain(file_extent[fd], FAT_MAX_EXTENTS, clust,
+      &next);
+  debug("fat_map_file fd %d extents %d\n", fd, file_extents[fd]);
+}
+
+//-----------------------------------------------------------------------
+// Translate a cluster index within a file to a cluster number.
+// Return: 2..n_fatent-1: cluster number
+//        -1:             index is past the end of the cluster chain
+//-----------------------------------------------------------------------
+static int fat_file_cluster(int fd, int index) {
+  fat_extent *ext = file_extent[fd];
+  int i, n = file_extents[fd];
+  int clust;
+
+  for(i=0; i<n; i++) {
+    if(index<ext[i].count) {
+      return ext[i].first+index;
+    }
+    index -= ext[i].count;
+  }
+  if(!n) {
+    return -1;
+  }
+  // Fragmented beyond the extent list. Follow the chain from its last entry.
+  clust = ext[n-1].first+ext[n-1].count-1;
+  while(index-->=0) {
+    clust = next_cluster(clust);
+    if(clust<2 || (unsigned)clust>=g_filesystem.n_fatent) {
+      return -1;
+    }
+  }
+  return clust;
+}
+
+//-----------------------------------------------------------------------
+// Make the cluster at the given index within the file the stdio buffer. The
+// valid data in the last cluster is limited to the size of the file.
+// Return: 0: success
+//        -1: cluster does not exist
+//-----------------------------------------------------------------------
+static int fat_load_cluster(int fd, int index) {
+  FILE* file_p = &_file[fd];
+  struct dirent *dir_p = (struct dirent*)file_p->minor;
+  int clust = fat_file_cluster(fd, index);
+  off_t remaining;
+
+  if(clust<0) {
+    return -1;
+  }
+  file_base[fd] = (off_t)index*FLASHFS_SECTOR_SIZE;
+  remaining = dir_p->file_size-file_base[fd];
+  file_p->_loc = clust;                 // Cluster currently in buffer
+  file_p->buffer = lookup_fat(clust);   // Data is read in place from flash
+  file_p->_max = FLASHFS_SECTOR_SIZE;   // Buffer size
+  file_p->head = 0;                     // Reset read pointer
+  file_p->tail = remaining<FLASHFS_SECTOR_SIZE ? remaining : FLASHFS_SECTOR_SIZE;
+  return 0;
+}
+
+
+//╔═══════════════════════════════════════════════════════════════════════════╗
+//║                                                                           ║
+//║     File writing - Cluster allocation and batched FAT/directory updates   ║
+//║                                                                           ║
+//╚═══════════════════════════════════════════════════════════════════════════╝
+
+// Every flash update erases and programs a whole 4kB sector so metadata is
+// not touched per cluster. Newly allocated clusters are collected as runs
+// and the FAT and directory entry are rewritten only when the run list is
+// full or the file is flushed. Updates are ordered so that a crash leaves
+// at worst unreferenced clusters:
+//   1. File data is written to clusters the FAT still marks free.
+//   2. The FAT is updated to chain the new clusters onto the file.
+//   3. The directory entry is updated with the new size.
+// Truncation is the reverse: the directory entry is cleared before the old
+// chain is released. A sector being erased is itself lost if power fails
+// during the few milliseconds it takes to reprogram.
+//
+// One file may be open for writing at a time. The single sector buffer holds
+// file data and is reused to stage FAT and directory sectors once that data
+// has reached the flash.
+#define FAT_EOC (g_filesystem.fat_bits==16 ? 0xFFFF : 0xFFF) // End of chain
+
+// A set of FAT changes. Runs are chained in order with link pointing at the
+// first and the last marked end of chain, or are all freed if release is set.
+typedef struct {
+  fat_extent run[FAT_MAX_EXTENTS];      // Clusters to be chained or freed
+  uint8_t n;                            // Runs in use
+  uint8_t release;                      // Free rather than chain the runs
+  uint16_t link;                        // Cluster to point at first run
+} fat_change;
+
+static struct {
+  FILE *file_p;                         // File open for writing, NULL if none
+  struct dirent *slot;                  // Location of entry in directory
+  struct dirent entry;                  // Entry as it will be written
+  fat_change pending;                   // Clusters allocated since last commit
+  uint16_t last;                        // Last cluster of the file
+  uint16_t buffered;                    // Cluster holding buffer, 0 if new
+  int fill;                             // Bytes of data in buffer
+} fat_writer;
+static uint8_t fat_buffer[FLASHFS_SECTOR_SIZE];
+
+//-----------------------------------------------------------------------
+// Replace one sector of the filesystem and wait for the flash to finish.
+// Other tasks keep running while the sector is erased and programmed.
+// Return: 0: success
+//        -1: errno EIO if the sector did not verify
+//-----------------------------------------------------------------------
+static int fat_write_sector(uint8_t *addr, const void *src) {
+  int dst = addr-(uint8_t*)SPIFLASH_BASE;
+  while(!write_flash(dst, src, FLASHFS_SECTOR_SIZE)) {
+    yield();
+  }
+  if(memcmp(addr, src, FLASHFS_SECTOR_SIZE)) {
+    errno = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+//-----------------------------------------------------------------------
+// Set a FAT entry in a window holding part of the FAT. The window starts at
+// byte offset base within the FAT. Bytes of a FAT12 entry outside the window
+// are left for the pass over the neighbouring sector.
+//-----------------------------------------------------------------------
+static void fat_set(uint8_t *window, int base, unsigned cluster,
+    unsigned value) {
+  int pair = cluster+cluster/2-base;
+  uint8_t lo, hi, lo_keep, hi_keep;
+
+  if(g_filesystem.fat_bits==16) {
+    pair = cluster*2-base;
+    lo = value;         lo_keep = 0x00;
+    hi = value>>8;      hi_keep = 0x00;
+  } else if(cluster&1) {
+    lo = value<<4;      lo_keep = 0x0F;
+    hi = value>>4;      hi_keep = 0x00;
+  } else {
+    lo = value;         lo_keep = 0x00;
+    hi = (value>>8)&0xF; hi_keep = 0xF0;
+  }
+  if(pair>=0 && pair<FLASHFS_SECTOR_SIZE) {
+    window[pair] = (window[pair]&lo_keep)|lo;
+  }
+  if(pair+1>=0 && pair+1<FLASHFS_SECTOR_SIZE) {
+    window[pair+1] = (window[pair+1]&hi_keep)|hi;
+  }
+}
+
+//-----------------------------------------------------------------------
+// Apply a set of changes to every FAT copy rewriting only the sectors that
+// are affected.
+//-----------------------------------------------------------------------
+static int fat_write_changes(const fat_change *chg) {
+  boot_sector *volume = g_filesystem.p_volume;
+  int sectors = align16(volume->sectors_per_fat);
+  int copy, sector, i;
+  unsigned clust, end, value;
+  uint8_t *window = fat_buffer;
+  uint8_t *addr;
+
+  for(copy=0; copy<volume->num_fats; copy++) {
+    for(sector=0; sector<sectors; sector++) {
+      addr = g_filesystem.p_fat+(copy*sectors+sector)*FLASHFS_SECTOR_SIZE;
+      memcpy(window, addr, FLASHFS_SECTOR_SIZE);
+      if(chg->link) {
+        fat_set(window, sector*FLASHFS_SECTOR_SIZE, chg->link,
+            chg->n ? chg->run[0].first : FAT_EOC);
+      }
+      for(i=0; i<chg->n; i++) {
+        end = chg->run[i].first+chg->run[i].count;
+        for(clust=chg->run[i].first; clust<end; clust++) {
+          if(chg->release) {
+            value = 0;
+          } else if(clust+1<end) {
+            value = clust+1;
+          } else {
+            value = i+1<chg->n ? chg->run[i+1].first : FAT_EOC;
+          }
+          fat_set(window, sector*FLASHFS_SECTOR_SIZE, clust, value);
+        }
+      }
+      if(memcmp(window, addr, FLASHFS_SECTOR_SIZE) &&
+          fat_write_sector(addr, window)) {
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+//-----------------------------------------------------------------------
+// Free a cluster chain a batch of runs at a time. The next batch is located
+// before the FAT is rewritten.
+//-----------------------------------------------------------------------
+static int fat_release_chain(int clust) {
+  fat_change chg;
+
+  chg.release = 1;
+  chg.link = 0;
+  while(clust>=2 && (unsigned)clust<g_filesystem.n_fatent) {
+    chg.n = fat_map_chain(chg.run, FAT_MAX_EXTENTS, clust, &clust);
+    if(fat_write_changes(&chg)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+//-----------------------------------------------------------------------
+// Return true if the cluster was allocated but not yet recorded in the FAT.
+//-----------------------------------------------------------------------
+static int fat_pending(unsigned clust) {
+  const fat_change *chg = &fat_writer.pending;
+  for(int i=0; i<chg->n; i++) {
+    if(clust>=chg->run[i].first && clust<chg->run[i].first+chg->run[i].count) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+//-----------------------------------------------------------------------
+// Allocate a free cluster for the file being written. The cluster following
+// the last one is preferred so files stay contiguous and can be mapped.
+// Return: cluster number or -1 with errno ENOSPC if the volume is full
+//-----------------------------------------------------------------------
+static int fat_alloc(void) {
+  fat_change *chg = &fat_writer.pending;
+  unsigned clust = fat_writer.last+1;
+  unsigned tries;
+
+  for(tries=g_filesystem.n_fatent; tries; tries--, clust++) {
+    if(clust<2 || clust>=g_filesystem.n_fatent) {
+      clust = 2;
+    }
+    if(next_cluster(clust)==0 && !fat_pending(clust)) {
+      break;
+    }
+  }
+  if(!tries) {
+    errno = ENOSPC;
+    return -1;
+  }
+  if(chg->n && clust==chg->run[chg->n-1].first+chg->run[chg->n-1].count) {
+    chg->run[chg->n-1].count++;
+  } else if(chg->n<FAT_MAX_EXTENTS) {
+    chg->run[chg->n].first = clust;
+    chg->run[chg->n].count = 1;
+    chg->n++;
+  } else {
+    // Caller commits before starting a new cluster so this cannot happen.
+    errno = EIO;
+    return -1;
+  }
+  fat_writer.last = clust;
+  return clust;
+}
+
+//-----------------------------------------------------------------------
+// Write the data buffer to its cluster, allocating one if necessary. The
+// unused tail is left erased so later appends need only program it.
+//-----------------------------------------------------------------------
+static int fat_write_data(void) {
+  int clust = fat_writer.buffered;
+
+  if(!clust) {
+    clust = fat_alloc();
+    if(clust<0) {
+      return -1;
+    }
+  }
+  memset(fat_buffer+fat_writer.fill, 0xFF,
+      FLASHFS_SECTOR_SIZE-fat_writer.fill);
+  if(fat_write_sector(lookup_fat(clust), fat_buffer)) {
+    return -1;
+  }
+  if(fat_writer.fill==FLASHFS_SECTOR_SIZE) {
+    fat_writer.fill = 0;
+    fat_writer.buffered = 0;
+  } else {
+    fat_writer.buffered = clust;
+  }
+  return 0;
+}
+
+//-----------------------------------------------------------------------
+// Rewrite the directory sector holding the entry of the file being written.
+//-----------------------------------------------------------------------
+static int fat_write_entry(void) {
+  uint8_t *sector = (uint8_t*)((uintptr_t)fat_writer.slot&
+      ~(FLASHFS_SECTOR_SIZE-1));
+  memcpy(fat_buffer, sector, FLASHFS_SECTOR_SIZE);
+  memcpy(fat_buffer+((uint8_t*)fat_writer.slot-sector),
+      &fat_writer.entry, sizeof(struct dirent));
+  return fat_write_sector(sector, fat_buffer);
+}
+
+//-----------------------------------------------------------------------
+// Record all clusters written so far in the FAT and then the directory.
+// The data buffer is overwritten so it must already be on flash.
+//-----------------------------------------------------------------------
+static int fat_commit(void) {
+  fat_change *chg = &fat_writer.pending;
+
+  if(chg->n) {
+    if(!chg->link) {
+      // First clusters of an empty file are referenced by the entry itself.
+      fat_writer.entry.first_cluster = chg->run[0].first;
+    }
+    if(fat_write_changes(chg)) {
+      return -1;
+    }
+    chg->link = fat_writer.last;
+    chg->n = 0;
+  }
+  if(memcmp(fat_writer.slot, &fat_writer.entry, sizeof(struct dirent))) {
+    return fat_write_entry();
+  }
+  return 0;
+}
+
+//-----------------------------------------------------------------------
+// Convert the last component of a path to a blank padded 8.3 name.
+// Return: 0: success
+//        -1: errno ENAMETOOLONG or EINVAL if the name cannot be created
+//-----------------------------------------------------------------------
+static int fat_short_name(const char *path, uint8_t *name) {
+  int i = 0, c, limit = 8;
+
+  memset(name, ' ', 11);
+  while(*path=='/' || *path=='\\') {
+    path++;
+  }
+  while((c = *path++)) {
+    if(c=='.' && limit==8) {
+      i = 8;
+      limit = 11;
+      continue;
+    }
+    if(c=='/' || c=='\\' || c=='*' || c=='.' || c<=' ') {
+      errno = EINVAL;
+      return -1;
+    }
+    if(i>=limit) {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+    if(c>='a' && c<='z') {
+      c = c+'A'-'a';
+    }
+    name[i++] = c;
+  }
+  if(name[0]==' ') {
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+//-----------------------------------------------------------------------
+// Prepare a file for writing. An existing entry is truncated or positioned
+// at its end for appending. A new file is created in the root directory; its
+// entry is not written until there is something to record.
+//-----------------------------------------------------------------------
+static int fat_open_write(FILE *file_p, struct dirent *dirp, const char *path,
+    int append) {
+  int fd = fileno(file_p);
+  int i, last;
+
+  memset(&fat_writer, 0, sizeof(fat_writer));
+  // Nothing may be left from the file that last used this descriptor
+  file_extents[fd] = 0;
+  memset(file_extent[fd], 0, sizeof(file_extent[fd]));
+  if(dirp) {
+    fat_writer.slot = dirp;
+    fat_writer.entry = *dirp;
+    if(!append || !dirp->file_size) {
+      // Truncate: forget the chain in the directory first, then free it.
+      fat_writer.entry.first_cluster = 0;
+      fat_writer.entry.file_size = 0;
+      if(dirp->first_cluster) {
+        if(fat_write_entry() || fat_release_chain(dirp->first_cluster)) {
+          return -1;
+        }
+      }
+    }
+  } else {
+    for(i=0; i<g_filesystem.n_dirent; i++) {
+      dirp = &g_filesystem.p_rootdir[i];
+      if(dirp->filename[0]=='\0' || dirp->filename[0]==0xE5) {
+        break;
+      }
+    }
+    if(i>=g_filesystem.n_dirent) {
+      errno = ENOSPC;
+      return -1;
+    }
+    if(fat_short_name(path, fat_writer.entry.filename)) {
+      return -1;
+    }
+    // No calendar clock exists so time stamps are left at zero.
+    fat_writer.slot = dirp;
+    fat_writer.entry.attributes = e_archive;
+  }
+  if(fat_writer.entry.file_size) {
+    // Continue from the end of the last cluster.
+    fat_map_file(fd, fat_writer.entry.first_cluster);
+    last = fat_file_cluster(fd,
+        (fat_writer.entry.file_size-1)/FLASHFS_SECTOR_SIZE);
+    if(last<0) {
+      errno = EBADF;
+      return -1;
+    }
+    fat_writer.last = last;
+    fat_writer.pending.link = last;
+    fat_writer.fill = fat_writer.entry.file_size&(FLASHFS_SECTOR_SIZE-1);
+    if(fat_writer.fill) {
+      fat_writer.buffered = last;
+      memcpy(fat_buffer, lookup_fat(last), fat_writer.fill);
+    }
+  }
+  fat_writer.file_p = file_p;
+  file_p->minor = (long)&fat_writer.entry; // Size grows as data is written
+  file_p->_flags = __SWR;
+  file_p->buffer = NULL;                // Character I/O is not buffered here
+  file_p->head = 0;
+  file_p->tail = 0;
+  file_p->_loc = 0;
+  return 0;
+}
+
 //---------------------------------------------------------------------------
 //  Public Functions
 //---------------------------------------------------------------------------
@@ -508,8 +1621,8 @@ struct dirent *finddirent(const char* path) {
 // memory at the location given by the volume parameter.
 // Return: EOK (0): success
 //         EINVAL:  failure
-// Failure would be because a valid FAT12 filesystem was not detected at the
-// given address.
+// Failure would be because a valid FAT12 or FAT16 filesystem was not found
+// at the given address.
 //-----------------------------------------------------------------------
 int mount(void* filesystem, long opt) {
   // No options supported currently but keep the placeholder.
@@ -562,12 +1675,33 @@ int mount(void* filesystem, long opt) {
       g_filesystem.n_dirent*sizeof(struct dirent)-2*FLASHFS_SECTOR_SIZE;
   // The last necessary piece of information is the maximum valid cluster
   // number for range checking. This will be the provided number of clusters on
-  // the medium minus those between the boot sector and inode 0.
-  g_filesystem.n_fatent = align16(volume->num_sectors)-
+  // the medium minus those between the boot sector and inode 0. Volumes of
+  // 65536 sectors or more give their size in the 32-bit field.
+  uint32_t sectors = align16(volume->num_sectors);
+  if(!sectors) {
+    sectors = align32(volume->num_sectors_32);
+  }
+  g_filesystem.n_fatent = sectors-
       ((void*)g_filesystem.p_ino-filesystem)/FLASHFS_SECTOR_SIZE;
+  // The FAT type is decided by the number of data clusters alone. The label
+  // in the boot sector is informational and is not consulted.
+  if(g_filesystem.n_fatent-2<4085) {
+    g_filesystem.fat_bits = 12;
+  } else if(g_filesystem.n_fatent-2<65525) {
+    g_filesystem.fat_bits = 16;
+  } else {
+    printf("mount: FAT32 not supported\n");
+    g_filesystem.p_volume = NULL;
+    return EINVAL;
+  }
+  fat_window_start = -1;
   // Everything should work now as long as the above parameters were configured
   // correctly. Of course, if there are problems like that, they would show up
   // under Windows or Linux when the filesystem was created.
+  // Index all names so opening a file does not require a directory scan.
+  // Forget paths resolved on any previously mounted filesystem.
+  fat_generation++;
+  dircache_build();
   debug("mount mounted\nvol %08x\nfat %08x\ndir %08x\nino %08x\ndirent %d, fatent %d\n", (unsigned)g_filesystem.p_volume, (unsigned)g_filesystem.p_fat, (unsigned)g_filesystem.p_rootdir, (unsigned)g_filesystem.p_ino, (int)g_filesystem.n_dirent, (int)g_filesystem.n_fatent);
   return 0;
 }
@@ -580,18 +1714,39 @@ FILE *fopen(const char* pathname, const char* mode) {
   struct dirent *dirp;
   int fileno;
 
-  // TODO Only mode supported is "r". Skipping check.
-  (void)mode;
+  // Modes "w" and "a" open for writing. Anything else is read only.
+  int writing = mode[0]=='w' || mode[0]=='a';
+  if(writing && fat_writer.file_p) {
+    // Only one file may be written at a time.
+    errno = EBUSY;
+    return NULL;
+  }
   // Follow the file path. This routine can also be used by cd and opendir.
   dirp = finddirent(pathname);
   if(!dirp) {
-    // File not found. Nothing exists with that name.
-    errno = ENOENT;
-    return NULL;
-  }
-  if(dirp->attributes&(e_directory|e_volume)) { // It is a directory
+    // File not found. Nothing exists with that name. A file being written
+    // is created in the root directory.
+    if(!writing || errno!=ENOENT) {
+      errno = ENOENT;
+      return NULL;
+    }
+    const char *p = pathname;
+    while(*p=='/' || *p=='\\') {
+      p++;
+    }
+    for( ; *p; p++) {
+      if(*p=='/' || *p=='\\') {
+        // Subdirectories are not extended.
+        errno = EROFS;
+        return NULL;
+      }
+    }
+  } else if(dirp->attributes&(e_directory|e_volume)) { // It is a directory
     errno = EISDIR;
     return NULL;
+  } else if(writing && (dirp->attributes&e_readonly)) {
+    errno = EROFS;
+    return NULL;
   }
   // File found and validated.
   // Allocate an unused FILE and, by association a fileno, for this file.
@@ -612,13 +1767,26 @@ FILE *fopen(const char* pathname, const char* mode) {
   // stdio calls such as getc and scanf to read the file.
   file_p = &_file[fileno];
   file_p->device = a2dev_flash;         // This is the mass storage device
-  file_p->_loc = dirp->first_cluster;   // Cluster currently in buffer
-  file_p->buffer = lookup_fat(file_p->_loc);   // Last one if multiple
-  file_p->_max = FLASHFS_SECTOR_SIZE;   // Buffer size
-  file_p->head = 0;                     // Reset read pointer
-  file_p->tail = file_p->_max;          // Indicate buffer is full
+  if(writing) {
+    if(fat_open_write(file_p, dirp, pathname, mode[0]=='a')) {
+      file_p->device = a2dev_none;
+      return NULL;
+    }
+    return file_p;
+  }
   file_p->minor = (long)dirp;           // Cookie is pointer to the dirent
   file_p->_flags = 0;                   // Clear error and end of file status
+  // Decode the cluster chain once and load the first cluster.
+  fat_map_file(fileno, dirp->first_cluster);
+  if(fat_load_cluster(fileno, 0)) {
+    // Empty file. Nothing to read.
+    file_p->_loc = 0;
+    file_p->buffer = NULL;
+    file_p->_max = FLASHFS_SECTOR_SIZE;
+    file_p->head = 0;
+    file_p->tail = 0;
+    file_base[fileno] = 0;
+  }
   debug("fopen fileno %d\n", fileno);
   return file_p;
 }
@@ -627,8 +1795,14 @@ FILE *fopen(const char* pathname, const char* mode) {
 // Close File
 //-----------------------------------------------------------------------
 int fclose(FILE *file_p) {
+  int rc = 0;
+  if(file_p==fat_writer.file_p) {
+    // Everything still in RAM is written out before the file is released.
+    rc = fsync(fileno(file_p));
+    fat_writer.file_p = NULL;
+  }
   file_p->device = a2dev_none;
-  return 0;
+  return rc;
 }
 
 //-----------------------------------------------------------------------
@@ -656,7 +1830,7 @@ DIR *opendir(const char* pathname) {
   // Allocate an unused FILE and, by association a fileno, for this file.
   // Do not allocate stdin, stdout, or sderr here even if they are freed.
   for(fileno=3; fileno<FOPEN_MAX; fileno++) {
-    if(_file[fileno].device) {
+    if(!_file[fileno].device) {
       // Found one.
       break;
     }
@@ -684,13 +1858,14 @@ DIR *opendir(const char* pathname) {
 ssize_t read(int fd, void *buf, size_t count) {
   FILE* file_p = &_file[fd];            // Get file object from file number
   ssize_t bytes_read = 0;               // Initialized the returned value
-  int clust, available;
+  int available;
 
-  if(fd<0 || fd>OPEN_MAX || file_p->device!=a2dev_flash) {
+  if(fd<0 || fd>=OPEN_MAX || file_p->device!=a2dev_flash ||
+      (file_p->_flags&__SWR)) {
     errno = EBADF;
     return -1;
   }
-  printf("read f=%d, a=%08x, s=%d\n", fd, (unsigned)buf, count);
+  debug("read f=%d, a=%08x, s=%d\n", fd, (unsigned)buf, count);
   // TODO Assume file is opened for read so no need to check flags
   // Repeat until all data read
   while(count) {
@@ -702,7 +1877,6 @@ ssize_t read(int fd, void *buf, size_t count) {
         // TODO A write operation was performed as that is the only reason
         // the tail pointer should have moved.  Write is not supported.
         file_p->_flags |= __SERR;
-        bytes_read = -1;
         errno = EINVAL;
         return -1;
       }
@@ -719,25 +1893,18 @@ ssize_t read(int fd, void *buf, size_t count) {
     }
     // Nothing left in current sector. fill buffer with next sector.
     if(count) {
-      // Advance to next sector
-      clust = next_cluster(file_p->_loc);
-      if(clust<2 || (unsigned)clust >= g_filesystem.n_fatent) {
-        if((clust&0xFF8)==0xFF8) {
-          // Normal end of file
-          file_p->_flags |= __SEOF;
-        } else {
-          // File corruption
-          errno = EBADF;
-          file_p->_flags |= __SERR;
-          return -1;
-        }
+      if(file_base[fd]+file_p->tail>=
+          (off_t)((struct dirent*)file_p->minor)->file_size) {
+        // Normal end of file
+        file_p->_flags |= __SEOF;
         break;
       }
-      file_p->_loc = clust;
-      file_p->buffer = lookup_fat(clust);   // Last one if multiple
-      file_p->_max = FLASHFS_SECTOR_SIZE;   // Buffer size
-      file_p->head = 0;                     // Reset read pointer
-      file_p->tail = file_p->_max;          // Indicate buffer is full
+      if(fat_load_cluster(fd, file_base[fd]/FLASHFS_SECTOR_SIZE+1)) {
+        // Chain ended before the size recorded in the directory entry.
+        errno = EBADF;
+        file_p->_flags |= __SERR;
+        return -1;
+      }
     }
   }
   return bytes_read;
@@ -750,29 +1917,22 @@ ssize_t read(int fd, void *buf, size_t count) {
 //-----------------------------------------------------------------------
 off_t lseek(int fd, off_t offset, int whence) {
   FILE* file_p = &_file[fd];            // Get file object from file number
-  int clust, pos=0;
   struct dirent *dir_p=(struct dirent*)file_p->minor;
+  int index;
 
-  printf("seek f=%d, a=%08x, s=%d\n", fd, (unsigned)offset, whence);
-  if(fd<0 || fd>OPEN_MAX || file_p->device!=a2dev_flash) {
+  debug("seek f=%d, a=%08x, s=%d\n", fd, (unsigned)offset, whence);
+  if(fd<0 || fd>=OPEN_MAX || file_p->device!=a2dev_flash) {
     errno = EBADF;
     return -1;
   }
-  // First determine the current byte offset since this is not stored
-  clust = dir_p->first_cluster;                 // Rewind to beginning
-  while(clust!=file_p->_loc) {
-    clust = next_cluster(clust);
-    if(clust<2 || (unsigned)clust >= g_filesystem.n_fatent) {
-      // File corruption
-      errno = EBADF;
-      file_p->_flags |= __SERR;
-      return -1;
-    }
-    pos += FLASHFS_SECTOR_SIZE;
+  if(file_p->_flags&__SWR) {
+    // Files are only written sequentially.
+    errno = EINVAL;
+    return -1;
   }
   switch(whence) {
     case SEEK_SET: break;                       // Absolute posistion given
-    case SEEK_CUR: offset += pos+file_p->head;  // Add current offset in file
+    case SEEK_CUR: offset += file_base[fd]+file_p->head; // From current offset
                    break;
     case SEEK_END: offset += dir_p->file_size; // Relative to end of file
                    break;
@@ -780,31 +1940,134 @@ off_t lseek(int fd, off_t offset, int whence) {
                    return -1;
   }
   // Limit offset to file size
-  if((unsigned)offset>dir_p->file_size ) {
+  if(offset<0 || (unsigned)offset>dir_p->file_size) {
     errno=EINVAL;
     return -1;
   }
-  // Start from beginning if offset is negative
-  if(offset<pos) {
-    clust = dir_p->first_cluster;      // Rewind to beginning
-    pos = 0;
-  }
-  // Advance until the correct sector is located
-  while(offset>=pos+FLASHFS_SECTOR_SIZE) {
-    // Advance to next sector
-    clust = next_cluster(file_p->_loc);
-    if(clust<2 || (unsigned)clust >= g_filesystem.n_fatent) {
-      // File corruption
-      errno = EBADF;
-      file_p->_flags |= __SERR;
-      return -1;
-    }
+  // The extent map gives the cluster directly. An offset at the very end of
+  // a file filling its last cluster stays in that cluster.
+  index = offset/FLASHFS_SECTOR_SIZE;
+  if(index && (unsigned)offset==dir_p->file_size &&
+      !(offset&(FLASHFS_SECTOR_SIZE-1))) {
+    index--;
+  }
+  if(offset==0 && dir_p->file_size==0) {
+    // Empty file has no cluster to load.
+    file_p->head = 0;
+    return 0;
   }
-  // Fill buffer with current sector
-  file_p->_loc = clust;                         // Point to the right location
-  file_p->buffer = lookup_fat(clust);           // Make data available for stdio
-  file_p->_max = FLASHFS_SECTOR_SIZE;           // Reset buffer size just incase
-  file_p->head += offset%FLASHFS_SECTOR_SIZE;   // Update read pointer
-  file_p->tail = file_p->_max;                  // Last valid byte in buf +1
+  if(fat_load_cluster(fd, index)) {
+    // File corruption
+    errno = EBADF;
+    file_p->_flags |= __SERR;
+    return -1;
+  }
+  file_p->head = offset-file_base[fd];          // Update read pointer
+  file_p->_flags &= ~__SEOF;
   return offset;
 }
+
+//-----------------------------------------------------------------------
+// Write File
+// Data is appended to the end of the file. Full clusters go to flash as soon
+// as they are complete while the FAT and directory are updated in batches.
+//-----------------------------------------------------------------------
+ssize_t write(int fd, const void *buf, size_t count) {
+  FILE* file_p = &_file[fd];            // Get file object from file number
+  ssize_t bytes_written = 0;
+  int n;
+
+  if(fd<0 || fd>=OPEN_MAX || file_p!=fat_writer.file_p) {
+    errno = EBADF;
+    return -1;
+  }
+  while(count) {
+    if(!fat_writer.fill && !fat_writer.buffered &&
+        fat_writer.pending.n==FAT_MAX_EXTENTS) {
+      // Run list is full. Record it while the buffer is free to stage the
+      // metadata sectors.
+      if(fat_commit()) {
+        break;
+      }
+    }
+    n = FLASHFS_SECTOR_SIZE-fat_writer.fill;
+    if(n>(int)count) {
+      n = count;
+    }
+    memcpy(fat_buffer+fat_writer.fill, buf, n);
+    fat_writer.fill += n;
+    if(fat_writer.fill==FLASHFS_SECTOR_SIZE && fat_write_data()) {
+      // The cluster could not be written. Nothing of it is recorded.
+      fat_writer.fill -= n;
+      break;
+    }
+    fat_writer.entry.file_size += n;
+    bytes_written += n;
+    buf += n;
+    count -= n;
+  }
+  if(!bytes_written && count) {
+    file_p->_flags |= __SERR;
+    return -1;
+  }
+  return bytes_written;
+}
+
+//-----------------------------------------------------------------------
+// Synchronize File
+// Write any partial cluster and record everything in the FAT and directory.
+//-----------------------------------------------------------------------
+int fsync(int fd) {
+  FILE* file_p = &_file[fd];            // Get file object from file number
+
+  if(fd<0 || fd>=OPEN_MAX || file_p->device!=a2dev_flash) {
+    errno = EBADF;
+    return -1;
+  }
+  if(file_p!=fat_writer.file_p) {
+    // Nothing to do for files that are only read.
+    return 0;
+  }
+  if(fat_writer.fill && fat_write_data()) {
+    return -1;
+  }
+  if(fat_commit()) {
+    return -1;
+  }
+  if(fat_writer.fill) {
+    // The buffer was used for metadata. Restore the partial cluster.
+    memcpy(fat_buffer, lookup_fat(fat_writer.buffered), fat_writer.fill);
+  }
+  return 0;
+}
+
+//-----------------------------------------------------------------------
+// Map File - Nonstandard
+// The filesystem is memory mapped so a file occupying consecutive clusters
+// can be used in place without copying it to RAM. Contiguity was determined
+// when the file was opened. The pointer remains valid after fclose() until
+// the file is rewritten but must not be read while the flash is busy.
+// Only files open for reading can be mapped as the clusters of one being
+// written are about to change.
+// Return: Pointer to first byte of file with its size stored in length
+//         NULL with errno EBADF if the file is not open for reading
+//         NULL with errno EINVAL if the file is empty or fragmented
+//-----------------------------------------------------------------------
+const void *fmap(FILE *file_p, size_t *length) {
+  int fd = fileno(file_p);
+  struct dirent *dir_p;
+
+  if(fd<0 || fd>=OPEN_MAX || file_p->device!=a2dev_flash ||
+      (file_p->_flags&__SWR)) {
+    errno = EBADF;
+    return NULL;
+  }
+  dir_p = (struct dirent*)file_p->minor;
+  if(file_extents[fd]!=1 || dir_p->file_size==0 ||
+      (uint32_t)file_extent[fd][0].count*FLASHFS_SECTOR_SIZE<dir_p->file_size) {
+    errno = EINVAL;
+    return NULL;
+  }
+  *length = dir_p->file_size;
+  return lookup_fat(file_extent[fd][0].first);
+}
@@ -19,7 +19,9 @@
 #include <flash.h>
 #include <string.h>
 #include <stdio.h>
+#include <fsfat.h>
 #include <a2fomu.h>
+#include <trace.h>
 
 #ifndef DEBUG
 #define DEBUG
@@ -110,10 +112,12 @@ int write_flash(int dst, const void *src, int size) {
       yield();
       return 0;
     } else {
-      // Transfer complete
+      // Transfer complete. Forget the request so a later write of the same
+      // buffer to the same place is treated as new rather than as finished.
       debug(persistence, "@K%d", ny);
       ny = 0;
       next_ny = 1;
+      flash_src_ptr = NULL;
       return size;
     }
   }
@@ -217,7 +221,9 @@ int write_flash(int dst, const void *src, int size) {
     }
   }
 
-  // All safety checks pass. Store parameters and start the long update cycle
+  // All safety checks pass. Let the filesystem drop anything cached from the
+  // region being replaced then start the long update cycle.
+  fat_flash_write(dst, size);
   flash_src_ptr = (uint8_t *)src;
   flash_dst_addr = dst;
   flash_update_size = size;
@@ -322,9 +328,19 @@ int write_flash_unsafe(int dst, const void *src, int size) {
  * or write_flash_unsafe routines which has already verified the content is
  * valid for the given location and will not brick the device.
  *============================================================================*/
+// Record state changes, whether made here or by a write request.
+static void flash_trace_state(void) {
+  static enum flash_state traced;
+  if(flash_state!=traced) {
+    traced = flash_state;
+    trace(trace_flash_state, traced, 0);
+  }
+}
+
 void flash_task(void) {
   int dst, size;
   unsigned char* src;
+  flash_trace_state();
   switch(flash_state) {
     case FLASH_USER_MODE:
       // Nothing to do. Device is memory mapped and read access is unresticted.
@@ -437,6 +453,7 @@ void flash_task(void) {
       debug(persistence, "@FS%d", flash_state);
       error("state");
   }
+  flash_trace_state();
 }
 
 void flash_init(void) {
@@ -0,0 +1,149 @@
+//
+// graphics.c - Part of a2fomu - Copyright (c) 2020-2021 Doug Eaton
+//
+// This file is part of a2fomu which is released under the two clause BSD
+// licence.  See file LICENSE in the project root directory or visit the
+// project at https://github.com/elecbrick/a2fomu for full license details.
+
+// Lo-Res and Hi-Res frame encoder.
+//
+// A copy of what the viewer was last sent is kept for the visible bytes of a
+// Hi-Res page, 7680 bytes, of which a Lo-Res page uses the first 960. The
+// page is compared with it two words at a time. Runs of unchanged blocks are
+// skipped and the XOR of a changed block with its old contents, mostly zero
+// bytes around the few that changed, is run length encoded. The copy is kept
+// whichever page is shown so flipping between two pages sends just their
+// differences.
+
+#include <stdint.h>
+#include <string.h>
+#include <graphics.h>
+
+#define BLOCK_WORDS (GRAPHICS_BLOCK/4)
+
+// Equal bytes sent as a repeat rather than as part of a literal.
+#define RUN_MIN 3
+
+uint32_t graphics_frames;
+uint32_t graphics_bytes;
+
+static uint32_t shadow[GRAPHICS_HIRES_BLOCKS][BLOCK_WORDS];
+static int key = graphics_key;
+static int pending, started, flags, blocks;
+// Position in the frame: block number and where it is in the page.
+static int block, column, offset;
+// Unchanged blocks not yet sent as skips.
+static int skip;
+
+void graphics_reset(void) {
+  pending = 0;
+  key = graphics_key;
+}
+
+void graphics_frame(int frame_flags) {
+  flags = frame_flags | key;
+  if(key) {
+    memset(shadow, 0, sizeof(shadow));
+    key = 0;
+  }
+  blocks = flags&graphics_hires ? GRAPHICS_HIRES_BLOCKS : GRAPHICS_LORES_BLOCKS;
+  block = column = offset = 0;
+  skip = 0;
+  started = 0;
+  pending = 1;
+}
+
+int graphics_pending(void) {
+  return pending;
+}
+
+static int run_length(const uint8_t *x, int i) {
+  int n;
+  for(n=i+1; n<GRAPHICS_BLOCK && x[n]==x[i]; n++) {
+  }
+  return n-i;
+}
+
+static uint8_t *encode_skip(uint8_t *p) {
+  int n;
+  while(skip) {
+    n = skip>64 ? 64 : skip;
+    *p++ = n-1;
+    skip -= n;
+  }
+  return p;
+}
+
+//-----------------------------------------------------------------------
+// The XOR of a changed block as repeats of at least RUN_MIN equal bytes with
+// literals between them. At most nine bytes.
+//-----------------------------------------------------------------------
+static uint8_t *encode_block(uint8_t *p, const uint8_t *x) {
+  int i = 0, n, run;
+  while(i<GRAPHICS_BLOCK) {
+    run = run_length(x, i);
+    if(run>=RUN_MIN) {
+      *p++ = run+0x7E;
+      *p++ = x[i];
+      i += run;
+    } else {
+      for(n=i+run; n<GRAPHICS_BLOCK && run_length(x, n)<RUN_MIN; n++) {
+      }
+      *p++ = 0x3F+n-i;
+      while(i<n) {
+        *p++ = x[i++];
+      }
+    }
+  }
+  return p;
+}
+
+int graphics_encode(uint8_t *out, int room, const void *page, int limit) {
+  uint8_t *p = out;
+  const uint32_t *vram;
+  uint32_t now[BLOCK_WORDS], diff[BLOCK_WORDS], *seen;
+  int w, changed;
+
+  while(pending && limit-->0 && room-(p-out)>=GRAPHICS_BLOCK_MAX) {
+    // The 6502 keeps running; the copy must hold exactly what was sent
+    vram = (const uint32_t*)((const uint8_t*)page+offset);
+    seen = shadow[block];
+    changed = 0;
+    for(w=0; w<BLOCK_WORDS; w++) {
+      now[w] = vram[w];
+      diff[w] = now[w]^seen[w];
+      changed |= diff[w]!=0;
+    }
+    if(!started && (changed || (flags&graphics_key))) {
+      *p++ = 0xA2;
+      *p++ = 'G';
+      *p++ = flags;
+      *p++ = graphics_frames;
+      started = 1;
+    }
+    if(changed) {
+      p = encode_skip(p);
+      p = encode_block(p, (const uint8_t*)diff);
+      for(w=0; w<BLOCK_WORDS; w++) {
+        seen[w] = now[w];
+      }
+    } else {
+      skip++;
+    }
+    // Step over the screen holes at the end of each group of three lines
+    offset += GRAPHICS_BLOCK;
+    if(++column==GRAPHICS_GROUP_BLOCKS) {
+      column = 0;
+      offset += GRAPHICS_BLOCK;
+    }
+    if(++block==blocks) {
+      if(started) {
+        p = encode_skip(p);
+        graphics_frames++;
+      }
+      pending = 0;
+    }
+  }
+  graphics_bytes += p-out;
+  return p-out;
+}
@@ -22,23 +22,47 @@
 #include <cli.h>
 #include <disk.h>
 #include <morse.h>
+#include <motion.h>
+#include <render.h>
+#include <graphics.h>
+#include <escape.h>
 #include <fsfat.h>
 #include <flash.h>
+#include <trace.h>
+#include <coroutine.h>
 
-// Performance analysis is ongoing. The system will speed if if performance
-// monitoring is disabled but this also means the cli command "times" has
-// nothing to display.
+// Performance analysis is ongoing. Task run times are always collected by
+// the scheduler from mcycle; perfmon is only needed here to also track the
+// time spent in the interrupt handler.
 //#define ISR_TIME_TRACKING
 //#define ACCURATE_PERFMON
 #define DISABLE_PERFMON
 #include <perfmon.h>
 
-a2time_t task_runtime[max_task];
+struct task_stats task_stats[max_task];
 volatile a2time_t isr_runtime;
 volatile int isr_count;
 
+// The Apple II screen FIFO, keyboard strobe and disk controller cannot
+// interrupt so the tasks serving them are also run on every timer tick. The
+// LED task is woken by morse_isr() when its schedule needs more.
+#define POLLED_TASKS ((1<<video_task_active)|(1<<disk_task_active)|\
+    (1<<graphics_task_active))
+
+// Tasks waiting for room in a CDC transmit buffer are run again after any USB
+// interrupt as a completed transfer may have made some.
+#define USB_TASKS ((1<<tud_task_active)|(1<<tty_task_active)|\
+    (1<<graphics_task_active))
+
 int debug_counter[max_application_error];
 enum scroll_mode scroll_mode;
+enum video_mode video_mode;
+
+// Without the dirty row register, all rows are compared this often in ms.
+#define RENDER_PERIOD 16
+
+// Rows for the shadow renderer still to compare with the terminal.
+static uint32_t render_rows;
 
 FILE *disk_fd;
 
@@ -76,22 +100,38 @@ void isr(void) {
   a2time_t isr_start = activetime();
   #endif
   isr_count++;
-  if(read_stack_pointer()<minsp) {
+  // Coroutine stacks have their own guard word so only the main one is tracked
+  if(!coroutine_current && read_stack_pointer()<minsp) {
     minsp = read_stack_pointer();
   }
   irqs = irq_pending() & irq_getmask();
+  trace(trace_isr_enter, 0, irqs);
   if(irqs & (1 << USB_INTERRUPT)) {
     tud_int_handler(0);
     //dcd_int_handler(0); // tud_int_handler calls this
+    ready_tasks |= USB_TASKS;
+    if(coroutine_count) {
+      ready_tasks |= 1<<cli_task_active;
+    }
   } else {
     if(irqs & (1 << TIMER0_INTERRUPT)) {
       if(usb_next_ev_read()) {
         tud_int_handler(0);
         debug_counter[usb_interrupt_lost]++;
+        ready_tasks |= USB_TASKS;
       }
     }
   }
   if(irqs & (1 << TIMER0_INTERRUPT)) {
+    ready_tasks |= POLLED_TASKS;
+    if(coroutine_count) {
+      // CLI commands waiting on time or the flash check again each tick
+      ready_tasks |= 1<<cli_task_active;
+    }
+    if(cangetc(stdin)) {
+      // Waiting for the Apple to take the last key
+      ready_tasks |= 1<<keyboard_task_active;
+    }
     system_ticks++;
     timer0_ev_pending_write(1);
     watchdog_timer++;
@@ -109,6 +149,7 @@ void isr(void) {
         (unsigned int)csrr(mtval));
     reboot();
   }
+  trace(trace_isr_exit, 0, 0);
   #ifdef ISR_TIME_TRACKING
   isr_runtime += (activetime()-isr_start);
   #endif
@@ -139,202 +180,324 @@ int a2toascii(int c, int h, int v) {
 
 #define A2TOASCII(c) a2toascii(c, h, v)
 
-void redraw(void) {
+// Text rows to be repainted from screen memory because the gateware, in its
+// Lossy mode, dropped writes to them while the screen FIFO was full.
+static uint32_t lost_rows;
+
+#ifdef CSR_APPLE2_RUN_ADDR
+#define RUN_MORE  (1u<<CSR_APPLE2_RUN_MORE_OFFSET)
+#define RUN_FIRST ((((1u<<CSR_APPLE2_RUN_CHARACTER_SIZE)-1)<<\
+    CSR_APPLE2_RUN_CHARACTER_OFFSET)|(1u<<CSR_APPLE2_RUN_REPEAT_OFFSET)|\
+    (1u<<CSR_APPLE2_RUN_SCROLLSTART_OFFSET)|\
+    (1u<<CSR_APPLE2_RUN_SCROLLEND_OFFSET)|RUN_MORE)
+
+//-----------------------------------------------------------------------
+// Next screen write in the form of the screen register. The gateware gathers
+// writes to consecutive columns of a row into runs of up to four characters
+// which take two register reads rather than one each. Characters after the
+// first are handed out from here with the column advanced; only the first of
+// a run can carry flags.
+//-----------------------------------------------------------------------
+static uint32_t screen_read(void) {
+  static uint32_t entry, chars, more;
+  static int left;
+  int count;
+  if(left) {
+    entry = ((entry & ~RUN_FIRST)+(1<<CSR_APPLE2_RUN_HORIZONTAL_OFFSET)) |
+        (chars & 0xff);
+    chars >>= 8;
+    left--;
+  } else {
+    entry = apple2_run_read();
+    count = (entry>>CSR_APPLE2_RUN_COUNT_OFFSET) &
+        ((1<<CSR_APPLE2_RUN_COUNT_SIZE)-1);
+    entry &= ~(((1u<<CSR_APPLE2_RUN_COUNT_SIZE)-1)<<
+        CSR_APPLE2_RUN_COUNT_OFFSET);
+    more = entry & RUN_MORE;
+    if(count>1) {
+      left = count-1;
+      chars = apple2_runchars_read();
+    }
+  }
+  return entry | (left ? RUN_MORE : more);
+}
+#else
+#define screen_read apple2_screen_read
+#endif
+
+// Convert one row of screen memory to ASCII, a word at a time.
+static void text_row(unsigned char *line, int v) {
   union {
     unsigned int c4;
     unsigned char c[4];
   } convert;
-  int v, h;
+  int h;
   void *vram = (void*)(A2RAM_BASE+0x400);
+  for(h=0; h<40; ) {
+    convert.c4=*(int*)(vram+v/8*40+v%8*128+h);
+    line[h] = A2TOASCII(convert.c[0]); h++;
+    line[h] = A2TOASCII(convert.c[1]); h++;
+    line[h] = A2TOASCII(convert.c[2]); h++;
+    line[h] = A2TOASCII(convert.c[3]); h++;
+  }
+}
+
+void redraw(void) {
+  unsigned char line[41];
+  int v, n;
   puts("\033[H\033[J");
+  if(video_mode==video_shadow) {
+    // The renderer fills in the cleared screen
+    render_reset();
+    render_rows = RENDER_ALL_ROWS;
+    return;
+  }
   for(v=0; v<24; v++) {
-    for(h=0; h<40; ) {
-      while(canputc(stdout)<4) {
-        yield();
-      }
-      convert.c4=*(int*)(vram+v/8*40+v%8*128+h);
-      putchar(A2TOASCII(convert.c[0])); h++;
-      putchar(A2TOASCII(convert.c[1])); h++;
-      putchar(A2TOASCII(convert.c[2])); h++;
-      putchar(A2TOASCII(convert.c[3])); h++;
-    }
+    // Convert a whole row and queue it in one block.
+    text_row(line, v);
+    n = 40;
     if(v<23) {
-      putchar('\n');
+      line[n++] = '\n';
     }
+    while(canputc(stdout)<n) {
+      yield();
+    }
+    fwrite(line, 1, n, stdout);
   }
+  lost_rows = 0;
   // We should have retrieved one flashing character from screen memory: cursor
   if(cursor_v>=0 && cursor_h>=0) {
     prev_h=cursor_h-1;
     prev_v=cursor_v;
   }
   // Position to cursor or last character updated on screen if not present
-  printf("\033[%d;%dH", prev_v+1, prev_h+2);
+  ansi_cursor(stdout, prev_v+1, prev_h+2);
+}
+
+// Repaint lost rows once the screen FIFO is empty, as many as there is room
+// for in stdout; the rest wait for the next pass. The cursor is put back
+// when the last one is done.
+static void repaint_rows(void) {
+  unsigned char line[40];
+  int v;
+  for(v=0; v<24; v++) {
+    if(lost_rows & (1<<v)) {
+      if(canputc(stdout)<40+2*MOTION_MAX) {
+        return;
+      }
+      cursor_motion(stdout, prev_v, prev_h+1, v, 0);
+      text_row(line, v);
+      fwrite(line, 1, 40, stdout);
+      prev_v = v;
+      prev_h = 39;
+      lost_rows &= ~(1<<v);
+    }
+  }
+  if(cursor_v>=0 && cursor_h>=0) {
+    cursor_motion(stdout, prev_v, prev_h+1, cursor_v, cursor_h);
+    prev_v = cursor_v;
+    prev_h = cursor_h-1;
+  }
 }
 
 void function_key(int n) {
   (void)n;
 }
 
-#define ESC_START  1
-#define ESC_CSI 0x40
-#define ESC_APP 0x80
-// Keyboard ESC O +  jklmnopqrstuvwxy
-char keypad_map[] = "*+,-./0123456789";
+// Room needed in stdin before reading from the USB: a full packet plus the
+// keys of an escape sequence split across packets that is passed on as typed.
+#define TTY_READ_ROOM (64+ESCAPE_MAX)
+
+//-----------------------------------------------------------------------
+// Keys that are not passed on to the Apple.
+//-----------------------------------------------------------------------
+static void tty_command(int command) {
+  uint32_t control;
+  switch(command) {
+  case escape_apple_reset:
+    // Send reset pulse, activate and release reset
+    control = apple2_control_read();
+    apple2_control_write(control | (1<<CSR_APPLE2_CONTROL_RESET_OFFSET));
+    apple2_control_write(control & ~(1<<CSR_APPLE2_CONTROL_RESET_OFFSET));
+    break;
+  case escape_redraw:
+    redraw();
+    break;
+  default:
+    function_key(command-escape_function);
+  }
+}
+
+//-----------------------------------------------------------------------
+// Offset of the first LF in a run of bytes or the length if there is none.
+// Aligned words are checked four bytes at a time: a byte of v is zero exactly
+// where the input holds LF and the expression below is nonzero only if some
+// byte is zero. No multiply is involved.
+//-----------------------------------------------------------------------
+static int find_lf(const unsigned char *p, int n) {
+  int i = 0;
+  uint32_t v;
+  while(i<n && ((uintptr_t)(p+i)&3)) {
+    if(p[i]=='\n') {
+      return i;
+    }
+    i++;
+  }
+  for( ; i+4<=n; i+=4) {
+    v = *(const uint32_t*)(p+i)^0x0A0A0A0A;
+    if((v-0x01010101)&~v&0x80808080) {
+      break;
+    }
+  }
+  for( ; i<n; i++) {
+    if(p[i]=='\n') {
+      break;
+    }
+  }
+  return i;
+}
+
+//-----------------------------------------------------------------------
+// Move as much of a stream to a CDC port as its transmit FIFO accepts,
+// expanding LF to CR LF. Text is taken straight from the stream's ring
+// buffer and each run between newlines goes to TinyUSB in one call.
+// Return: Number of bytes taken from the stream
+//-----------------------------------------------------------------------
+int tty_drain(FILE *stream, int itf) {
+  static const char crlf[2] = { '\r', '\n' };
+  const unsigned char *span;
+  int room = tud_cdc_n_write_available(itf);
+  int n, run, taken = 0;
+
+  while(room>0 && (n=fgetspan(stream, &span))>0) {
+    if(n>room) {
+      n = room;
+    }
+    run = find_lf(span, n);
+    if(run==0) {
+      // Newline at the start of the span. Both bytes must fit.
+      if(room<2) {
+        break;
+      }
+      tud_cdc_n_write(itf, crlf, 2);
+      run = 1;
+      room -= 2;
+    } else {
+      tud_cdc_n_write(itf, span, run);
+      room -= run;
+    }
+    fgetcommit(stream, run);
+    taken += run;
+  }
+  if(taken) {
+    tud_cdc_n_write_flush(itf);
+    trace(trace_usb, trace_usb_cdc_tx, taken);
+  }
+  return taken;
+}
+
+// Keys read from the USB ahead of a CLI escape or reset that arrived while
+// the Apple was not taking keys. They go to the Apple before anything newer.
+static uint8_t tty_held[64];
+static int tty_held_count;
+
+//-----------------------------------------------------------------------
+// Decode keys for the Apple and queue them in stdin in one block.
+//-----------------------------------------------------------------------
+static void tty_keys(const uint8_t *buf, int count) {
+  uint8_t keys[sizeof(tty_held)+ESCAPE_MAX];
+  int i, rc, n = 0;
+  for(i=0; i<count; i++) {
+    rc = escape_key(buf[i], keys+n);
+    if(rc>=0) {
+      n += rc;
+    } else {
+      tty_command(-rc);
+    }
+  }
+  if(n && fwrite(keys, 1, n, stdin)<(size_t)n) {
+    debug_counter[tty_input_overflow]++;
+  }
+}
+
+//-----------------------------------------------------------------------
+// Terminal input: the CLI escape and what follows it go to the CLI and the
+// rest to the Apple.
+//-----------------------------------------------------------------------
+static void tty_input(uint8_t *buf, int count) {
+  int i = 0, start, rc;
+  while(i<count) {
+    if(cli_active || buf[i]==cli_escape) {
+      rc = cli((char*)&buf[i], count-i);
+      if(rc==0) {
+        break;
+      }
+      i += rc;
+      continue;
+    }
+    for(start=i; i<count && buf[i]!=cli_escape; i++) {
+    }
+    if(tty_held_count) {
+      tty_keys(tty_held, tty_held_count);
+      tty_held_count = 0;
+    }
+    tty_keys(&buf[start], i-start);
+  }
+}
+
+//-----------------------------------------------------------------------
+// Stdin is full so input is being left in the USB buffer. Look through it
+// for the CLI escape and reset, which are needed most when the Apple has
+// stopped reading keys. The keys in front of one are held for the Apple.
+//-----------------------------------------------------------------------
+static void tty_scan(void) {
+  int i, n = tud_cdc_n_available(cdc_tty);
+  uint8_t c;
+  for(i=0; i<n && tty_held_count+i<(int)sizeof(tty_held); i++) {
+    if(!tud_cdc_n_peek(cdc_tty, i, &c)) {
+      return;
+    }
+    if(c==cli_escape || c=='\22' || c=='\0') {
+      tty_held_count += tud_cdc_n_read(cdc_tty, &tty_held[tty_held_count], i);
+      tud_cdc_n_read(cdc_tty, &c, 1);
+      if(c==cli_escape) {
+        cli((char*)&c, 1);
+      } else {
+        tty_command(escape_apple_reset);
+      }
+      return;
+    }
+  }
+}
 
 void tty_task(void) {
-  static int in_esc;
-  int c, rc;
+  int room;
   if(tud_cdc_n_connected(cdc_tty)) {
-    if(tud_cdc_n_available(cdc_tty)) {
-      // connected and data is available
-      uint8_t buf[64];
-      int count = tud_cdc_n_read(cdc_tty, buf, sizeof(buf));
-      for(int i=0; i<count; i++) {
-        if(cli_active || buf[i]==cli_escape) {
-          rc=cli((char*)&buf[i], count-i);
-          i+=rc;
-          if(rc==0 || i>=count) {
-            break;
-          }
-        }
-        // Force upper case as that is all Apple II+ understands
-        c = toupper(buf[i]);
-        if(in_esc) {
-          // In an escape sequence - detect arrow keys, etc
-          if(in_esc & (ESC_CSI | ESC_APP)) {
-            // Treat Application and Command mode as equivalent
-            if(c>='0' && c<='9') {
-              in_esc = (c-'0' + (10*(in_esc&~(ESC_CSI|ESC_APP)))) |
-                (in_esc&(ESC_CSI|ESC_APP));
-            } else {
-              if(c=='A') {
-                // Up Arrow becomes Apple ESC code for command line editing
-                rc=fputs("\033D", stdin);
-              } else if(c=='B') {
-                // Down Arrow becomes Apple ESC code for command line editing
-                rc=fputs("\033C", stdin);
-              } else if(c=='C') {
-                // Right Arrow - ^U (high bit set)
-                rc=fputc(0x95, stdin);
-              } else if(c=='D') {
-                // Left Arrow - ^H (high bit set)
-                rc=fputc(0x88, stdin);
-              } else if(c=='M') {
-                // Keypad Enter
-                rc=fputc('\r', stdin);
-              } else if(c=='X') {
-                // Keypad Equal
-                rc=fputc('=', stdin);
-              } else if(c>='P' && c<='S') {
-                // Function key 1-4
-                function_key(c-'P'+1);
-              } else if(c>='j' && c<='y') {
-                // Keypad digits and symbols
-                rc=fputc(keypad_map[c-'j'], stdin);
-              } else if(c=='~') {
-                switch(in_esc&~(ESC_CSI|ESC_APP)) {
-                  case 1:
-                    // Home
-                    rc=fputs("\033@", stdin);
-                    break;
-                  case 2:
-                    // Insert
-                    rc=fputs("\033F", stdin);
-                    break;
-                  case 3:
-                    // Delete become Left Arrow
-                    rc=fputc(0x88, stdin);
-                    break;
-                  case 4:
-                    // End
-                    rc=fputs("\033E", stdin);
-                    break;
-                  case 5:
-                    // Page Up
-                    rc=fputs("\033I", stdin);
-                    break;
-                  case 6:
-                    // Page Down
-                    rc=fputs("\033M", stdin);
-                    break;
-                  case 15:
-                    // F5
-                    function_key(5);
-                    break;
-                  case 17:
-                  case 18:
-                  case 19:
-                  case 20:
-                  case 21:
-                    // F6 - F10
-                    function_key(c-17+6);
-                    break;
-                  case 23:
-                  case 24:
-                    // F11 - F12
-                    function_key(c-23+11);
-                    break;
-                  default:
-                    // Ignore unrecognized key
-                    break;
-                }
-              } else {
-                // Unrecognized sequence - user may have pushed ESC key
-                // Reconstruct sequence of keys user likely pressed
-                if(in_esc&~(ESC_CSI|ESC_APP)) {
-                  rc = fprintf(stdin, "\033%c%d%c", in_esc&ESC_CSI?'[':'O',
-                      in_esc&~(ESC_CSI|ESC_APP), c);
-                } else {
-                  rc = fprintf(stdin, "\033%c%c", in_esc&ESC_CSI?'[':'O', c);
-                }
-              }
-              in_esc = 0;
-            }
-          } else if(c=='[') {
-            in_esc = ESC_CSI;
-          } else if(c=='O') {
-            in_esc = ESC_APP;
-          } else {
-            // Unrecognized sequence - user likely pushed ESC key
-            rc = fprintf(stdin, "\033%c", c);
-            in_esc = 0;
-          }
-        } else if(c=='\033') {
-          in_esc = ESC_START;
-        } else if(c=='\22' || c=='\0') {
-          // NUL / Control-R: Send reset pulse, activate and release reset
-          // Take A2 out of reset
-          uint32_t control = apple2_control_read();
-          apple2_control_write(control | (1<<CSR_APPLE2_CONTROL_RESET_OFFSET));
-          apple2_control_write(control & ~(1<<CSR_APPLE2_CONTROL_RESET_OFFSET));
-        } else if(c=='\b' || c=='\x7f') {
-          // Backspace and Delete become Left Arrow
-          rc=putc(0x88, stdin);
-        } else if(c=='\f') {
-          // Control-L: Redraw screen
-          redraw();
-        } else {
-          rc=putc(c, stdin);
-          if(rc<0)
-            debug_counter[tty_input_overflow]++;
-        }
+    // Input waits in the USB buffer while a command is running or until the
+    // Apple has made room for it in stdin. The USB then refuses more and the
+    // host holds the rest, so a paste goes at the speed the Apple reads it.
+    room = canputc(stdin)>=TTY_READ_ROOM;
+    if(!cli_running) {
+      if(room && tty_held_count && !cli_active) {
+        tty_keys(tty_held, tty_held_count);
+        tty_held_count = 0;
+      } else if((room || cli_active) && tud_cdc_n_available(cdc_tty)) {
+        // connected and data is available
+        uint8_t buf[64];
+        int count = tud_cdc_n_read(cdc_tty, buf, sizeof(buf));
+        trace(trace_usb, trace_usb_cdc_rx, count);
+        tty_input(buf, count);
+      } else if(!room) {
+        tty_scan();
       }
     }
-    int n = tud_cdc_n_write_available(cdc_tty);
-    int written=0;
-    while(n-->0 && (c=fgetc(stdout)) != EOF) {
-      if(c=='\n') {
-        if(n--<=0) {
-          ungetc(c, stdout);
-          break;
-        }
-        tud_cdc_n_write_char(cdc_tty, '\r');
-      }
-      tud_cdc_n_write_char(cdc_tty, c);
-      written=1;
+    if(tty_drain(stdout, cdc_tty)) {
+      // Screen output may have been waiting for room
+      task_ready(video_task_active);
     }
-    if(written) {
-      tud_cdc_n_write_flush(cdc_tty);
+    if((tty_held_count || tud_cdc_n_available(cdc_tty)) &&
+        (canputc(stdin)>=TTY_READ_ROOM || cli_active)) {
+      task_ready(tty_task_active);
     }
   }
 }
@@ -354,7 +517,7 @@ void tud_cdc_line_state_cb(uint8_t itf, bool dtr, bool rts)
       stderr->device = a2dev_usb;
       stderr->minor = itf;
       tud_cdc_n_write_str(itf, "A2Fomu connected\r\n");
-    } else {
+    } else if(itf==cdc_disk) {
       // disk connected
       external_disk_state = ext_no_disk;
       #if 0
@@ -374,7 +537,7 @@ void tud_cdc_line_state_cb(uint8_t itf, bool dtr, bool rts)
       if(stdout->device==a2dev_usb && stdout->minor==itf) {
         stdout->device = a2dev_led;
       }
-    } else {
+    } else if(itf==cdc_disk) {
       // disk detatched
       if(stderr->device==a2dev_usb && stderr->minor==itf) {
         stderr->device = a2dev_led;
@@ -387,13 +550,23 @@ void tud_cdc_line_state_cb(uint8_t itf, bool dtr, bool rts)
 
 // Invoked when CDC interface received data from host
 void tud_cdc_rx_cb(uint8_t itf) {
-  (void) itf;
   // Do nothing at interupt level, wait for device task to drain buffers
+  task_ready(itf==cdc_tty ? tty_task_active :
+      itf==cdc_disk ? disk_task_active : graphics_task_active);
   // TODO writes to disk are read back as reads from the same device
 }
 
 void keyboard_task(void) {
   int c;
+#ifdef CSR_APPLE2_KEYFIFO_ADDR
+  // Top up the key queue; the 6502 takes keys from it as fast as it reads
+  // them rather than one each time this task runs.
+  int room = (apple2_keyfifo_read()>>CSR_APPLE2_KEYFIFO_ROOM_OFFSET) &
+      ((1<<CSR_APPLE2_KEYFIFO_ROOM_SIZE)-1);
+  while(room-- && (c=fgetc(stdin))!=EOF) {
+    apple2_keyboard_write(c|0x80);
+  }
+#else
   // Do nothing if character has already been sent
   if(!apple2_strobe_read()) {
     // Get the next character and send it
@@ -402,6 +575,12 @@ void keyboard_task(void) {
       apple2_keyboard_write(c|0x80);
     }
   }
+#endif
+  // Input may have been left in the USB buffer for want of room in stdin
+  if(canputc(stdin)>=TTY_READ_ROOM &&
+      (tty_held_count || tud_cdc_n_available(cdc_tty))) {
+    task_ready(tty_task_active);
+  }
 }
 
 // Convert an integer in the range 0-99 into a 1 or 2 digit string
@@ -425,19 +604,77 @@ void error(const char *msg) {
   fprintf(stdout, "Em:%s\n", msg);
 }
 
+//-----------------------------------------------------------------------
+// Shadow framebuffer rendering. The screen FIFO is emptied unread and screen
+// memory is compared with what the terminal shows instead: just the dirty
+// rows where the gateware reports them, otherwise every row periodically.
+// Rows left over, for want of room or during a scroll, are tried next tick.
+//-----------------------------------------------------------------------
+static void video_render(uint32_t dirty) {
+  while(screen_read() & (1<<CSR_APPLE2_SCREEN_VALID_OFFSET)) {
+  }
+  render_rows |= dirty;
+#ifndef CSR_APPLE2_DIRTY_ADDR
+  static a2time_t next_render;
+  if(!render_rows && system_ticks>=next_render) {
+    render_rows = RENDER_ALL_ROWS;
+    next_render = system_ticks+RENDER_PERIOD;
+  }
+#endif
+  if(render_rows) {
+    render_rows = render_update(stdout, (void*)(A2RAM_BASE+0x400),
+        render_rows);
+  }
+}
+
 void video_task(void) {
   static int vid;
   static char space_supress;
   // Pack these variables into a single memory access
   static unsigned char scroll_start, scroll_top, scroll_bottom, cursor_active;
+  static enum video_mode shown_mode;
   int c, h, v, rc=0;
   unsigned int flags;
+  uint32_t dirty = 0;
+#ifdef CSR_APPLE2_DIRTY_ADDR
+  // Rows are marked by every write. The stream only needs those of a pass
+  // where the FIFO dropped something. Reading clears the register.
+  dirty = apple2_dirty_read();
+  if(dirty & (1u<<CSR_APPLE2_DIRTY_LOST_OFFSET)) {
+    lost_rows |= dirty & ((1<<CSR_APPLE2_DIRTY_ROWS_SIZE)-1);
+  }
+  dirty &= (1<<CSR_APPLE2_DIRTY_ROWS_SIZE)-1;
+#endif
+  if(stdout->device == a2dev_usb && video_mode!=shown_mode) {
+    if(video_mode==video_shadow) {
+      // Start from a cleared terminal without a scroll region
+      if(canputc(stdout)<16) {
+        return;
+      }
+      puts("\033[r\033[H\033[J");
+      render_reset();
+      render_rows = RENDER_ALL_ROWS;
+      scroll_top = scroll_bottom = 0;
+      vid = 0;
+    } else {
+      // The terminal shows the screen; carry on from the cursor
+      prev_v = render_v;
+      prev_h = render_h-1;
+      cursor_v = -1;
+    }
+    shown_mode = video_mode;
+  }
+  if(stdout->device == a2dev_usb && video_mode==video_shadow) {
+    video_render(dirty);
+    return;
+  }
   // Print stored character if output buffer was full on the last attempt
   if(!(vid&(1<<CSR_APPLE2_SCREEN_VALID_OFFSET))) {
-    vid = apple2_screen_read();
+    vid = screen_read();
   }
   if(stdout->device == a2dev_usb) {
     while((canputc(stdout)>40) && (vid & (1<<CSR_APPLE2_SCREEN_VALID_OFFSET))) {
+      run_deadline_tasks();
       //fprintf(stderr, "%08x/", vid);
       h = (vid>>CSR_APPLE2_SCREEN_HORIZONTAL_OFFSET) & 0xff;
       v = (vid>>CSR_APPLE2_SCREEN_VERTICAL_OFFSET) & 0xff;
@@ -447,7 +684,7 @@ void video_task(void) {
       // sequence looking for disk controller writes to location 07F8.
       // This is an unlikely scenario so optimize for code space
       if(h>=40 || v>=24) {
-        vid = apple2_screen_read();
+        vid = screen_read();
         continue;
       }
       flags = vid&0x0000F800;
@@ -469,7 +706,7 @@ void video_task(void) {
               v=prev_v;
               h=prev_h;
               if(vid & (1<<CSR_APPLE2_SCREEN_MORE_OFFSET)) {
-                vid = apple2_screen_read();
+                vid = screen_read();
                 continue;
               }
               // No pending character so wait until next pass to check.
@@ -544,7 +781,7 @@ void video_task(void) {
           // highly unlikely there will be another character waiting but for
           // consistency, we check since the value of vid must be updated
           // anyway.
-          vid = apple2_screen_read();
+          vid = screen_read();
           continue;
         } else if(flags&(1<<CSR_APPLE2_SCREEN_SCROLLEND_OFFSET)) {
           //fprintf(stderr, "{e%d,%d}",v,h);
@@ -571,7 +808,7 @@ void video_task(void) {
           space_supress = 40;
           // Suppress this character also. Not suppressing would cause the
           // the cursor to redraw the character at line 23 column 1.
-          vid = apple2_screen_read();
+          vid = screen_read();
           continue;
         } else fprintf(stderr, "{vid:%08x}", vid);
         #else
@@ -586,59 +823,20 @@ void video_task(void) {
         // Perform software compress of clear to end of line.
         if(space_supress>0) {
           space_supress--;
-          vid = apple2_screen_read();
+          vid = screen_read();
           continue;
         }
       }
       //fprintf(stderr, "(%d,%d)", v,h);
-      // Reposition cursor in easiest way possible
-      if(v==prev_v) {
-        if(h==prev_h+1) {
-          // No repositioning necessary
-          //fputc('.', stderr);
-        } else if(h==0) {
-          // Use Carriage Return to return to beginning of current line
-          if(canputc(stdout) < 2) {
-            error("cr");
-            debug_counter[video_output_overflow]++;
-            break;
-          }
-          putchar('\r');
-        } else if(h<=prev_h && prev_h-h<5) {
-          // Use one or more backspaces
-          if(canputc(stdout) <= prev_h-h+1) {
-            error("bs");
-            debug_counter[video_output_overflow]++;
-            break;
-          }
-          for(int i=0; i<=prev_h-h; i++) {
-            putchar('\b');
-          }
-        } else {
-          // Resposition with ANSI CSI CHA Cursor Horizontal Absolute
-          if(canputc(stdout) < 6) {
-            error("nl");
-            debug_counter[video_output_overflow]++;
-            break;
-          }
-          printf("\033[%dG", h+1);
-        }
-      } else if(h==0 && v==prev_v+1) {
-        // Use Newline to get to beginning of next line
-        if(canputc(stdout) < 2) {
-          error("nl");
-          debug_counter[video_output_overflow]++;
-          break;
-        }
-        putchar('\n');
-      } else {
-        // Reposition with ANSI CSI CUP Cursor Position sequence
-        if(canputc(stdout) < 9) {
-          error("cup");
+      // Reposition cursor in the cheapest way possible. The terminal cursor
+      // is just past the previous character.
+      if(v!=prev_v || h!=prev_h+1) {
+        if(canputc(stdout) <= MOTION_MAX) {
+          error("mv");
           debug_counter[video_output_overflow]++;
           break;
         }
-        printf("\033[%d;%dH", v+1, h+1);
+        cursor_motion(stdout, prev_v, prev_h+1, v, h);
       }
       rc=putchar(c);
       if(rc<0) {
@@ -650,14 +848,19 @@ void video_task(void) {
       prev_h=h;
       prev_v=v;
       if(vid & (1<<CSR_APPLE2_SCREEN_MORE_OFFSET)) {
-        vid = apple2_screen_read();
+        vid = screen_read();
       } else {
       // Need to clear valid but may as well clear the whole thing
         vid=0;
       }
     }
     // At this point, vid will contain an unprinted character or 0 indicating
-    // done. Reposition cursor if no characters pending and cursor is misplaced.
+    // done. Rows with dropped writes are only repainted once the FIFO has
+    // been emptied so what is shown is not overwritten by older characters.
+    if(lost_rows && !(vid & (1<<CSR_APPLE2_SCREEN_VALID_OFFSET))) {
+      repaint_rows();
+    }
+    // Reposition cursor if no characters pending and cursor is misplaced.
     if(~(vid & ((1<<CSR_APPLE2_SCREEN_VALID_OFFSET)|
                (1<<CSR_APPLE2_SCREEN_MORE_OFFSET))) &&
                (cursor_h==prev_h && cursor_v==prev_v)) {
@@ -677,7 +880,7 @@ void video_task(void) {
         // Ignore off-screen writes to frame buffer. In particular, the boot
         // sequence looking for disk controller writes to location 07F8.
         // This is an unlikely scenario so optimize for code space
-        vid = apple2_screen_read();
+        vid = screen_read();
         continue;
       }
       // Handle repeat, scroll, space and other movements
@@ -688,7 +891,7 @@ void video_task(void) {
             // Compress multiple spaces to a single one
             if(c==' ') {
               // Clear to end of line - supress extra space
-              vid = apple2_screen_read();
+              vid = screen_read();
               continue;
             }
             // Fall through for normal printing of the last character
@@ -724,12 +927,12 @@ void video_task(void) {
         if(cursor_active || (vid&0xC0)==0x40) {
           // No need to show or remove cursor
           cursor_active = ~cursor_active;
-          vid = apple2_screen_read();
+          vid = screen_read();
           continue;
         }
         if(c==' ' && (prev_c==' ' || prev_c=='\n')) {
           // Suppress consecutive spaces
-          vid = apple2_screen_read();
+          vid = screen_read();
           continue;
         }
         if(h==prev_h+1 && v==prev_v) {
@@ -752,7 +955,7 @@ void video_task(void) {
       prev_h=h;
       prev_v=v;
       if(vid & (1<<CSR_APPLE2_SCREEN_MORE_OFFSET)) {
-        vid = apple2_screen_read();
+        vid = screen_read();
       } else {
         // Need to clear valid but may as well clear the whole thing as the
         // constant 0 saves instruction and cache space
@@ -763,6 +966,82 @@ void video_task(void) {
   }
 }
 
+//-----------------------------------------------------------------------
+// Lo-Res and Hi-Res frames for a viewer on the third CDC interface. The soft
+// switches choose the page; nothing is sent while text is shown as the tty
+// already has it. A frame is started only once the last has been sent and
+// graphics_interval after it started, so a slow link lowers the frame rate
+// rather than falling behind. One that took longer than the interval is
+// followed by a pause of half as long again to leave the bus to the tty and
+// disk. Any byte from the viewer asks for a key frame.
+//-----------------------------------------------------------------------
+#define GRAPHICS_INTERVAL   33          // ms: 30 frames per second
+#define GRAPHICS_RUN_BLOCKS 120         // Blocks compared per run of the task
+
+unsigned int graphics_interval = GRAPHICS_INTERVAL;
+
+void graphics_task(void) {
+#ifdef CSR_APPLE2_DISPLAY_ADDR
+  static a2time_t frame_start, next_frame;
+  static const void *page;
+  uint8_t buf[CFG_TUD_CDC_TX_BUFSIZE];
+  uint32_t display, base;
+  a2time_t elapsed;
+  int n, flags;
+  if(!tud_cdc_n_connected(cdc_video)) {
+    graphics_reset();
+    return;
+  }
+  if(tud_cdc_n_available(cdc_video)) {
+    tud_cdc_n_read(cdc_video, buf, sizeof(buf));
+    graphics_reset();
+  }
+  if(!graphics_pending()) {
+    display = apple2_display_read();
+    if(!graphics_interval || system_ticks<next_frame ||
+        !(display & (1<<CSR_APPLE2_DISPLAY_GRAPHICS_OFFSET))) {
+      return;
+    }
+    flags = 0;
+    if(display & (1<<CSR_APPLE2_DISPLAY_HIRES_OFFSET)) {
+      flags |= graphics_hires;
+    }
+    if(display & (1<<CSR_APPLE2_DISPLAY_PAGE2_OFFSET)) {
+      flags |= graphics_page2;
+    }
+    if(display & (1<<CSR_APPLE2_DISPLAY_MIXED_OFFSET)) {
+      flags |= graphics_mixed;
+    }
+    base = flags&graphics_hires ? 0x2000 : 0x400;
+    if(flags&graphics_page2) {
+      base <<= 1;
+    }
+    page = (const void*)(A2RAM_BASE+base);
+    graphics_frame(flags);
+    frame_start = system_ticks;
+  }
+  n = graphics_encode(buf, tud_cdc_n_write_available(cdc_video), page,
+      GRAPHICS_RUN_BLOCKS);
+  if(n) {
+    tud_cdc_n_write(cdc_video, buf, n);
+    tud_cdc_n_write_flush(cdc_video);
+    trace(trace_usb, trace_usb_cdc_tx, n);
+  }
+  if(graphics_pending()) {
+    // Carry on next pass unless waiting for the USB to make room
+    if(tud_cdc_n_write_available(cdc_video)>=GRAPHICS_BLOCK_MAX) {
+      task_ready(graphics_task_active);
+    }
+  } else {
+    elapsed = system_ticks-frame_start;
+    next_frame = frame_start+graphics_interval;
+    if(elapsed>graphics_interval) {
+      next_frame = system_ticks+(elapsed>>1);
+    }
+  }
+#endif
+}
+
 void init(void) {
   rgb_init(LED_RAW);                    // Show successful handoff to main
   rgb_raw_write(RGB_RAW_YELLOW);
@@ -793,11 +1072,21 @@ void init(void) {
 #endif
   tusb_init();
   disk_init();
+#ifdef CSR_APPLE2_DIRTY_ADDR
+  // Let the Apple run at full speed; dirty rows cover for a full screen FIFO
+  apple2_control_write(apple2_control_read() |
+      (1<<CSR_APPLE2_CONTROL_LOSSY_OFFSET));
+#endif
+#ifdef CSR_APPLE2_RUN_ADDR
+  // Screen writes are read in runs through screen_read()
+  apple2_control_write(apple2_control_read() |
+      (1<<CSR_APPLE2_CONTROL_BATCH_OFFSET));
+#endif
 #ifndef SIMULATION
   // Mount root filesystem
   mount((void*)(FLASHFS_START_ADDRESS+SPIFLASH_BASE), 0);
-  // Run startup program script
-  exec("HELLO");
+  // Run startup program script once the scheduler is going
+  cli_script("HELLO");
 #endif
 }
 
@@ -809,30 +1098,102 @@ void init(void) {
  *============================================================================*/
 
 int active_tasks;
+volatile unsigned int ready_tasks = (1<<max_task)-1;  // Everything runs once
+
+// Interrupt handlers also set bits so the update is made with them disabled.
+void task_ready(enum task_num task) {
+  int ie = irq_getie();
+  irq_setie(0);
+  ready_tasks |= 1<<task;
+  irq_setie(ie);
+}
 
+// Histogram bin of a duration: the position of its highest set bit, found
+// with a binary search as there is no count leading zeros instruction.
+static int duration_bin(uint32_t cycles) {
+  int bin = 0;
+  if(cycles>>16) { cycles >>= 16; bin += 16; }
+  if(cycles>>8)  { cycles >>= 8;  bin += 8; }
+  if(cycles>>4)  { cycles >>= 4;  bin += 4; }
+  if(cycles>>2)  { cycles >>= 2;  bin += 2; }
+  if(cycles>>1)  { bin += 1; }
+  return bin<TASK_HISTOGRAM_BINS ? bin : TASK_HISTOGRAM_BINS-1;
+}
+
+// Deadline tasks are polled far more often than they have work and would
+// fill the trace with empty runs. They trace themselves when they do work.
+#define UNTRACED_TASKS (1<<disk_feed_task_active)
+
+// A task is run only when it is ready and not already running further up the
+// stack. Its bit is cleared first so that events while it runs are kept.
 void run_task(void(*task)(void), enum task_num num) {
   int mask = 1<<num;
-  if(!(active_tasks & mask)) {
+  if(!(active_tasks & mask) && (ready_tasks & mask)) {
+    int ie = irq_getie();
+    irq_setie(0);
+    ready_tasks &= ~mask;
+    irq_setie(ie);
     active_tasks|=mask;
-    a2perf_t starttime;
-    perfmon_start(&starttime);
+    // Timed with the cycle counter directly. Interrupts and nested tasks run
+    // from yield() are included in the time of the task that was interrupted.
+    if(!(mask&UNTRACED_TASKS)) {
+      trace(trace_task_enter, num, 0);
+    }
+    uint32_t start = csrr(mcycle);
     (*task)();
-    task_runtime[num] += perfmon_end(starttime);
+    uint32_t cycles = csrr(mcycle)-start;
+    if(!(mask&UNTRACED_TASKS)) {
+      trace(trace_task_exit, num, 0);
+    }
+    struct task_stats *stats = &task_stats[num];
+    stats->calls++;
+    stats->total += cycles;
+    if(cycles>stats->max) {
+      stats->max = cycles;
+    }
+    stats->histogram[duration_bin(cycles)]++;
     active_tasks&=~mask;
   }
 }
 
+// Tasks are in two priority classes. Ordinary tasks take turns while those
+// with a hard deadline are checked again before each ordinary task, so a
+// ready one never waits for more than a single ordinary task to finish.
+void run_deadline_tasks(void) {
+  run_task(disk_feed_task, disk_feed_task_active);
+}
+
 void run_task_list(void) {
   // Generic FOMU operating system tasks
+  run_deadline_tasks();
   run_task(tty_task, tty_task_active);
+  run_deadline_tasks();
   run_task(tud_task,      tud_task_active);
+  run_deadline_tasks();
   // TODO Separate morse task into generic LED and Touch with Morse Code modes
   run_task(morse_task,    led_task_active);
   //run_task(touch_task,    touch_task_active);  // TODO Need to write this
-  //run_task(cli_task,      cli_task_active);    // TODO Need to write this
+  run_deadline_tasks();
+  run_task(coroutine_task, cli_task_active);
+  run_deadline_tasks();
   run_task(keyboard_task, keyboard_task_active);
+  run_deadline_tasks();
   run_task(video_task,    video_task_active);
+  run_deadline_tasks();
   run_task(disk_task,     disk_task_active);
+  run_deadline_tasks();
+  run_task(graphics_task, graphics_task_active);
+}
+
+// Sleep until an interrupt when no task is ready. Interrupts are disabled
+// while checking so one arriving just before the wfi is not missed: wfi
+// still wakes on a pending interrupt and it is serviced once re-enabled.
+static void idle(void) {
+  irq_setie(0);
+  if(!ready_tasks) {
+    asm volatile ("wfi");
+  }
+  irq_setie(1);
 }
 
 void yield(void) {
@@ -853,7 +1214,12 @@ void yield(void) {
     //fprintf(persistence, "Yield timeout: %02x %d\n", active_tasks, ny);
     //reboot();
   //}
-  run_task_list();
+  if(coroutine_current) {
+    // Back to the main loop; the stack stays flat and deadlines are kept.
+    coroutine_yield();
+  } else {
+    run_task_list();
+  }
 }
 
 int main(void) {
@@ -864,6 +1230,7 @@ int main(void) {
     watchdog_timer = 0; // reboot if main loop not called every so often
     yield_timeout = rtc_read()+yield_max;
     run_task_list();
+    idle();
   }
   return 0;
 }
@@ -207,6 +207,102 @@ a2time_t key_down_start[morse_key_max];         // time when key press detected
 unsigned char touch_debounce[morse_key_max];    // filter state updated by ISR
 unsigned char touch[morse_key_max];             // binary state updated by task
 
+/*============================================================================*
+ * Transmit Schedule                                                          *
+ *----------------------------------------------------------------------------*
+ * Outgoing text is compiled by the task into runs of the LED being on or off *
+ * and played by the 1ms timer interrupt, so the timing does not depend on    *
+ * how busy the main loop is. A run is a byte: the top bit is the LED state   *
+ * and the rest its length in dit times. The task is only woken when there is *
+ * room for another character and text waiting, or when the schedule runs    *
+ * out and a pause has to be ended.                                           *
+ *============================================================================*/
+#define MORSE_ON        0x80
+#define MORSE_DITS      0x7F
+
+// buffer must be a power of 2 to avoid extremely slow division
+#define MORSE_SCHEDULE  64
+// Most runs a single character compiles into: seven symbols, each on and off
+#define MORSE_CHAR_RUNS 14
+
+/* TX State                                                                   *
+ * Idle: nothing sent since the last pause                                    *
+ *     <space> -> transmit start then word space, Space                       *
+ * Character: a character and letter space have been sent                    *
+ *     <space> -> wait the rest of a word space, Space                        *
+ * Space: a space has been sent                                               *
+ *     <space> -> transmit start then word space, Space                       *
+ *     text runs out -> transmit end then word space, Idle                    *
+ * Any other character is transmitted followed by a letter space and moves to *
+ * Character. Running out of text anywhere else moves to Idle.                */
+enum morse_state {
+  IDLE,
+  CHARACTER,
+  SPACE,
+};
+
+static volatile enum morse_state morse_state;
+static uint8_t schedule[MORSE_SCHEDULE];
+// Head is advanced by the task and tail by the interrupt
+static volatile unsigned int schedule_head, schedule_tail;
+// Time left of the run being played, counted down by the interrupt
+static int run_dits, dit_ticks;
+
+static inline int schedule_room(void) {
+  return MORSE_SCHEDULE-(schedule_head-schedule_tail);
+}
+
+static inline int schedule_empty(void) {
+  return schedule_head==schedule_tail;
+}
+
+static inline int text_waiting(void) {
+  return stdout->device==a2dev_led && cangetc(stdout);
+}
+
+static void schedule_run(int run) {
+  schedule[schedule_head&(MORSE_SCHEDULE-1)] = run;
+  // The run must be in place before the interrupt can see the new head
+  asm volatile ("" ::: "memory");
+  schedule_head++;
+}
+
+// Symbols of a pattern below its start bit then the given space.
+static void schedule_pattern(int pattern, int space) {
+  int bit;
+  for(bit=0x80; !(pattern&bit); bit>>=1) {
+  }
+  while(bit>>=1) {
+    schedule_run(MORSE_ON | ((pattern&bit) ? 3 : 1));
+    schedule_run(bit>1 ? SYMBOL_SPACE : space);
+  }
+}
+
+// Called every 1ms. Counting each run down a dit at a time avoids a multiply.
+static void morse_play(void) {
+  int run;
+  if(run_dits) {
+    if(--dit_ticks) {
+      return;
+    }
+    dit_ticks = dit_duration;
+    if(--run_dits) {
+      return;
+    }
+  }
+  if(!schedule_empty()) {
+    run = schedule[schedule_tail&(MORSE_SCHEDULE-1)];
+    schedule_tail++;
+    rgb_raw_write((run&MORSE_ON) ? rgb_morse_on : rgb_morse_off);
+    run_dits = run&MORSE_DITS;
+    dit_ticks = dit_duration;
+  }
+  if(schedule_room()>=MORSE_CHAR_RUNS &&
+      (text_waiting() || (schedule_empty() && morse_state!=IDLE))) {
+    task_ready(led_task_active);
+  }
+}
+
 /*============================================================================*
  * Interrupt Service Routine                                                  *
  *----------------------------------------------------------------------------*
@@ -216,6 +312,7 @@ unsigned char touch[morse_key_max];             // binary state updated by task
  * and thus uses the coeficients 0x3F for 0.25 and 0xC0 for 0.75. This acts   *
  * like analog RC filter. Followed this, hysteresis will be added during the  *
  * main task loop emulating schmitt trigger.                                  *
+ * The transmit schedule is then advanced.                                    *
  *============================================================================*/
 void morse_isr(void) {
   int i, button_state;
@@ -228,6 +325,7 @@ void morse_isr(void) {
       touch_debounce[i] += (0xFF>>2);
     }
   }
+  morse_play();
 }
 
 /*============================================================================*
@@ -338,33 +436,21 @@ void morse_key_switch_task(void) {
  * Monitor touchpads and place any detected symbols in stdin                  *
  *============================================================================*/
 static inline int dequeue(void) {
-  int code = 0;
   #if 0
   if((stderr->device == a2dev_led) && (cangetc(stderr))) {
-    code = fgetc(stderr);
-  } else
-  #endif
-  if((stdout->device == a2dev_led) && (cangetc(stdout))) {
-    code = fgetc(stdout);
+    return fgetc(stderr);
   }
-  if((code == '\r') || (code == '\n')) {
-    code = MORSE_END;
-  } else if(code) {
-    if(code > 96) {
-      // convert lower case to upper case: if(isupper(c)) tolower(c)
-      code -= 32;
-    }
-    code = morse_hw[(code-32) & 63];
+  #endif
+  if(text_waiting()) {
+    return fgetc(stdout);
   }
-  return code;
+  return 0;
 }
 
 
 /*============================================================================*
- * Timing Routines                                                            *
- * Prerequisite: assumes 1ms timer is running                                 *
+ * Configuration                                                              *
  *============================================================================*/
-#define CLOCK_NS 1000000
 
 /* Configuration - volatile to keep them out of read-only memory and able to
  * be changed at runtime                                                      */
@@ -372,72 +458,19 @@ int rgb_morse_on;
 int rgb_morse_off;
 long dit_duration;
 
-/* Class Variables */
-a2time_t next_event_time = 0;
-int current_character = 0;
-int previous_character = 0;
-int morse_on = false;
-
-
-static inline void set_timer(int dit_times) {
-  next_event_time = rtc_read() + dit_times * dit_duration;
-}
-
-static inline int timer_expired(void) {
-  a2time_t now;
-  now = rtc_read();
-  return now >= next_event_time;
-}
-
-static void set_morse(bool on, int t) {
-  rgb_raw_write(on ? rgb_morse_on : rgb_morse_off);
-  morse_on = on;
-  set_timer(t);
-}
-
-/*============================================================================*
- * TX State                                                                   *
- *============================================================================*
- * Idle: do nothing then                                                      *
- *     received <space> -> Start                                              *
- *     received any other character -> Character                              *
- *     nothing pending -> Idle                                                *
- * Start: transmit start then                                                 *
- *     always -> Space                                                        *
- * Character: transmit character then letter space then                       *
- *     received <space> -> Space                                              *
- *     received any other character -> Character                              *
- *     nothing pending -> Idle                                                *
- * Space: transmit space then                                                 *
- *     received <space> -> Start                                              *
- *     received any other character -> Character                              *
- *     nothing pending -> End                                                 *
- * Stop: transmit start then                                                  *
- *     always -> Idle                                                         *
- *============================================================================*/
-
-enum morse_state {
-  IDLE,
-  START,
-  STOP,
-  CHARACTER,
-  SPACE,
-};
-
-enum morse_state morse_state;
-int current_pattern;
-int current_bit;
-
 void morse_init(void) {
   rgb_morse_off = 0;            // Black
   rgb_morse_on = 7;             // White
   dit_duration = 300;           // 30 ms is standard speed
   max_dit_time = 400;
 #ifdef SIMULATION
-  dit_duration = 1;             // 0.1 ms, not humanly detectable
+  dit_duration = 1;             // 1 ms, not humanly detectable
 #else
   //dit_duration = 100;         // 30 ms, standard speed
 #endif
+  morse_state = IDLE;
+  schedule_head = schedule_tail = 0;
+  run_dits = 0;
 
   // Turn on RGB block and current enable, enable led control enable LED
   // driver, set 250 Hz mode, enable quick stop, set clock to 12 MHz/64 kHz-1.
@@ -463,114 +496,64 @@ void morse_init(void) {
 }
 
 int morse_isidle(void) {
-  return morse_state == IDLE;
+  return schedule_empty() && !run_dits && morse_state!=SPACE;
 }
 
 /*============================================================================*
  * Morse Code TX                                                              *
  *----------------------------------------------------------------------------*
- * Called when the transmit timer expires to flip the transmit LED on/off as  *
- * required. Also handles pulling characters from the transmit buffers.       *
+ * Compile a character onto the end of the transmit schedule. Returns EOF if  *
+ * there is not room for it, which morse_task makes sure of.                  *
  *============================================================================*/
-void morse_transmit_task(void) {
-  if (morse_state == IDLE) {
-    current_pattern = dequeue();
-    if (!current_pattern) {
-      return;
-    }
-    morse_state = CHARACTER;
-    if (current_pattern == MORSE_SPACE) {
-      morse_state = START;
-      current_pattern = MORSE_START;
-      // Begin with space after start bit
-      current_bit = MORSE_START_FIRST_BIT-1;
-    } else {
-      // advance to start bit
-      current_bit = 0x80;
-      while(!(current_pattern&current_bit)) {
-        current_bit>>=1;
-      }
-    }
-    // Wait until start of next period to prevent partial bit time
-    set_morse(false, 1);
-    return;
-  }
-
-  // If bit was just transmitted, turn off light and wait appropriately
-  if (morse_on) {
-    int t;
-    t = SYMBOL_SPACE;
-    if (current_bit == 1) {
-      // Last bit was sent. Turn off and wait appropriate time
-      t = LETTER_SPACE;
-      if (morse_state == START) {
-        t = WORD_SPACE;
-        morse_state = SPACE;
-      } else if (morse_state == STOP) {
-        t = WORD_SPACE;
-        morse_state = IDLE;
-      }
-    }
-    set_morse(false, t);
-    return;
-  }
-
-  // Intra-character break just completed - send next bit
-  current_bit>>=1;
-  if (current_bit) {
-    set_morse(true, (current_pattern&current_bit) ? 3 : 1);
-    return;
+int morse_putchar(int c) {
+  int pattern;
+  if(schedule_room()<MORSE_CHAR_RUNS) {
+    return EOF;
   }
-
-  // Get next character to send
-  current_pattern = dequeue();
-  if (!current_pattern) {
-    // No more to send - go to idle unless last character was a space
-    // To prevent a small break from being interpreted as space, go STOP
-    // whether or not the last character was a space
-    if (morse_state == SPACE) {
-      morse_state = STOP;
-      current_pattern = MORSE_END;
-    } else {
-      // Wait longer than a word space before restarting to prevent spaces
-      set_timer(2*WORD_SPACE+1);
-      return;
+  if((c == '\r') || (c == '\n')) {
+    pattern = MORSE_END;
+  } else {
+    if(c > 96) {
+      // convert lower case to upper case: if(isupper(c)) tolower(c)
+      c -= 32;
     }
+    pattern = morse_hw[(c-32) & 63];
   }
-
-  if (current_pattern == MORSE_SPACE) {
-    if (morse_state == SPACE) {
-      morse_state = START;
-      current_pattern = MORSE_START;
+  if(pattern == MORSE_SPACE) {
+    if(morse_state == CHARACTER) {
+      // Letter space already sent so wait the difference
+      schedule_run(WORD_SPACE-LETTER_SPACE);
     } else {
-      // inter-character space just sent so wait difference
-      morse_state = SPACE;
-      set_morse(false, WORD_SPACE-LETTER_SPACE);
-      return;
+      // Start keeps consecutive spaces or a leading one from merging
+      schedule_pattern(MORSE_START, WORD_SPACE);
     }
+    morse_state = SPACE;
+  } else {
+    schedule_pattern(pattern, LETTER_SPACE);
+    morse_state = CHARACTER;
   }
-
-  // advance to start bit
-  current_bit = 0x80;
-  while(!(current_pattern&current_bit)) {
-    current_bit>>=1;
-  }
-  // skip start bit
-  current_bit>>=1;
-  set_morse(true, (current_pattern&current_bit) ? 3 : 1);
+  return c;
 }
 
 
 /*============================================================================*
  * Main Task                                                                  *
  *----------------------------------------------------------------------------*
- * Called by the scheduler periodically to read the key switches and update   *
- * the LED status.                                                            *
+ * Woken by the interrupt when the schedule has room for text waiting to be   *
+ * sent or has run out. To prevent a small break from being interpreted as a  *
+ * space, a space followed by a pause is ended with End.                      *
  *============================================================================*/
 void morse_task(void) {
+  int c;
   // FIXME TODO XXX morse_key_switch_task();
-  if (timer_expired()) {
-    morse_transmit_task();
+  while(schedule_room()>=MORSE_CHAR_RUNS && (c=dequeue())) {
+    (void)morse_putchar(c);
+  }
+  if(schedule_empty() && !text_waiting()) {
+    if(morse_state == SPACE) {
+      schedule_pattern(MORSE_END, WORD_SPACE);
+    }
+    morse_state = IDLE;
   }
 }
 
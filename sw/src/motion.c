@@ -0,0 +1,221 @@
+//
+// motion.c - Part of a2fomu - Copyright (c) 2020-2021 Doug Eaton
+//
+// This file is part of a2fomu which is released under the two clause BSD
+// licence.  See file LICENSE in the project root directory or visit the
+// project at https://github.com/elecbrick/a2fomu for full license details.
+
+// Optimized cursor motion for the 40x24 text screen on an ANSI terminal.
+//
+// Every way of getting from one position to another is priced in bytes sent
+// over USB and the cheapest is queued: carriage return, backspace, newline,
+// relative moves (CSI A, B, C, D), horizontal absolute (CSI G) and absolute
+// position (CSI H). All of the escape sequences are assembled from the
+// preformatted tables below with memcpy so no number conversion is needed.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <motion.h>
+
+typedef struct {
+  uint8_t length;
+  char text[7];
+} motion_seq;
+
+#define SEQ(s) { sizeof(s)-1, s }
+
+// Preformatted decimal parameters 1-40, CSI CHA for each column and CSI CUP
+// to the first column of each row.
+static const motion_seq count[40] = {
+  SEQ("1"), SEQ("2"), SEQ("3"), SEQ("4"), SEQ("5"), SEQ("6"),
+  SEQ("7"), SEQ("8"), SEQ("9"), SEQ("10"), SEQ("11"), SEQ("12"),
+  SEQ("13"), SEQ("14"), SEQ("15"), SEQ("16"), SEQ("17"), SEQ("18"),
+  SEQ("19"), SEQ("20"), SEQ("21"), SEQ("22"), SEQ("23"), SEQ("24"),
+  SEQ("25"), SEQ("26"), SEQ("27"), SEQ("28"), SEQ("29"), SEQ("30"),
+  SEQ("31"), SEQ("32"), SEQ("33"), SEQ("34"), SEQ("35"), SEQ("36"),
+  SEQ("37"), SEQ("38"), SEQ("39"), SEQ("40"),
+};
+
+static const motion_seq column_absolute[40] = {
+  SEQ("\033[1G"), SEQ("\033[2G"), SEQ("\033[3G"), SEQ("\033[4G"),
+  SEQ("\033[5G"), SEQ("\033[6G"), SEQ("\033[7G"), SEQ("\033[8G"),
+  SEQ("\033[9G"), SEQ("\033[10G"), SEQ("\033[11G"), SEQ("\033[12G"),
+  SEQ("\033[13G"), SEQ("\033[14G"), SEQ("\033[15G"), SEQ("\033[16G"),
+  SEQ("\033[17G"), SEQ("\033[18G"), SEQ("\033[19G"), SEQ("\033[20G"),
+  SEQ("\033[21G"), SEQ("\033[22G"), SEQ("\033[23G"), SEQ("\033[24G"),
+  SEQ("\033[25G"), SEQ("\033[26G"), SEQ("\033[27G"), SEQ("\033[28G"),
+  SEQ("\033[29G"), SEQ("\033[30G"), SEQ("\033[31G"), SEQ("\033[32G"),
+  SEQ("\033[33G"), SEQ("\033[34G"), SEQ("\033[35G"), SEQ("\033[36G"),
+  SEQ("\033[37G"), SEQ("\033[38G"), SEQ("\033[39G"), SEQ("\033[40G"),
+};
+
+static const motion_seq row_absolute[24] = {
+  SEQ("\033[1H"), SEQ("\033[2H"), SEQ("\033[3H"), SEQ("\033[4H"),
+  SEQ("\033[5H"), SEQ("\033[6H"), SEQ("\033[7H"), SEQ("\033[8H"),
+  SEQ("\033[9H"), SEQ("\033[10H"), SEQ("\033[11H"), SEQ("\033[12H"),
+  SEQ("\033[13H"), SEQ("\033[14H"), SEQ("\033[15H"), SEQ("\033[16H"),
+  SEQ("\033[17H"), SEQ("\033[18H"), SEQ("\033[19H"), SEQ("\033[20H"),
+  SEQ("\033[21H"), SEQ("\033[22H"), SEQ("\033[23H"), SEQ("\033[24H"),
+};
+
+// Newline reaches the tty as CR LF so it costs two bytes.
+#define NEWLINE_COST 2
+
+// Backspaces are only used while cheaper than any escape sequence.
+#define MAX_BACKSPACE 3
+
+static int known(int v, int h) {
+  return v>=0 && v<MOTION_ROWS && h>=0 && h<MOTION_COLUMNS;
+}
+
+// Bytes in CSI n A/B/C/D. The parameter is omitted when it is one.
+static int relative_cost(int n) {
+  if(n<0) {
+    n = -n;
+  }
+  return n==0 ? 0 : n==1 ? 3 : 3+count[n-1].length;
+}
+
+static char *relative(char *s, int n, char forward, char back) {
+  if(n) {
+    *s++ = '\033';
+    *s++ = '[';
+    if(n<0) {
+      n = -n;
+      forward = back;
+    }
+    if(n>1) {
+      memcpy(s, count[n-1].text, count[n-1].length);
+      s += count[n-1].length;
+    }
+    *s++ = forward;
+  }
+  return s;
+}
+
+//-----------------------------------------------------------------------
+// Cheapest way along the current row. The starting column may be unknown,
+// such as after the last column was written, leaving only carriage return
+// and absolute moves.
+//-----------------------------------------------------------------------
+enum horizontal {
+  h_none,
+  h_return,
+  h_backspace,
+  h_relative,
+  h_return_relative,
+  h_absolute,
+};
+
+static int horizontal_plan(int from, int to, enum horizontal *how) {
+  int cost, best;
+  int from_known = from>=0 && from<MOTION_COLUMNS;
+  if(from_known && from==to) {
+    *how = h_none;
+    return 0;
+  }
+  if(to==0) {
+    *how = h_return;
+    return 1;
+  }
+  *how = h_absolute;
+  best = column_absolute[to].length;
+  if(from_known) {
+    if(from>to && from-to<=MAX_BACKSPACE && from-to<best) {
+      *how = h_backspace;
+      best = from-to;
+    }
+    if((cost=relative_cost(to-from))<best) {
+      *how = h_relative;
+      best = cost;
+    }
+  }
+  if((cost=1+relative_cost(to))<best) {
+    *how = h_return_relative;
+    best = cost;
+  }
+  return best;
+}
+
+static char *horizontal(char *s, int from, int to, enum horizontal how) {
+  switch(how) {
+  case h_none:
+    break;
+  case h_return:
+    *s++ = '\r';
+    break;
+  case h_backspace:
+    for( ; from>to; from--) {
+      *s++ = '\b';
+    }
+    break;
+  case h_relative:
+    s = relative(s, to-from, 'C', 'D');
+    break;
+  case h_return_relative:
+    *s++ = '\r';
+    s = relative(s, to, 'C', 'D');
+    break;
+  case h_absolute:
+    memcpy(s, column_absolute[to].text, column_absolute[to].length);
+    s += column_absolute[to].length;
+    break;
+  }
+  return s;
+}
+
+//-----------------------------------------------------------------------
+// Queue the cheapest cursor motion from one position to another. Positions
+// are zero based and give where the next character will be written. Returns
+// the number of bytes queued, which is never more than MOTION_MAX, or EOF if
+// the sequence did not fit in the stream.
+//-----------------------------------------------------------------------
+int cursor_motion(FILE *stream, int v0, int h0, int v, int h) {
+  char seq[MOTION_MAX];
+  char *s = seq;
+  enum horizontal how=h_none, how_after_newline=h_none;
+  enum { v_absolute, v_relative, v_newline } vertical = v_absolute;
+  int cost, best;
+
+  // Absolute positioning always works. The column is omitted when it is one.
+  best = row_absolute[v].length;
+  if(h) {
+    best += 1+count[h].length;
+  }
+  if(known(v0, 0)) {
+    if((cost=relative_cost(v-v0)+horizontal_plan(h0, h, &how))<best) {
+      vertical = v_relative;
+      best = cost;
+    }
+    if(v==v0+1 &&
+        (cost=NEWLINE_COST+horizontal_plan(0, h, &how_after_newline))<best) {
+      vertical = v_newline;
+      best = cost;
+    }
+  }
+  switch(vertical) {
+  case v_absolute:
+    if(h) {
+      memcpy(s, row_absolute[v].text, row_absolute[v].length-1);
+      s += row_absolute[v].length-1;
+      *s++ = ';';
+      memcpy(s, count[h].text, count[h].length);
+      s += count[h].length;
+      *s++ = 'H';
+    } else {
+      memcpy(s, row_absolute[v].text, row_absolute[v].length);
+      s += row_absolute[v].length;
+    }
+    break;
+  case v_relative:
+    s = relative(s, v-v0, 'B', 'A');
+    s = horizontal(s, h0, h, how);
+    break;
+  case v_newline:
+    *s++ = '\n';
+    s = horizontal(s, 0, h, how_after_newline);
+    break;
+  }
+  return s==seq ? 0 : fputseq(stream, seq, s-seq);
+}
@@ -8,19 +8,44 @@
 #include <generated/mem.h>
 #include "a2fomu.h"
 #include "flash.h"
+#include "rtc.h"
 #include "tusb.h"
-
-#define FATFS_NUM_SECTORS  (0x17E)
-#if FATFS_NUM_SECTORS != (FLASHFS_NUM_SECTORS-2)
-#if SPIFLASH_SIZE == 0x01000000
-// Ignore this as Fomu EVT has larger flash than regular Fomu PVT does.
-#else
-#error "Block count mismatch"
-#endif /* SPIFLASH_SIZE == 0x01000000 */
-#endif /* FATFS_NUM_SECTORS != (FLASHFS_NUM_SECTORS-2) */
+#include "trace.h"
+
+// Volume geometry is derived from the flash size: one boot sector, the FAT,
+// 256 root directory entries and one 4kB cluster per remaining sector. Fomu
+// PVT (2MB) yields a FAT12 volume of under 400 clusters while Fomu EVT (16MB)
+// yields nearly 4000. FAT16 is used once the cluster count requires it.
+#define FATFS_NUM_SECTORS   FLASHFS_NUM_SECTORS
+#define FATFS_ROOT_ENTRIES  256
+#define FATFS_ROOT_SECTORS  (FATFS_ROOT_ENTRIES*32/FLASHFS_SECTOR_SIZE)
+#define FATFS_MAX_CLUSTERS  (FATFS_NUM_SECTORS-1-FATFS_ROOT_SECTORS)
+#define FATFS_FAT_BITS      (FATFS_MAX_CLUSTERS<4085 ? 12 : 16)
+#define FATFS_FAT_SECTORS   (((FATFS_MAX_CLUSTERS+2)*FATFS_FAT_BITS/8+ \
+                              FLASHFS_SECTOR_SIZE-1)/FLASHFS_SECTOR_SIZE)
+#if FATFS_NUM_SECTORS > 0xFFFF
+#error "Flash drive too large for 16-bit sector count"
+#endif /* FATFS_NUM_SECTORS > 0xFFFF */
 
 int flash_drive = FIRST_SAFE_ADDRESS;
 
+// Read-ahead block for sequential host reads. TinyUSB requests each 4kB
+// logical sector in CFG_TUD_MSC_BUFSIZE chunks. When a read continues exactly
+// where the previous one ended, the whole sector is copied from the memory
+// mapped SPI flash in a single pass and the remaining chunks are served from
+// RAM instead of restarting the SPI read command for every chunk.
+#define MSC_NO_BLOCK  (-1)
+#define MSC_IDLE_MS   100               // Gap that ends a transfer burst
+static uint8_t msc_block[FLASHFS_SECTOR_SIZE];
+static int msc_block_lba = MSC_NO_BLOCK;
+static int msc_next_address = MSC_NO_BLOCK;
+static a2time_t msc_last_read;
+struct msc_stats msc_stats;
+
+void msc_invalidate(void) {
+  msc_block_lba = MSC_NO_BLOCK;
+}
+
 // The filesystem initialization shown here is not part of the a2fomu
 // operating system. Instead, the filesystem is loaded into flash directly as
 // a byproduct of programming the a2fomu gateware and firmware into flash.
@@ -34,9 +59,10 @@ uint8_t boot_sector[] = {
   0x01, 0x00,                      // Reserved logical sectors:     1 00e-00f
   0x01,                            // Num. File Allocation Tables:  1     010
   0x00, 0x01,                      // Max. root directory entries:256 011-012
-  0x80, 0x01, //FLASHFS_NUM_SECTORS// Total logical sectors:      382 013-014
+  FATFS_NUM_SECTORS&0xFF,          // Total logical sectors:      384 013-014
+  FATFS_NUM_SECTORS>>8,
   0xF8,                            // Media descriptor (in BPB)   xF8     015
-  0x01, 0x00,                      // Logical sectors per FAT:      1 016-017
+  FATFS_FAT_SECTORS, 0x00,         // Logical sectors per FAT:      1 016-017
   0x20, 0x00,                      // Physical sectors per track:   1 018-019
   0x01, 0x00,                      // Number of heads:              1 01a-01b
   0x00, 0x00, 0x00, 0x00,          // Hidden sectors (not partnd):  0 (required)
@@ -46,15 +72,20 @@ uint8_t boot_sector[] = {
   0x29,                            // Extended boot signature:    x29 (required)
   0x21, 0x20, 0x31, 0x01,          // Volume ID (BCD)             nnn 027-02a
   'A','2','F','o','m','u',' ',' ',' ',' ',' ',  // Volume Label:   "" 02b-035
-  'F','A','T','1','2',' ',' ',' ', // File system type:            "" 036-03d
+  'F','A','T','1',                 // File system type:            "" 036-03d
+  FATFS_FAT_BITS==12 ? '2' : '6',' ',' ',' ',
 };
 uint8_t boot_sector_signature[] = {
   0x55, 0xAA                       // Boot sector signature           1fe-1ff
 };
 
-// Block1: FAT12 Table
+// Block1: FAT Table
 uint8_t fat_table_init[] = {
+#if FATFS_FAT_BITS == 16
+  0xF8,0xFF,0xFF,0xFF,  // FAT ID / Media Descriptor + End Of Chain
+#else
   0xF8,0xFF,0xFF,   // FAT ID / Media Descriptor + End Of Chain
+#endif
   //0xFF,0x0F,0x00,   // Cluster end of readme file
 };
 
@@ -104,8 +135,9 @@ bool tud_msc_test_unit_ready_cb(uint8_t lun)
 void tud_msc_capacity_cb(uint8_t lun, uint32_t* block_count,
     uint16_t* block_size) {
   (void)lun;
-  // Drive size is requested.
-  *block_count = FLASHFS_NUM_SECTORS;
+  // Drive size is requested. Everything past the reserved area belongs to
+  // the drive so larger flash parts simply present a larger volume.
+  *block_count = FATFS_NUM_SECTORS;
   *block_size  = FLASHFS_SECTOR_SIZE;
 }
 
@@ -129,10 +161,40 @@ bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start,
 // READ10 command is received.
 // Translate logical block address to flash memory address and copy the
 // requrested number of bytes to the buffer.
+// Sequential reads are satisfied from the read-ahead block.
 int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize) {
   (void)lun;
-  int src = flash_drive+lba*FLASHFS_SECTOR_SIZE+offset;
-  return read_flash(buffer, src, bufsize);
+  int block = flash_drive+lba*FLASHFS_SECTOR_SIZE;
+  int src = block+offset;
+  bool in_block = offset+bufsize<=FLASHFS_SECTOR_SIZE;
+  a2time_t now = rtc_read();
+  int32_t count;
+  // Only time between closely spaced requests counts toward throughput.
+  if(now-msc_last_read<MSC_IDLE_MS) {
+    msc_stats.active_ms += now-msc_last_read;
+  }
+  msc_last_read = now;
+  if((int)lba!=msc_block_lba && src==msc_next_address && in_block) {
+    // Host is streaming. Fetch the rest of this sector now. A busy flash
+    // returns 0 and leaves the block invalid so the host simply retries.
+    if(read_flash(msc_block, block, FLASHFS_SECTOR_SIZE)) {
+      msc_block_lba = lba;
+      ++msc_stats.blocks_prefetched;
+    }
+  }
+  if((int)lba==msc_block_lba && in_block) {
+    memcpy(buffer, msc_block+offset, bufsize);
+    msc_stats.bytes_cached += bufsize;
+    count = bufsize;
+  } else {
+    count = read_flash(buffer, src, bufsize);
+  }
+  if(count>0) {
+    msc_stats.bytes_read += count;
+    msc_next_address = src+count;
+  }
+  trace(trace_usb, trace_usb_msc_read, count);
+  return count;
 }
 
 // WRITE10 command is received.
@@ -141,6 +203,8 @@ int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buff
 int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t* buffer, uint32_t bufsize)
 {
   (void)lun;
+  // write_flash() discards the read-ahead block
+  trace(trace_usb, trace_usb_msc_write, bufsize);
   return write_flash(flash_drive+lba*FLASHFS_SECTOR_SIZE+offset,
       buffer, bufsize);
 }
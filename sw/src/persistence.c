@@ -41,8 +41,6 @@ void persistence_init(void) {
 }
 
 void dump_persistence(void) {
-  int n;
-  int c;
   // Ensure integrity of persistance file pointer and reset if corrupted
   if(persistence!=&_end.persistent) {
     fprintf(stderr, "corrupt P %08x->%08x ", (unsigned int)persistence,
@@ -55,27 +53,10 @@ void dump_persistence(void) {
     persistence_init();
     persistence->tail=persistence->_max;
   }
-  c=fgetc(persistence);
   tud_cdc_n_write_str(cdc_tty, "\r\n");
-  while(c != EOF) {
+  while(cangetc(persistence)) {
     // Fill as much of the USB buffer as we can
-    n = tud_cdc_n_write_available(cdc_tty);
-    while(n-->0) {
-      if(c=='\n') {
-        if(!n) {
-          break;
-        }
-        // Add the <CR> in <CR><LF>
-        tud_cdc_n_write_char(cdc_tty, '\r');
-        n--;
-      }
-      tud_cdc_n_write_char(cdc_tty, c);
-      c=fgetc(persistence);
-      if(c == EOF) {
-        break;
-      }
-    }
-    tud_cdc_n_write_flush(cdc_tty);
+    tty_drain(persistence, cdc_tty);
     // Run TUD task which transfers the partial log to the host
     yield();
   }
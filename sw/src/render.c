@@ -0,0 +1,231 @@
+//
+// render.c - Part of a2fomu - Copyright (c) 2020-2021 Doug Eaton
+//
+// This file is part of a2fomu which is released under the two clause BSD
+// licence.  See file LICENSE in the project root directory or visit the
+// project at https://github.com/elecbrick/a2fomu for full license details.
+
+// Shadow framebuffer renderer for the 40x24 text screen.
+//
+// A copy of the text page as last sent is kept in screen memory form so rows
+// can be compared a word at a time. Changed characters are sent after the
+// cheapest cursor motion, runs of unchanged ones are skipped over when that
+// costs less than sending them again and a blank end of line becomes an erase.
+// A scroll of the whole screen is recognised and sent as a single newline.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <motion.h>
+#include <render.h>
+
+#define ROW_WORDS (MOTION_COLUMNS/4)
+
+// Normal video space as stored in screen memory.
+#define A2_SPACE 0xA0
+
+// Unchanged characters are only skipped over if there are at least this many
+// as CSI n C costs three bytes plus the digits.
+#define RENDER_GAP 5
+
+// Passes to wait for the 6502 to finish copying the rows of a scroll, which
+// takes it about 15ms, before giving up and sending them as they are.
+#define RENDER_SCROLL_WAIT 20
+
+// What the terminal shows, in screen memory form.
+static uint32_t shadow[MOTION_ROWS][ROW_WORDS];
+int render_v, render_h;
+static int cursor_v=-1, cursor_h;
+static int scroll_wait;
+
+// Screen memory holds three rows in each of eight 128 byte blocks.
+static const uint32_t *text_row(const void *vram, int v) {
+  return (const uint32_t*)((const uint8_t*)vram+(v&7)*128+(v>>3)*40);
+}
+
+// Inverse and flashing characters are shown as normal ones.
+static int ascii(int c) {
+  return c&0x20 ? c&0x3f : (c&0x1f)|0x40;
+}
+
+static int same_row(const uint32_t *a, const uint32_t *b) {
+  int w;
+  for(w=0; w<ROW_WORDS && a[w]==b[w]; w++) {
+  }
+  return w==ROW_WORDS;
+}
+
+static void move_to(FILE *stream, int v, int h) {
+  cursor_motion(stream, render_v, render_h, v, h);
+  render_v = v;
+  render_h = h;
+}
+
+void render_reset(void) {
+  memset(shadow, A2_SPACE, sizeof(shadow));
+  render_v = 0;
+  render_h = 0;
+  cursor_v = -1;
+  scroll_wait = 0;
+}
+
+//-----------------------------------------------------------------------
+// The text page has moved up a line if each row matches the one below it in
+// the shadow. The last may not as it could have been finished off after the
+// terminal was last updated. Newline at the bottom does the same on the
+// terminal, leaving only the new last rows to be sent. Returns 1 once that
+// is done and 0 if it is not a scroll. While the 6502 is still copying, with
+// one row part way and those below it still as shown, it returns -1 as the
+// rows should not be sent as they are.
+//-----------------------------------------------------------------------
+static int scroll(FILE *stream, const void *vram) {
+  const uint8_t *row, *shown, *below;
+  int v, w, h, moved = 0, copying;
+  for(v=0; v<MOTION_ROWS-1 && same_row(text_row(vram, v), shadow[v+1]); v++) {
+    moved |= !same_row(shadow[v], shadow[v+1]);
+  }
+  if(v<MOTION_ROWS-1) {
+    // Each character of a row being copied is either the old or the new one
+    row = (const uint8_t*)text_row(vram, v);
+    shown = (const uint8_t*)shadow[v];
+    below = (const uint8_t*)shadow[v+1];
+    copying = moved;
+    for(h=0; h<MOTION_COLUMNS && (row[h]==shown[h] || row[h]==below[h]); h++) {
+      copying |= row[h]!=shown[h];
+    }
+    if(copying && h==MOTION_COLUMNS) {
+      for(w=v+1; w<MOTION_ROWS-1 && same_row(text_row(vram, w), shadow[w]);
+          w++) {
+      }
+      if(w==MOTION_ROWS-1) {
+        return -1;
+      }
+    }
+    if(v<MOTION_ROWS-2) {
+      return 0;
+    }
+  }
+  if(!moved) {
+    return 0;
+  }
+  move_to(stream, MOTION_ROWS-1, 0);
+  putc('\n', stream);
+  for(v=0; v<MOTION_ROWS-1; v++) {
+    for(w=0; w<ROW_WORDS; w++) {
+      shadow[v][w] = shadow[v+1][w];
+    }
+  }
+  memset(shadow[MOTION_ROWS-1], A2_SPACE, sizeof(shadow[0]));
+  if(cursor_v>=0) {
+    cursor_v--;
+  }
+  return 1;
+}
+
+//-----------------------------------------------------------------------
+// Bring one row of the terminal up to date. The row is copied first as the
+// 6502 keeps running; the shadow must hold exactly what was sent. Returns
+// nonzero if anything was.
+//-----------------------------------------------------------------------
+static int update_row(FILE *stream, const uint32_t *vram_row, int v) {
+  uint32_t row[ROW_WORDS];
+  const uint8_t *next = (const uint8_t*)row;
+  const uint8_t *shown = (const uint8_t*)shadow[v];
+  char text[MOTION_COLUMNS];
+  int w, h, first, last, blank, end, gap, n;
+
+  for(w=0; w<ROW_WORDS; w++) {
+    row[w] = vram_row[w];
+  }
+  for(w=0; w<ROW_WORDS && row[w]==shadow[v][w]; w++) {
+  }
+  if(w==ROW_WORDS) {
+    return 0;
+  }
+  for(first=w*4; next[first]==shown[first]; first++) {
+  }
+  for(w=ROW_WORDS-1; row[w]==shadow[v][w]; w--) {
+  }
+  for(last=w*4+3; next[last]==shown[last]; last--) {
+  }
+  // Any flashing character is taken to be the cursor
+  for(h=first; h<=last; h++) {
+    if((next[h]&0xC0)==0x40) {
+      cursor_v = v;
+      cursor_h = h;
+    } else if(cursor_v==v && cursor_h==h) {
+      cursor_v = -1;
+    }
+  }
+  // Blank end of the row, erased if that is shorter than sending spaces
+  for(blank=MOTION_COLUMNS; blank>first && ascii(next[blank-1])==' ';
+      blank--) {
+  }
+  end = last-blank+1>3 ? blank : last+1;
+
+  move_to(stream, v, first);
+  n = 0;
+  for(h=first; h<end; h++) {
+    if(next[h]==shown[h]) {
+      for(gap=h; gap<end && next[gap]==shown[gap]; gap++) {
+      }
+      if(gap-h>=RENDER_GAP) {
+        // Cheaper to move past them than to send them again
+        if(n) {
+          fwrite(text, 1, n, stream);
+          render_h += n;
+          n = 0;
+        }
+        move_to(stream, v, gap);
+        h = gap-1;
+        continue;
+      }
+    }
+    text[n++] = ascii(next[h]);
+  }
+  if(n) {
+    fwrite(text, 1, n, stream);
+    render_h += n;
+  }
+  if(end<=last) {
+    fputs("\033[K", stream);
+  }
+  for(w=0; w<ROW_WORDS; w++) {
+    shadow[v][w] = row[w];
+  }
+  return 1;
+}
+
+uint32_t render_update(FILE *stream, const void *vram, uint32_t rows) {
+  int v, sent = 0;
+  if((rows&1) && canputc(stream)>=RENDER_ROW_MAX) {
+    switch(scroll(stream, vram)) {
+    case 1:
+      scroll_wait = 0;
+      rows = RENDER_ALL_ROWS;
+      sent = 1;
+      break;
+    case -1:
+      // Part way through a scroll; try again next time
+      if(scroll_wait++<RENDER_SCROLL_WAIT) {
+        return rows;
+      }
+      break;
+    default:
+      scroll_wait = 0;
+    }
+  }
+  for(v=0; v<MOTION_ROWS; v++) {
+    if(rows & (1<<v)) {
+      if(canputc(stream)<RENDER_ROW_MAX+MOTION_MAX) {
+        break;
+      }
+      sent |= update_row(stream, text_row(vram, v), v);
+      rows &= ~(1<<v);
+    }
+  }
+  if(sent && cursor_v>=0) {
+    move_to(stream, cursor_v, cursor_h);
+  }
+  return rows;
+}
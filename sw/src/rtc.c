@@ -73,6 +73,16 @@ int yield_max = 1000;    // 1.0 seconds
 a2time_t yield_timeout;
 
 
+// Low 32 bits of the cycle counter. Enough to time short intervals without
+// the multiplication activetime() may need.
+uint32_t rtc_cycles(void) {
+#ifdef RISCV_CSR_MCYCLE
+  return csrr(mcycle);
+#else
+  return (uint32_t)activetime();
+#endif
+}
+
 void timer_isr(void) {
   system_ticks++;
   timer0_ev_pending_write(1);
@@ -9,6 +9,8 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <string.h>
+#include <a2fomu.h>
+#include <fsfat.h>
 
 FILE _file[FOPEN_MAX];
 static unsigned char _buffer[FOPEN_MAX][BUFSIZ];
@@ -64,6 +66,17 @@ int fileno(FILE *stream) {
  * Unbuffered, Non-blocking C89 compatible output of characters and strings   *
  * Returns immediately with EOF if output buffer is full                      *
  *============================================================================*/
+// Wake the task that empties a standard stream when data first arrives.
+static void stream_wake(FILE *stream) {
+  if(stream==stdin) {
+    task_ready(keyboard_task_active);
+  } else if(stream==stdout) {
+    task_ready(tty_task_active);
+  } else if(stream==stderr) {
+    task_ready(disk_task_active);
+  }
+}
+
 int fputc(int c, FILE *stream) {
   int rollback;
   if(!stream->buffer) {
@@ -83,6 +96,8 @@ int fputc(int c, FILE *stream) {
     stream->tail = rollback;
     errno = EAGAIN;
     c = EOF; // queue full
+  } else if(rollback == stream->head) {
+    stream_wake(stream);
   }
   return c; // success
 }
@@ -112,7 +127,7 @@ int canputc(FILE *stream) {
   if(stream->head > stream->tail) {
     return stream->head-stream->tail-1;
   }
-  return stream->_max-stream->head+stream->tail+1;
+  return stream->_max-stream->tail+stream->head;
 }
 
 /*============================================================================*
@@ -194,6 +209,63 @@ int cangetc(FILE *stream) {
   return stream->head != stream->tail;
 }
 
+/*============================================================================*
+ * Direct access to the ring buffer of a character stream. A span is the      *
+ * longest run of bytes that can be written or read without wrapping. After   *
+ * filling or consuming part or all of it, commit the number of bytes used.   *
+ * A span length of 0 means the buffer is full or empty respectively.         *
+ *============================================================================*/
+size_t fputspan(FILE *stream, unsigned char **span) {
+  int end;
+  if(!stream->buffer) {
+    if(!stdio_initialized) {       // Initialize library on first access
+      _init_stdio();
+    }
+    if(!stream->buffer) {  // Second check now that library has been initialized
+      errno = EBADF;
+      *span = NULL;
+      return 0;
+    }
+  }
+  *span = stream->buffer+stream->tail;
+  if(stream->head > stream->tail) {
+    return stream->head-stream->tail-1;
+  }
+  // Up to the end of the buffer but the slot before head must stay empty.
+  end = stream->_max+1-stream->tail;
+  return stream->head==0 ? end-1 : end;
+}
+
+void fputcommit(FILE *stream, size_t n) {
+  int was_empty = stream->tail == stream->head;
+  stream->tail += n;
+  if(stream->tail > stream->_max) {
+    stream->tail = 0;
+  }
+  if(n && was_empty) {
+    stream_wake(stream);
+  }
+}
+
+size_t fgetspan(FILE *stream, const unsigned char **span) {
+  if(!stream->buffer) {
+    *span = NULL;
+    return 0;
+  }
+  *span = stream->buffer+stream->head;
+  if(stream->tail >= stream->head) {
+    return stream->tail-stream->head;
+  }
+  return stream->_max+1-stream->head;
+}
+
+void fgetcommit(FILE *stream, size_t n) {
+  stream->head += n;
+  if(stream->head > stream->_max) {
+    stream->head = 0;
+  }
+}
+
 enum pad {
   pad_left=0,
   pad_right=1,
@@ -238,32 +310,59 @@ static int format_s(FILE *out, const char *string, int width, int pad) {
 // and terminating NULL
 #define PRINT_BUF_LEN 12
 
+// The processor has no divide instruction so numbers are converted without
+// one. Decimal digits are found by repeatedly subtracting powers of ten, at
+// most nine times per digit, and hexadecimal digits are extracted by shifting.
+static const unsigned int power_of_ten[10] = {
+  1000000000, 100000000, 10000000, 1000000, 100000, 10000, 1000, 100, 10, 1
+};
+
+static char *format_dec(char *s, unsigned int u) {
+  int k = 0;
+  char digit;
+  while(k<9 && u<power_of_ten[k]) {
+    k++;
+  }
+  for( ; k<10; k++) {
+    for(digit='0'; u>=power_of_ten[k]; digit++) {
+      u -= power_of_ten[k];
+    }
+    *s++ = digit;
+  }
+  return s;
+}
+
+static char *format_hex(char *s, unsigned int u, int letbase) {
+  int shift, t;
+  for(shift=28; shift>0 && !(u>>shift); shift-=4)
+    ;
+  for( ; shift>=0; shift-=4) {
+    t = (u>>shift)&0xF;
+    *s++ = t<10 ? t+'0' : t-10+letbase;
+  }
+  return s;
+}
+
 static int format_n(FILE *out, int i, int b, int sign,
     int width, int pad, int letbase)
 {
   char print_buf[PRINT_BUF_LEN];
   char *s;
-  int t, negative=0, chars_printed=0;
+  int negative=0, chars_printed=0;
   unsigned int u=i;
 
-  if(i==0) {
-    print_buf[0] = '0';
-    print_buf[1] = '\0';
-    return format_s(out, print_buf, width, pad);
-  }
   if(sign && b==10 && i<0) {
     negative = 1;
     u = -i;
   }
-  s = print_buf + PRINT_BUF_LEN-1;
-  *s = '\0';
-  while(u) {
-    t = u%b;
-    if(t>=10)
-      t += letbase-'0'-10;
-    *--s = t+'0';
-    u /= b;
+  // Digits start one byte in to leave room for the sign.
+  if(b==16) {
+    s = format_hex(print_buf+1, u, letbase);
+  } else {
+    s = format_dec(print_buf+1, u);
   }
+  *s = '\0';
+  s = print_buf+1;
   if(negative) {
     if(width && (pad & pad_zero)) {
       fputc('-', out);
@@ -276,7 +375,6 @@ static int format_n(FILE *out, int i, int b, int sign,
   return chars_printed + format_s(out, s, width, pad);
 }
 
-
 int vfprintf(FILE *file, const char *format, va_list ap) {
                //__attribute__ ((format (printf, 2, 0)))
   int width, pad;
@@ -302,8 +400,7 @@ int vfprintf(FILE *file, const char *format, va_list ap) {
         pad |= pad_zero;
       }
       for( ; *format>='0' && *format<='9'; format++) {
-        width *= 10;
-        width += *format-'0';
+        width = (width<<3) + (width<<1) + *format-'0';
       }
       if(*format=='s') {
         char *s = va_arg(ap, char*);
@@ -384,24 +481,146 @@ int sprintf(char *str, const char *format, ...) {
   return rc;
 }
 
-#ifdef FWRITE_IN_STDIO
-// TODO These routines still need to be implemented
+/*============================================================================*
+ * Nonstandard: ANSI cursor positioning without the general formatter. These  *
+ * are the most frequent output of the video path. Either the whole sequence  *
+ * is queued or nothing is, in which case EOF is returned and errno set.      *
+ *============================================================================*/
+// Rows and columns almost always have one or two digits.
+static char *format_small(char *s, unsigned int n) {
+  char digit;
+  if(n>=100) {
+    return format_dec(s, n);
+  }
+  if(n>=10) {
+    for(digit='0'; n>=10; digit++) {
+      n -= 10;
+    }
+    *s++ = digit;
+  }
+  *s++ = n+'0';
+  return s;
+}
+
+// Queued only if it all fits so that a sequence is never split. Checking the
+// room first lets fwrite() copy bytes without the multiply and divide it
+// needs to keep elements larger than a byte whole.
+int fputseq(FILE *stream, const char *seq, int n) {
+  unsigned char *span;
+  // Opens the stream on first use, as fputc() would
+  (void)fputspan(stream, &span);
+  if(canputc(stream)<n) {
+    errno = EAGAIN;
+    return EOF;
+  }
+  return fwrite(seq, 1, n, stream)==(size_t)n ? n : EOF;
+}
+
+// CSI CUP Cursor Position. Equivalent to printf("\033[%d;%dH", row, column).
+int ansi_cursor(FILE *stream, int row, int column) {
+  char seq[2+10+1+10+1];
+  char *s = seq;
+  *s++ = '\033';
+  *s++ = '[';
+  s = format_small(s, row);
+  *s++ = ';';
+  s = format_small(s, column);
+  *s++ = 'H';
+  return fputseq(stream, seq, s-seq);
+}
+
+// CSI CHA Cursor Horizontal Absolute. Same as printf("\033[%dG", column).
+int ansi_column(FILE *stream, int column) {
+  char seq[2+10+1];
+  char *s = seq;
+  *s++ = '\033';
+  *s++ = '[';
+  s = format_small(s, column);
+  *s++ = 'G';
+  return fputseq(stream, seq, s-seq);
+}
+
+/*============================================================================*
+ * Block input and output. Files on flash go straight to read() and write().  *
+ * Character streams are non-blocking: only whole elements are transferred   *
+ * and as many as fit are, with errno set to EAGAIN if that is not all.       *
+ *============================================================================*/
 size_t fread(void *ptr, size_t size, size_t nmemb, FILE *stream) {
-  (void)ptr;
-  (void)size;
-  (void)nmemb;
-  (void)stream;
-  return 0;
+  unsigned char *dst = ptr;
+  const unsigned char *span;
+  size_t total, done, n;
+  ssize_t rc;
+
+  total = size==1 ? nmemb : size*nmemb;
+  if(stream->device==a2dev_flash) {
+    rc = read(fileno(stream), ptr, total);
+    if(rc<0) {
+      stream->_flags |= __SERR;
+      return 0;
+    }
+    if((size_t)rc<total) {
+      stream->_flags |= __SEOF;
+    }
+    return size==1 ? (size_t)rc : rc/size;
+  }
+  if(size!=1) {
+    // Do not split an element. Count what is buffered across the wrap.
+    n = fgetspan(stream, &span);
+    if(n<total && stream->tail<stream->head) {
+      n += stream->tail;
+    }
+    if(n<total) {
+      total = n/size*size;
+    }
+  }
+  for(done=0; done<total && (n=fgetspan(stream, &span)); done+=n) {
+    if(n>total-done) {
+      n = total-done;
+    }
+    memcpy(dst+done, span, n);
+    fgetcommit(stream, n);
+  }
+  if(done<size*nmemb) {
+    errno = EAGAIN;
+  }
+  return size==1 ? done : done/size;
 }
 
 size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream) {
-  (void)ptr;
-  (void)size;
-  (void)nmemb;
-  (void)stream;
-  return 0;
+  const unsigned char *src = ptr;
+  unsigned char *span;
+  size_t total, done, n;
+  ssize_t rc;
+
+  total = size==1 ? nmemb : size*nmemb;
+  if(stream->device==a2dev_flash) {
+    rc = write(fileno(stream), ptr, total);
+    if(rc<0) {
+      stream->_flags |= __SERR;
+      return 0;
+    }
+    return size==1 ? (size_t)rc : rc/size;
+  }
+  if(size!=1) {
+    // Do not split an element.
+    (void)fputspan(stream, &span);
+    n = canputc(stream);
+    if(n<total) {
+      total = n/size*size;
+    }
+  }
+  for(done=0; done<total && (n=fputspan(stream, &span)); done+=n) {
+    if(n>total-done) {
+      n = total-done;
+    }
+    memcpy(span, src+done, n);
+    fputcommit(stream, n);
+  }
+  if(done<size*nmemb) {
+    errno = EAGAIN;
+  }
+  return size==1 ? done : done/size;
 }
-#endif
 
 
 #ifdef PERROR_IN_STDIO
@@ -73,6 +73,21 @@ void *memcpy(void *dest, const void *src, size_t n) {
 }
 #endif
 
+#ifdef USE_PRIVATE_MEMCMP
+int memcmp(const void *s1, const void *s2, size_t n) {
+  const unsigned char *p1 = s1;
+  const unsigned char *p2 = s2;
+  while(n-->0) {
+    if(*p1!=*p2) {
+      return *p1-*p2;
+    }
+    p1++;
+    p2++;
+  }
+  return 0;
+}
+#endif
+
 #ifdef USE_PRIVATE_STRTOK
 char *strtok(char *str, const char *delim) {
   static char *stored;
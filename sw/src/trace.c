@@ -0,0 +1,71 @@
+//
+// trace.c - Part of a2fomu - Copyright (c) 2020-2021 Doug Eaton
+//
+// This file is part of a2fomu which is released under the two clause BSD
+// licence.  See file LICENSE in the project root directory or visit the
+// project at https://github.com/elecbrick/a2fomu for full license details.
+
+// Ring of binary trace events. Recording an event costs a few dozen cycles
+// so it is left enabled; the ring always holds the most recent events.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <irq.h>
+#include <tusb.h>
+#include <a2fomu.h>
+#include <trace.h>
+
+static struct trace_event trace_ring[TRACE_EVENTS];
+static unsigned int trace_next;         // Total events recorded
+int trace_enabled = 1;
+
+//-----------------------------------------------------------------------
+// Record an event. Called from both tasks and the interrupt handler, so the
+// slot is claimed with interrupts disabled.
+//-----------------------------------------------------------------------
+void trace(enum trace_type type, int id, int arg) {
+  struct trace_event *event;
+  int ie;
+  if(!trace_enabled) {
+    return;
+  }
+  ie = irq_getie();
+  irq_setie(0);
+  event = &trace_ring[trace_next++ & (TRACE_EVENTS-1)];
+  event->time = csrr(mcycle);
+  event->type = type;
+  event->id = id;
+  event->arg = arg;
+  irq_setie(ie);
+}
+
+//-----------------------------------------------------------------------
+// Write the ring, oldest first, as one line of hex per event framed by
+// "trace <count>" and "end". Recording stops meanwhile so the dump does not
+// overwrite what it is showing. The output is far larger than the stdout
+// buffer so it is pushed to the USB tty directly while the CLI waits.
+//-----------------------------------------------------------------------
+void trace_dump(FILE *stream) {
+  unsigned int i, first, count;
+  struct trace_event *event;
+  int enabled = trace_enabled;
+  trace_enabled = 0;
+  count = trace_next<TRACE_EVENTS ? trace_next : TRACE_EVENTS;
+  first = trace_next-count;
+  fprintf(stream, "trace %d\n", count);
+  for(i=first; i<first+count; i++) {
+    while(canputc(stream)<20) {
+      if(stream->device!=a2dev_usb || !tud_cdc_n_connected(stream->minor)) {
+        trace_enabled = enabled;
+        return;
+      }
+      tty_drain(stream, stream->minor);
+      yield();
+    }
+    event = &trace_ring[i & (TRACE_EVENTS-1)];
+    fprintf(stream, "%08x%02x%02x%04x\n", (unsigned)event->time,
+        event->type, event->id, event->arg);
+  }
+  fputs("end\n", stream);
+  trace_enabled = enabled;
+}
@@ -79,6 +79,8 @@ enum
   ITF_NUM_CDC_TTY_DATA,
   ITF_NUM_CDC_FLOPPY,
   ITF_NUM_CDC_FLOPPY_DATA,
+  ITF_NUM_CDC_VIDEO,
+  ITF_NUM_CDC_VIDEO_DATA,
 #if CFG_TUD_MSC > 0
   ITF_NUM_MSC,
   #else
@@ -96,6 +98,8 @@ enum
 #define EPNUM_CDC_FLOPPY_NOTIF  0x83
 #define EPNUM_CDC_FLOPPY_DATA   0x04
 #define EPNUM_MSC               0x05
+#define EPNUM_CDC_VIDEO_NOTIF   0x86
+#define EPNUM_CDC_VIDEO_DATA    0x07
 
 uint8_t const desc_fs_configuration[] =
 {
@@ -105,6 +109,7 @@ uint8_t const desc_fs_configuration[] =
   // Interface number, string index, EP notification address and size, EP data address (out, in) and size.
   TUD_CDC_DESCRIPTOR(ITF_NUM_CDC_TTY, 4, EPNUM_CDC_TTY_NOTIF, 8, EPNUM_CDC_TTY_DATA, 0x80 | EPNUM_CDC_TTY_DATA, 64),
   TUD_CDC_DESCRIPTOR(ITF_NUM_CDC_FLOPPY, 4, EPNUM_CDC_FLOPPY_NOTIF, 8, EPNUM_CDC_FLOPPY_DATA, 0x80 | EPNUM_CDC_FLOPPY_DATA, 64),
+  TUD_CDC_DESCRIPTOR(ITF_NUM_CDC_VIDEO, 7, EPNUM_CDC_VIDEO_NOTIF, 8, EPNUM_CDC_VIDEO_DATA, 0x80 | EPNUM_CDC_VIDEO_DATA, 64),
 
 #if CFG_TUD_MSC > 0
   // Interface number, string index, EP Out & EP In address, EP size
@@ -138,6 +143,7 @@ char const* string_desc_arr [] =
 #if CFG_TUD_MSC > 0
   "A2Fomu MSC",                  // 6: MSC Interface: Flash Drive (device)
 #endif
+  "A2Fomu Video",                // 7: CDC Interface: Graphics frames
 };
 
 static uint16_t _desc_str[32];